@@ -52,6 +52,34 @@
 	#include <sys/prctl.h>
 #endif
 
+#if HAVE_TIME_H
+	#include <time.h>
+#endif
+
+#if HAVE_ERRNO_H
+	#include <errno.h>
+#endif
+
+#if HAVE_FCNTL_H
+	#include <fcntl.h>
+#endif
+
+#if HAVE_SIGNAL_H
+	#include <signal.h>
+#endif
+
+#if HAVE_SYS_SIGNALFD_H
+	#include <sys/signalfd.h>
+#endif
+
+#if HAVE_SYS_SYSCALL_H
+	#include <sys/syscall.h>
+#endif
+
+#if HAVE_PTHREAD_H
+	#include <pthread.h>
+#endif
+
 #if !defined(UINT32_C)
 	#warning UINT32_C not defined
 	#define UINT32_C(x) x
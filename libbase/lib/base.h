@@ -53,6 +53,16 @@ extern "C" {
 	#define unlikely(x)			(x)
 #endif
 
+/**
+ * Memory barrier for data shared with other processes
+ */
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1)
+	#define ngim_barrier()		__sync_synchronize()
+#else
+	/* Keeps the compiler from reordering, which is enough on x86 */
+	#define ngim_barrier()		__asm__ __volatile__ ("" : : : "memory")
+#endif
+
 /**
  * @defgroup base-global-vars Global variables
  * @{
@@ -158,6 +168,26 @@ extern void ngim_setprogname(const char *name);
  */
 extern void ngim_seterrorlevel(int level);
 
+/**
+ * Sets how error messages are written.
+ * @param[in] mode Zero, or a combination of #NGIM_ERROR_STRUCTURED and
+ *   #NGIM_ERROR_NONBLOCK.
+ * @see ngim_error6()
+ */
+extern void ngim_seterrormode(int mode);
+
+/**
+ * Returns the mode set with ngim_seterrormode().
+ */
+extern int ngim_geterrormode(void);
+
+/**
+ * Returns the number of messages dropped in non-blocking mode since the
+ * last message that was written.
+ * @see #NGIM_ERROR_NONBLOCK
+ */
+extern apr_uint32_t ngim_errordropped(void);
+
 /**
  * Reports an error consisting of up to six message parts.
  * @param[in] level Error level.
@@ -168,8 +198,11 @@ extern void ngim_seterrorlevel(int level);
  * @param[in] s5 A message string, or NULL if there is none.
  * @param[in] s6 A message string, or NULL if there is none.
  * @remarks Messages are always written to g_apr_stderr and prepended
- *          by a name if one is set.
+ *          by a name if one is set. Each message is written with a single
+ *          write of at most 512 bytes, so messages from processes sharing
+ *          a pipe don't mix.
  * @see ngim_setprogname()
+ * @see ngim_seterrormode()
  */
 extern void ngim_error6(int level, const char *s1, const char *s2,
 		const char *s3, const char *s4, const char *s5, const char *s6);
@@ -227,6 +260,18 @@ extern void __noreturn ngim_die_aprerror4(apr_status_t status, const char *s1,
 
 #define NGIM_ENV_ERROR_LEVEL	"NGIM_ERROR_LEVEL"
 
+/**
+ * Error mode flags
+ */
+
+/** messages are written as level=... program="..." message="..." */
+#define NGIM_ERROR_STRUCTURED	1
+/** messages other than #FATAL are dropped if stderr is full */
+#define NGIM_ERROR_NONBLOCK		2
+
+/** comma-separated list of text, structured and nonblock */
+#define NGIM_ENV_ERROR_MODE		"NGIM_ERROR_MODE"
+
 /**
  * Error reporting macros
  */
@@ -503,6 +548,129 @@ typedef struct ngim_tain {
 /** External textual TAI64N format size in bytes without a terminating NUL */
 #define NGIM_TAIN_FORMAT	(2 * NGIM_TAIN_PACK + 1)
 
+/** The maximum value for seconds in a TAI64 label, 2^63 - 1 */
+#define NGIM_TAI_MAX_SEC	APR_UINT64_C(9223372036854775807)
+/** The maximum value for nanoseconds in a TAI64N label */
+#define NGIM_TAI_MAX_NANO	999999999
+
+/** Set in ngim_tai_hex_value for characters that are not hex digits */
+#define NGIM_TAI_HEX_BAD	0x10
+
+/**
+ * Values of the lowercase hex digits used in external textual labels,
+ * indexed by character. Other characters have #NGIM_TAI_HEX_BAD set.
+ */
+extern const unsigned char ngim_tai_hex_value[256];
+
+/** Each byte as two lowercase hex digits, indexed by twice the byte */
+extern const char ngim_tai_hex_pair[512];
+
+/*
+ * Inline functions
+ */
+
+/**
+ * Writes x as 2 * bytes lowercase hex digits.
+ * @param[out] s Pointer to an array of at least 2 * bytes characters.
+ * @param[in] x The value.
+ * @param[in] bytes The number of least significant bytes in x to write.
+ */
+static inline void ngim_tai_encode_hex(char *s, apr_uint64_t x, int bytes)
+{
+	const char *p;
+
+	while (--bytes >= 0) {
+		p = &ngim_tai_hex_pair[2 * (x & 0xFF)];
+		s[2 * bytes]     = p[0];
+		s[2 * bytes + 1] = p[1];
+		x >>= 8;
+	}
+}
+
+/**
+ * Reads 2 * bytes lowercase hex digits.
+ * @param[in] s Pointer to an array of at least 2 * bytes characters.
+ * @param[out] x Result.
+ * @param[in] bytes The number of bytes to read.
+ * @return Non-zero if all the characters were hex digits.
+ */
+static inline int ngim_tai_decode_hex(const char *s, apr_uint64_t *x,
+		int bytes)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	const unsigned char *end = p + 2 * bytes;
+	unsigned int a, b, bad = 0;
+	apr_uint64_t y = 0;
+
+	/* Invalid characters are noticed once at the end, which leaves the
+	 * loop without branches */
+	for (; p < end; p += 2) {
+		a = ngim_tai_hex_value[p[0]];
+		b = ngim_tai_hex_value[p[1]];
+		bad |= a | b;
+		y = (y << 8) | (a << 4) | (b & 0xF);
+	}
+
+	*x = y;
+	return !(bad & NGIM_TAI_HEX_BAD);
+}
+
+/**
+ * Inline version of ngim_tai_format.
+ * @param[out] s Pointer to an array of at least #NGIM_TAI_FORMAT bytes.
+ * @param[in] t A label.
+ */
+static inline void ngim_tai_encode(char *s, const ngim_tai_t *t)
+{
+	s[0] = '@';
+	ngim_tai_encode_hex(&s[1], t->x, NGIM_TAI_PACK);
+}
+
+/**
+ * Inline version of ngim_tai_unformat.
+ * @param[in] s Pointer to an array of at least #NGIM_TAI_FORMAT bytes.
+ * @param[out] t A label.
+ * @return Non-zero if s is a valid TAI64 label.
+ */
+static inline int ngim_tai_decode(const char *s, ngim_tai_t *t)
+{
+	return (s[0] == '@' && ngim_tai_decode_hex(&s[1], &t->x,
+				NGIM_TAI_PACK) && t->x <= NGIM_TAI_MAX_SEC);
+}
+
+/**
+ * Inline version of ngim_tain_format.
+ * @param[out] s Pointer to an array of at least #NGIM_TAIN_FORMAT bytes.
+ * @param[in] t A label.
+ */
+static inline void ngim_tain_encode(char *s, const ngim_tain_t *t)
+{
+	ngim_tai_encode(s, &t->sec);
+	ngim_tai_encode_hex(&s[NGIM_TAI_FORMAT], t->nano,
+		NGIM_TAIN_PACK - NGIM_TAI_PACK);
+}
+
+/**
+ * Inline version of ngim_tain_unformat.
+ * @param[in] s Pointer to an array of at least #NGIM_TAIN_FORMAT bytes.
+ * @param[out] t A label.
+ * @return Non-zero if s is a valid TAI64N label.
+ */
+static inline int ngim_tain_decode(const char *s, ngim_tain_t *t)
+{
+	apr_uint64_t nano;
+
+	if (ngim_tai_decode(s, &t->sec) &&
+			ngim_tai_decode_hex(&s[NGIM_TAI_FORMAT], &nano,
+				NGIM_TAIN_PACK - NGIM_TAI_PACK) &&
+			nano <= NGIM_TAI_MAX_NANO) {
+		t->nano = nano;
+		return 1;
+	}
+
+	return 0;
+}
+
 /*
  * Functions
  */
@@ -526,8 +694,7 @@ extern void ngim_tai_from_apr(ngim_tai_t *t, apr_time_t a);
 /**
  * Sets a TAI64 label to an approximate of the current TAI time.
  * @param[out] t Result.
- * @remarks Equivalent to calling ngim_tai_from_apr using the result of
- *          apr_time_now as a parameter.
+ * @remarks Uses the clock selected with ngim_clock_select.
  * @see #NGIM_TAI_APR_EPOCH
  */
 extern void ngim_tai_now(ngim_tai_t *t);
@@ -602,8 +769,7 @@ extern void ngim_tain_to_tai(const ngim_tain_t *ta, ngim_tai_t *t);
 /**
  * Sets a TAI64N label to an approximate of the current TAI time.
  * @param[out] t Result.
- * @remarks Equivalent to calling ngim_tain_from_apr using the result of
- *          apr_time_now as a parameter.
+ * @remarks Equivalent to ngim_clock_now.
  * @see #NGIM_TAI_APR_EPOCH
  */
 extern void ngim_tain_now(ngim_tain_t *t);
@@ -664,6 +830,298 @@ extern void ngim_tain_format(char *s, const ngim_tain_t *t);
  */
 extern int __must_check ngim_tain_unformat(const char *s, ngim_tain_t *t);
 
+/**
+ * Converts an array of TAI64N labels to the external TAI64 ASCII format.
+ * @param[out] s Pointer to an array of at least n * stride bytes.
+ * @param[in] stride Distance between labels in s, at least
+ *   #NGIM_TAIN_FORMAT.
+ * @param[in] t The labels.
+ * @param[in] n The number of labels.
+ * @remarks Bytes between the labels in s are left untouched.
+ */
+extern void ngim_tain_format_n(char *s, apr_size_t stride,
+		const ngim_tain_t *t, apr_size_t n);
+
+/**
+ * Converts an array of TAI64N labels from the external TAI64 ASCII format.
+ * @param[in] s Pointer to an array of at least n * stride bytes.
+ * @param[in] stride Distance between labels in s, at least
+ *   #NGIM_TAIN_FORMAT.
+ * @param[out] t Result.
+ * @param[in] n The number of labels.
+ * @return The number of valid labels converted before the first invalid
+ *   one, n if all of them are valid.
+ */
+extern apr_size_t __must_check ngim_tain_unformat_n(const char *s,
+		apr_size_t stride, ngim_tain_t *t, apr_size_t n);
+
+/** @} */
+
+/**
+ * @defgroup base-clock Clocks
+ * @{
+ */
+
+/*
+ * Definitions
+ */
+
+/** Nanosecond system time, assumed to be TAI - 10 s as with apr_time_now */
+#define NGIM_CLOCK_REALTIME		0
+/** The kernel's TAI clock, if it knows the offset between TAI and UTC.
+ * Labels are shifted to agree with #NGIM_CLOCK_REALTIME when selected. */
+#define NGIM_CLOCK_TAI			1
+/** System time as of the last timer tick, cheaper to read */
+#define NGIM_CLOCK_COARSE		2
+
+/*
+ * Functions
+ */
+
+/**
+ * Selects the clock used for time stamps by ngim_clock_now, ngim_tain_now
+ * and ngim_tai_now. The default is #NGIM_CLOCK_REALTIME.
+ * @param[in] source #NGIM_CLOCK_REALTIME, #NGIM_CLOCK_TAI or
+ *   #NGIM_CLOCK_COARSE.
+ * @return The clock selected, which is #NGIM_CLOCK_REALTIME if the
+ *   requested one is not available.
+ * @remarks All clocks follow #NGIM_TAI_APR_EPOCH, so labels from different
+ *   clocks and programs can be mixed. #NGIM_CLOCK_TAI is shifted by the
+ *   offset between TAI and UTC at the time it is selected. It doesn't
+ *   repeat a second when a leap second is inserted, but is then a second
+ *   ahead of the others until selected again.
+ */
+extern int ngim_clock_select(int source);
+
+/**
+ * Sets a TAI64N label to the current time from the selected clock.
+ * @param[out] t Result.
+ * @see ngim_clock_select
+ */
+extern void ngim_clock_now(ngim_tain_t *t);
+
+/**
+ * Reads a monotonic clock for timing intervals, which is not affected by
+ * changes to the system time.
+ * @return Microseconds from an arbitrary starting point.
+ */
+extern apr_time_t ngim_clock_monotonic(void);
+
+/** @} */
+
+/**
+ * @defgroup base-wheel Timer wheel
+ * @{
+ */
+
+/*
+ * Types
+ */
+
+/** A hierarchical timer wheel, created with ngim_wheel_create */
+typedef struct ngim_wheel ngim_wheel_t;
+
+/** A timer, usually embedded in the structure it belongs to. Zero the
+ * structure before first use. */
+typedef struct ngim_timer ngim_timer_t;
+
+struct ngim_timer {
+	ngim_timer_t *next;		/**< @internal */
+	ngim_timer_t **prev;	/**< @internal Non-NULL while pending */
+	ngim_wheel_t *wheel;	/**< @internal */
+	apr_time_t deadline;	/**< Time of expiry */
+};
+
+/**
+ * Called for each expired timer.
+ * @param[in] timer The timer, which is no longer pending.
+ * @param[in] data The pointer given to ngim_wheel_expire.
+ */
+typedef void (*ngim_timer_func_t)(ngim_timer_t *timer, void *data);
+
+/*
+ * Functions
+ */
+
+/**
+ * Creates a timer wheel. Timers are kept at millisecond resolution and
+ * adding or cancelling one takes constant time, so a wheel can hold
+ * thousands of them. Times may be from any clock, usually
+ * ngim_clock_monotonic, as long as the same clock is used throughout.
+ * @param[out] wheel Result.
+ * @param[in] now Current time.
+ * @param[in] pool Memory pool for the wheel.
+ * @return Zero if successful, <0 otherwise.
+ */
+extern int __must_check ngim_wheel_create(ngim_wheel_t **wheel,
+		apr_time_t now, apr_pool_t *pool);
+
+/**
+ * Adds a timer to a wheel, or moves a pending one to a new deadline.
+ * @param[in] wheel The wheel.
+ * @param[in] timer The timer, which must stay valid while pending.
+ * @param[in] deadline Time of expiry.
+ */
+extern void ngim_wheel_add(ngim_wheel_t *wheel, ngim_timer_t *timer,
+		apr_time_t deadline);
+
+/**
+ * Removes a timer from its wheel. Does nothing if the timer isn't pending.
+ * @param[in] timer The timer.
+ */
+extern void ngim_timer_cancel(ngim_timer_t *timer);
+
+/**
+ * Tests if a timer is waiting to expire.
+ * @param[in] timer The timer.
+ * @return Non-zero if pending.
+ */
+static inline int ngim_timer_pending(const ngim_timer_t *timer)
+{
+	return (timer->prev != NULL);
+}
+
+/**
+ * Returns how long a poll loop may sleep before calling ngim_wheel_expire.
+ * @param[in] wheel The wheel.
+ * @param[in] now Current time.
+ * @return Time to sleep, or -1 if there are no timers.
+ * @remarks The loop may be woken up before any timer expires, as distant
+ *   timers are moved closer at intervals.
+ */
+extern apr_interval_time_t ngim_wheel_timeout(ngim_wheel_t *wheel,
+		apr_time_t now);
+
+/**
+ * Calls func for each timer that has expired by now. Timers due on the
+ * same millisecond are expired as one batch.
+ * @param[in] wheel The wheel.
+ * @param[in] now Current time.
+ * @param[in] func Function to call.
+ * @param[in] data Passed to func.
+ * @return The number of expired timers.
+ * @remarks func may add and cancel timers, including ones in the same
+ *   batch that have not been called yet.
+ */
+extern apr_size_t ngim_wheel_expire(ngim_wheel_t *wheel, apr_time_t now,
+		ngim_timer_func_t func, void *data);
+
+/** @} */
+
+/**
+ * @defgroup base-loop Event loop
+ * @{
+ */
+
+/*
+ * Types
+ */
+
+/** An event loop, created with ngim_loop_create */
+typedef struct ngim_loop ngim_loop_t;
+
+/** An event watched by a loop */
+typedef struct ngim_event ngim_event_t;
+
+/**
+ * Called when an event occurs.
+ * @param[in] loop The loop.
+ * @param[in] ev The event.
+ * @param[in] data The pointer given when the event was added.
+ */
+typedef void (*ngim_event_func_t)(ngim_loop_t *loop, ngim_event_t *ev,
+		void *data);
+
+/*
+ * Functions
+ */
+
+/**
+ * Creates an event loop.
+ * @param[out] loop Result.
+ * @param[in] pool Memory pool for the loop and its events.
+ * @return Zero if successful, <0 otherwise.
+ */
+extern int __must_check ngim_loop_create(ngim_loop_t **loop,
+		apr_pool_t *pool);
+
+/**
+ * Calls func each time a file has data to read.
+ * @param[in] loop The loop.
+ * @param[in] file The file, which remains owned by the caller.
+ * @param[in] func Function to call.
+ * @param[in] data Passed to func.
+ * @return The event, or NULL in case of failure.
+ */
+extern ngim_event_t * ngim_loop_file(ngim_loop_t *loop, apr_file_t *file,
+		ngim_event_func_t func, void *data);
+
+/**
+ * Calls func from the loop after a signal is received, instead of from a
+ * signal handler. Signals are read from a signalfd where available, so
+ * they are blocked while the process runs; forked children get the
+ * original signal mask back.
+ * @param[in] loop The loop.
+ * @param[in] sig The signal.
+ * @param[in] func Function to call.
+ * @param[in] data Passed to func.
+ * @return The event, or NULL in case of failure.
+ * @remarks Signals are process-wide, so only one loop should watch them.
+ *   Signals of the same kind received close together may be reported
+ *   once.
+ */
+extern ngim_event_t * ngim_loop_signal(ngim_loop_t *loop, int sig,
+		ngim_event_func_t func, void *data);
+
+/**
+ * Calls func once after a time, and then at regular intervals if repeat is
+ * given. Timers run on ngim_clock_monotonic.
+ * @param[in] loop The loop.
+ * @param[in] after Time until the first call.
+ * @param[in] repeat Interval for later calls, or zero to call only once.
+ * @param[in] func Function to call.
+ * @param[in] data Passed to func.
+ * @return The event.
+ */
+extern ngim_event_t * ngim_loop_timer(ngim_loop_t *loop,
+		apr_interval_time_t after, apr_interval_time_t repeat,
+		ngim_event_func_t func, void *data);
+
+/**
+ * Calls func once when a child process exits. The child is not waited
+ * for, the caller should collect its exit status.
+ * @param[in] loop The loop.
+ * @param[in] proc The child process.
+ * @param[in] func Function to call.
+ * @param[in] data Passed to func.
+ * @return The event, or NULL if the system can't watch a single process,
+ *   in which case SIGCHLD should be used instead.
+ */
+extern ngim_event_t * ngim_loop_child(ngim_loop_t *loop, apr_proc_t *proc,
+		ngim_event_func_t func, void *data);
+
+/**
+ * Stops watching an event. Events that occur only once, such as timers
+ * without repeat and children, are removed before their function is
+ * called and must not be cancelled after that, as the memory is reused.
+ * @param[in] ev The event, or NULL.
+ */
+extern void ngim_loop_cancel(ngim_event_t *ev);
+
+/**
+ * Runs the loop until ngim_loop_stop is called or there are no events
+ * left to watch.
+ * @param[in] loop The loop.
+ * @return Zero if stopped, <0 in case of failure.
+ */
+extern int ngim_loop_run(ngim_loop_t *loop);
+
+/**
+ * Makes ngim_loop_run return after the current event.
+ * @param[in] loop The loop.
+ */
+extern void ngim_loop_stop(ngim_loop_t *loop);
+
 /** @} */
 
 /**
@@ -684,6 +1142,43 @@ extern int __must_check ngim_tain_unformat(const char *s, ngim_tain_t *t);
  */
 #define NGIM_ISO8601_FORMAT		33
 
+/** Size of the table of offsets from UTC in a formatting context */
+#define NGIM_ISO8601_OFFSETS		64
+
+/** Length of hh:mm:ss */
+#define NGIM_ISO8601_TIME		8
+
+/** Marks a quarter of an hour during which the offset from UTC changes */
+#define NGIM_ISO8601_MIXED		APR_INT32_MIN
+
+/** Seconds from the epoch to 9999-12-31, beyond which nothing is cached */
+#define NGIM_ISO8601_LAST		APR_INT64_C(253402214400)
+
+/**
+ * Context for converting a series of times, which remembers the date and
+ * time of the last second and day it formatted, and the offsets from UTC
+ * in effect during recently used quarters of an hour. Set up with
+ * ngim_iso8601_context_init, the fields are private.
+ */
+typedef struct iso8601_context {
+	/** Non-zero if formatting in UTC */
+	int utc;
+	/** The last second formatted, and the local day it was on */
+	apr_int64_t second;
+	apr_int64_t day;
+	/** The length of the date in text */
+	int length;
+	/** Date and time of the last second, not NUL-terminated */
+	char text[NGIM_ISO8601_FORMAT];
+	/** Offset from UTC of the last second, NUL-terminated */
+	char zone[8];
+	/** Quarters of an hour since the epoch, and their offsets from UTC */
+	apr_int64_t block[NGIM_ISO8601_OFFSETS];
+	apr_int32_t offset[NGIM_ISO8601_OFFSETS];
+	/** Non-zero for the entries above that have been looked up */
+	char cached[NGIM_ISO8601_OFFSETS];
+} ngim_iso8601_context_t;
+
 /*
  * Functions
  */
@@ -706,6 +1201,171 @@ extern void ngim_iso8601_utc_format(char *s, apr_time_t t);
  */
 extern void ngim_iso8601_local_format(char *s, apr_time_t t);
 
+/**
+ * Sets up a context for formatting or parsing many times in a row with
+ * ngim_iso8601_context_format or ngim_iso8601_context_parse.
+ * @param[out] ctx The context.
+ * @param[in] utc If non-zero, times are in the UTC time zone, otherwise in
+ *   the local time zone.
+ */
+extern void ngim_iso8601_context_init(ngim_iso8601_context_t *ctx, int utc);
+
+/**
+ * Converts apr_time_t to an ISO 8601:2004 string, producing the same result
+ * as ngim_iso8601_utc_format or ngim_iso8601_local_format. The date and
+ * time of the previous call are reused when they haven't changed, and the
+ * time zone is looked up only once for each quarter of an hour, which makes
+ * converting times in order much cheaper.
+ * @param[in,out] ctx The context.
+ * @param[out] s Pointer to an array of at least #NGIM_ISO8601_FORMAT bytes.
+ * @param[in] t The time to convert.
+ * @remarks Always NUL-terminates s. Changes to the time zone while the
+ *   context is in use are not noticed.
+ * @see #NGIM_ISO8601_FORMAT
+ */
+extern void ngim_iso8601_context_format(ngim_iso8601_context_t *ctx,
+		char *s, apr_time_t t);
+
+/**
+ * Parses an ISO 8601:2004 date and time string, such as one written by
+ * ngim_iso8601_utc_format or ngim_iso8601_local_format.
+ * Accepts YYYY[Y]-MM-DD[Thh:mm[:ss[.fff]]][Z|+hh[[:]mm]|-hh[[:]mm]], where
+ * the separator between date and time may also be a space, the fraction
+ * may also follow a comma and have any number of digits, and the time
+ * defaults to midnight.
+ * @param[in] s The string to parse, need not be NUL-terminated.
+ * @param[in] len The length of s.
+ * @param[out] t Result.
+ * @param[in] utc If non-zero, a time without an offset from UTC is in UTC,
+ *   otherwise in the local time zone.
+ * @return The number of bytes parsed from the beginning of s, or zero if
+ *   s does not start with a valid date.
+ * @remarks Precision beyond microseconds is ignored. The time zone is
+ *   looked up for each local time, use ngim_iso8601_context_parse to parse
+ *   many of them.
+ */
+extern apr_size_t __must_check ngim_iso8601_parse(const char *s,
+		apr_size_t len, apr_time_t *t, int utc);
+
+/**
+ * Parses an ISO 8601:2004 date and time string as ngim_iso8601_parse does,
+ * in the time zone the context was set up for. Offsets from UTC are looked
+ * up once for each quarter of an hour, as with
+ * ngim_iso8601_context_format.
+ * @param[in,out] ctx The context.
+ * @param[in] s The string to parse, need not be NUL-terminated.
+ * @param[in] len The length of s.
+ * @param[out] t Result.
+ * @return The number of bytes parsed from the beginning of s, or zero if
+ *   s does not start with a valid date.
+ * @remarks Changes to the time zone while the context is in use are not
+ *   noticed.
+ */
+extern apr_size_t __must_check ngim_iso8601_context_parse(
+		ngim_iso8601_context_t *ctx, const char *s, apr_size_t len,
+		apr_time_t *t);
+
+/** @} */
+
+/**
+ * @defgroup base-convert TAI64 label conversion
+ * @{
+ */
+
+/*
+ * Types and definitions
+ */
+
+/** Convert all labels, not just the ones at the beginning of each line */
+#define NGIM_CONVERT_ALL		1
+
+/**
+ * Formats a label found in the input.
+ * @param[out] s Pointer to an array of at least #NGIM_ISO8601_FORMAT bytes,
+ *               receives a NUL-terminated string.
+ * @param[in] t The label.
+ */
+typedef void (*ngim_convert_format_t)(char *s, const ngim_tain_t *t);
+
+/**
+ * Receives output from a converter.
+ * @param[in] data The pointer given to ngim_convert_init.
+ * @param[in] s Either a part of the input as is, or a formatted label.
+ * @param[in] len The length of s, always >0.
+ */
+typedef void (*ngim_convert_emit_t)(void *data, const char *s,
+		apr_size_t len);
+
+/**
+ * State of a streaming converter. Set up with ngim_convert_init, the
+ * fields are private.
+ */
+typedef struct convert {
+	/** Non-zero if all labels are converted */
+	int all;
+	/** Formatting function */
+	ngim_convert_format_t format;
+	/** Output function and its data */
+	ngim_convert_emit_t emit;
+	void *data;
+	/** Non-zero at the beginning of a line */
+	int start;
+	/** Length of a possible label continuing in the next buffer */
+	int pending;
+	/** The possible label */
+	char label[NGIM_TAIN_FORMAT];
+	/** The formatted label */
+	char result[NGIM_ISO8601_FORMAT];
+} ngim_convert_t;
+
+/*
+ * Functions
+ */
+
+/**
+ * Converts an external textual TAI64N label, or a TAI64 label if there are
+ * fewer than #NGIM_TAIN_FORMAT bytes.
+ * @param[in] s The label, starting with '@'.
+ * @param[in] len The length of s.
+ * @param[out] t Result.
+ * @return The number of bytes used from s, or zero if s does not start
+ *         with a valid label.
+ */
+extern apr_size_t __must_check ngim_convert_label(const char *s,
+		apr_size_t len, ngim_tain_t *t);
+
+/**
+ * Sets up a streaming converter, which replaces the TAI64N and TAI64 labels
+ * in its input with formatted ones.
+ * @param[out] c The converter.
+ * @param[in] flags Zero to convert the labels at the beginning of each line
+ *                  only, or #NGIM_CONVERT_ALL.
+ * @param[in] format Function for formatting the labels.
+ * @param[in] emit Function receiving the output.
+ * @param[in] data A pointer passed to emit.
+ * @remarks The converter does not allocate memory, and passes unchanged
+ *          parts of the input to emit without copying them.
+ */
+extern void ngim_convert_init(ngim_convert_t *c, int flags,
+		ngim_convert_format_t format, ngim_convert_emit_t emit, void *data);
+
+/**
+ * Converts the next part of the input. A label may continue in the next
+ * part, in which case its beginning is held back until then.
+ * @param[in] c The converter.
+ * @param[in] s Input.
+ * @param[in] len The length of s.
+ */
+extern void ngim_convert_feed(ngim_convert_t *c, const char *s,
+		apr_size_t len);
+
+/**
+ * Ends the input, converting anything that was held back. The converter
+ * may then be used for new input, starting from the beginning of a line.
+ * @param[in] c The converter.
+ */
+extern void ngim_convert_finish(ngim_convert_t *c);
+
 /** @} */
 
 /**
@@ -807,6 +1467,57 @@ extern int __must_check ngim_create_symlink(const char *target,
 extern int __must_check ngim_resolve_symlink_basename(const char *path,
 		char **target, apr_pool_t *pool);
 
+/**
+ * Starts updating data protected by a sequence lock. Readers never block
+ * the writer, and retry if they saw an update in progress.
+ * @param[in] seq The sequence counter, which starts out even.
+ * @remarks There must be only one writer at a time.
+ */
+static inline void ngim_seqlock_write_begin(volatile apr_uint32_t *seq)
+{
+	*seq = *seq + 1;
+	ngim_barrier();
+}
+
+/**
+ * Finishes an update started with ngim_seqlock_write_begin.
+ * @param[in] seq The sequence counter.
+ */
+static inline void ngim_seqlock_write_end(volatile apr_uint32_t *seq)
+{
+	ngim_barrier();
+	*seq = *seq + 1;
+}
+
+/**
+ * Starts reading data protected by a sequence lock. Copy the data, and
+ * then check the copy with ngim_seqlock_read_retry.
+ * @param[in] seq The sequence counter.
+ * @return The value to pass to ngim_seqlock_read_retry.
+ */
+static inline apr_uint32_t ngim_seqlock_read_begin(
+		const volatile apr_uint32_t *seq)
+{
+	apr_uint32_t start = *seq;
+	ngim_barrier();
+	return start;
+}
+
+/**
+ * Tests if data read after ngim_seqlock_read_begin may be inconsistent.
+ * @param[in] seq The sequence counter.
+ * @param[in] start Value returned by ngim_seqlock_read_begin.
+ * @return Non-zero if the data was being updated, and should be read again.
+ * @remarks The counter stays odd if the writer dies during an update, so
+ *   readers should give up after a number of tries.
+ */
+static inline int ngim_seqlock_read_retry(const volatile apr_uint32_t *seq,
+		apr_uint32_t start)
+{
+	ngim_barrier();
+	return ((start & 1) || *seq != start);
+}
+
 /**
  * Tries to converts apr_exit_why_e to an explanation message.
  * @param[in] reason Value apr_exit_why_e usually returned by apr_proc_wait.
@@ -0,0 +1,147 @@
+/*
+ * clock.c
+ *
+ * Copyright  2005, 2006, 2007  Sami Tolvanen <sami@ngim.org>
+ */
+
+#include "common.h"
+#include "base.h"
+#include <apr_time.h>
+
+/* TAI was ahead of UTC by 10 s in 1972 and the difference only grows, so a
+ * smaller one means the kernel hasn't been told */
+#define TAI_MIN_OFFSET		10
+
+/* The clock used for time stamps */
+static int clock_source = NGIM_CLOCK_REALTIME;
+
+/* Seconds CLOCK_TAI was ahead of CLOCK_REALTIME when it was selected */
+static apr_int64_t clock_tai_offset = 0;
+
+#if HAVE_CLOCK_GETTIME
+/*
+ * Tests if the kernel keeps TAI and stores its offset from system time.
+ * Until a time daemon tells it the offset, CLOCK_TAI is the same as
+ * CLOCK_REALTIME.
+ */
+static int clock_has_tai(void)
+{
+#ifdef CLOCK_TAI
+	struct timespec tai, real;
+	apr_int64_t offset;
+
+	if (clock_gettime(CLOCK_TAI, &tai) == -1 ||
+		clock_gettime(CLOCK_REALTIME, &real) == -1) {
+		return 0;
+	}
+
+	/* The offset is in whole seconds, round off the time between the
+	 * two reads */
+	offset = tai.tv_sec - real.tv_sec;
+	if (tai.tv_nsec - real.tv_nsec >= 500000000) {
+		++offset;
+	} else if (tai.tv_nsec - real.tv_nsec < -500000000) {
+		--offset;
+	}
+
+	if (offset < TAI_MIN_OFFSET) {
+		return 0;
+	}
+
+	clock_tai_offset = offset;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Tests if the kernel has a coarse clock.
+ */
+static int clock_has_coarse(void)
+{
+#ifdef CLOCK_REALTIME_COARSE
+	struct timespec ts;
+	return (clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0);
+#else
+	return 0;
+#endif
+}
+#endif
+
+/*
+ * Selects the clock used for time stamps.
+ */
+int ngim_clock_select(int source)
+{
+	clock_source = NGIM_CLOCK_REALTIME;
+
+#if HAVE_CLOCK_GETTIME
+	if ((source == NGIM_CLOCK_TAI && clock_has_tai()) ||
+		(source == NGIM_CLOCK_COARSE && clock_has_coarse())) {
+		clock_source = source;
+	}
+#endif
+
+	return clock_source;
+}
+
+/*
+ * Reads the selected clock.
+ */
+void ngim_clock_now(ngim_tain_t *t)
+{
+#if HAVE_CLOCK_GETTIME
+	struct timespec ts;
+	apr_uint64_t epoch = NGIM_TAI_APR_EPOCH;
+	clockid_t id = CLOCK_REALTIME;
+
+	die_assert(t);
+
+	switch (clock_source) {
+#ifdef CLOCK_TAI
+	case NGIM_CLOCK_TAI:
+		/* Labels follow NGIM_TAI_APR_EPOCH as of selection, but don't
+		 * repeat or skip seconds when a leap second is inserted */
+		id = CLOCK_TAI;
+		epoch -= clock_tai_offset;
+		break;
+#endif
+#ifdef CLOCK_REALTIME_COARSE
+	case NGIM_CLOCK_COARSE:
+		id = CLOCK_REALTIME_COARSE;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	if (likely(clock_gettime(id, &ts) == 0)) {
+		t->sec.x = epoch + ts.tv_sec;
+		t->nano = ts.tv_nsec;
+		return;
+	}
+#else
+	die_assert(t);
+#endif
+
+	/* Microseconds at best */
+	ngim_tain_from_apr(t, apr_time_now());
+}
+
+/*
+ * Reads a monotonic clock.
+ */
+apr_time_t ngim_clock_monotonic(void)
+{
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (likely(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)) {
+		return apr_time_make(ts.tv_sec, ts.tv_nsec / 1000);
+	}
+#endif
+
+	/* Not monotonic, but the best we have */
+	return apr_time_now();
+}
@@ -0,0 +1,173 @@
+/*
+ * convert.c
+ *
+ * Copyright  2005, 2006, 2007  Sami Tolvanen <sami@ngim.org>
+ */
+
+#include "common.h"
+#include "base.h"
+
+/*
+ * Tests if a character is a valid ASCII hex nibble
+ */
+#define is_hex_nibble(c) \
+	(!(ngim_tai_hex_value[(unsigned char)(c)] & NGIM_TAI_HEX_BAD))
+
+/*
+ * Converts an external textual label.
+ */
+apr_size_t ngim_convert_label(const char *s, apr_size_t len, ngim_tain_t *t)
+{
+	die_assert(s && t);
+
+	if (len >= NGIM_TAIN_FORMAT && ngim_tain_decode(s, t)) {
+		return NGIM_TAIN_FORMAT;
+	}
+	if (len >= NGIM_TAI_FORMAT && ngim_tai_decode(s, &t->sec)) {
+		t->nano = 0;
+		return NGIM_TAI_FORMAT;
+	}
+
+	return 0;
+}
+
+/*
+ * Formats a label and outputs it.
+ */
+static inline void convert_emit(ngim_convert_t *c, const ngim_tain_t *t)
+{
+	c->format(c->result, t);
+	c->emit(c->data, c->result, strlen(c->result));
+}
+
+/*
+ * Sets up a streaming converter.
+ */
+void ngim_convert_init(ngim_convert_t *c, int flags,
+		ngim_convert_format_t format, ngim_convert_emit_t emit, void *data)
+{
+	die_assert(c && format && emit);
+
+	c->all = (flags & NGIM_CONVERT_ALL);
+	c->format = format;
+	c->emit = emit;
+	c->data = data;
+	c->start = 1;
+	c->pending = 0;
+}
+
+/*
+ * Converts the next part of the input. Unchanged parts of the input are
+ * collected to spans and output as is.
+ */
+void ngim_convert_feed(ngim_convert_t *c, const char *s, apr_size_t len)
+{
+	const char *end = s + len;
+	const char *span = s;
+	const char *label;
+	apr_size_t used;
+	ngim_tain_t t;
+
+	die_assert(c && s);
+
+	/* Finish a label that started in the previous part */
+	if (c->pending > 0) {
+		while (s < end && c->pending < NGIM_TAIN_FORMAT &&
+				is_hex_nibble(*s)) {
+			c->label[c->pending++] = *s++;
+		}
+
+		if (s == end && c->pending < NGIM_TAIN_FORMAT) {
+			/* And it still continues */
+			return;
+		}
+
+		used = ngim_convert_label(c->label, c->pending, &t);
+		if (used) {
+			convert_emit(c, &t);
+		}
+		if (used < (apr_size_t)c->pending) {
+			c->emit(c->data, &c->label[used], c->pending - used);
+		}
+
+		c->pending = 0;
+		c->start = 0;
+		span = s;
+	}
+
+	while (s < end) {
+		if (c->all) {
+			/* The next possible label */
+			if (!(label = memchr(s, '@', end - s))) {
+				break;
+			}
+		} else if (c->start && *s == '@') {
+			label = s;
+		} else {
+			/* The beginning of the next line */
+			if (!(s = memchr(s, '\n', end - s))) {
+				break;
+			}
+			++s;
+			c->start = 1;
+			continue;
+		}
+
+		/* Find the end of the label, a label of the maximum length may
+		 * be followed by more hex digits */
+		s = label + 1;
+		while (s < end && s - label < NGIM_TAIN_FORMAT && is_hex_nibble(*s)) {
+			++s;
+		}
+
+		c->start = 0;
+
+		if (s == end && s - label < NGIM_TAIN_FORMAT) {
+			/* Continues in the next part */
+			if (span < label) {
+				c->emit(c->data, span, label - span);
+			}
+			c->pending = s - label;
+			memcpy(c->label, label, c->pending);
+			return;
+		}
+
+		if ((used = ngim_convert_label(label, s - label, &t))) {
+			if (span < label) {
+				c->emit(c->data, span, label - span);
+			}
+			convert_emit(c, &t);
+
+			/* The rest of the hex digits are output as is */
+			span = label + used;
+		}
+	}
+
+	if (span < end) {
+		c->emit(c->data, span, end - span);
+	}
+}
+
+/*
+ * Ends the input.
+ */
+void ngim_convert_finish(ngim_convert_t *c)
+{
+	apr_size_t used;
+	ngim_tain_t t;
+
+	die_assert(c);
+
+	if (c->pending > 0) {
+		used = ngim_convert_label(c->label, c->pending, &t);
+		if (used) {
+			convert_emit(c, &t);
+		}
+		if (used < (apr_size_t)c->pending) {
+			c->emit(c->data, &c->label[used], c->pending - used);
+		}
+	}
+
+	c->pending = 0;
+	c->start = 1;
+}
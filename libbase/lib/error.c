@@ -9,12 +9,24 @@
 
 #define ERROR_BUFFERSIZE 128
 
+/* Maximum length of a message, including the newline. Writes to a pipe up
+ * to PIPE_BUF bytes are atomic, which is at least this much. */
+#define ERROR_MESSAGESIZE 512
+/* Maximum length of a notice about dropped messages preceding a message */
+#define ERROR_NOTICESIZE 128
+
 /* Program name */
 static const char *progname = NULL;
 
 /* Error level */
 static int error_level = INFO; /* Defaults to informational */
 
+/* Error mode */
+static int error_mode = 0;
+
+/* Number of messages dropped in non-blocking mode */
+static apr_uint32_t error_dropped = 0;
+
 /*
  * Sets program name for error messages.
  */
@@ -57,34 +69,186 @@ void ngim_seterrorlevel(int level)
 }
 
 /*
- * Prints an error message to stderr.
+ * Sets the error mode.
+ */
+void ngim_seterrormode(int mode)
+{
+	error_mode = mode;
+}
+
+/*
+ * Returns the error mode.
+ */
+int ngim_geterrormode(void)
+{
+	return error_mode;
+}
+
+/*
+ * Returns the number of messages dropped.
+ */
+apr_uint32_t ngim_errordropped(void)
+{
+	return error_dropped;
+}
+
+/*
+ * Appends a string to a message buffer, truncating it at end.
+ */
+static inline char * append(char *p, const char *end, const char *s)
+{
+	if (s) {
+		while (*s && p < end) {
+			*p++ = *s++;
+		}
+	}
+	return p;
+}
+
+/*
+ * Appends a string to a message buffer as the inside of a quoted value.
+ * Quotes and backslashes are escaped, control characters replaced.
+ */
+static inline char * append_quoted(char *p, const char *end, const char *s)
+{
+	if (s) {
+		for (; *s && p < end; ++s) {
+			if (*s == '"' || *s == '\\') {
+				if (p + 1 >= end) {
+					break;
+				}
+				*p++ = '\\';
+				*p++ = *s;
+			} else if ((unsigned char)*s < ' ') {
+				*p++ = '?';
+			} else {
+				*p++ = *s;
+			}
+		}
+	}
+	return p;
+}
+
+/*
+ * Appends a decimal number to a message buffer.
+ */
+static inline char * append_number(char *p, const char *end, apr_uint32_t n)
+{
+	char digits[16];
+	int i = sizeof(digits);
+
+	digits[--i] = '\0';
+	do {
+		digits[--i] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+
+	return append(p, end, &digits[i]);
+}
+
+/*
+ * Builds a message to a buffer, returns a pointer to its end. The parts
+ * are concatenated, or written as the value of message in the structured
+ * form.
+ */
+static char * format_message(char *p, const char *end, int level,
+		const char * const *parts, int count)
+{
+	int i;
+
+	if (error_mode & NGIM_ERROR_STRUCTURED) {
+		p = append(p, end, "level=");
+		p = append(p, end, strlevel(level));
+		if (likely(progname)) {
+			p = append(p, end, " program=\"");
+			p = append_quoted(p, end, progname);
+			p = append(p, end, "\"");
+		}
+		p = append(p, end, " message=\"");
+		for (i = 0; i < count; ++i) {
+			p = append_quoted(p, end, parts[i]);
+		}
+		p = append(p, end, "\"");
+	} else {
+		p = append(p, end, strlevel(level));
+		p = append(p, end, ": ");
+		if (likely(progname)) {
+			p = append(p, end, progname);
+			p = append(p, end, ": ");
+		}
+		for (i = 0; i < count; ++i) {
+			p = append(p, end, parts[i]);
+		}
+	}
+
+	/* end leaves room for this */
+	*p++ = '\n';
+	return p;
+}
+
+/*
+ * Tests if stderr can be written to without blocking. A pipe with room
+ * for PIPE_BUF bytes polls as writable, so the message won't block.
+ */
+static int stderr_writable(void)
+{
+	apr_pollfd_t fd;
+	apr_int32_t n = 0;
+
+	memset(&fd, 0, sizeof(fd));
+	fd.desc_type = APR_POLL_FILE;
+	fd.reqevents = APR_POLLOUT;
+	fd.desc.f = g_apr_stderr;
+
+	if (APR_FAIL_N(apr_poll(&fd, 1, &n, 0))) {
+		/* Including a timeout, which means no room */
+		return 0;
+	}
+
+	return (n > 0);
+}
+
+/*
+ * Prints an error message to stderr with a single write.
  */
 void ngim_error6(int level, const char *s1, const char *s2,
 		const char *s3, const char *s4, const char *s5, const char *s6)
 {
+	const char *parts[] = { s1, s2, s3, s4, s5, s6 };
+	const char *dropped[] = { NULL, " messages dropped" };
+	char buffer[ERROR_MESSAGESIZE];
+	char number[16], *p = buffer;
+	apr_size_t len;
+
 	if (level < error_level) {
 		return;
 	}
-	
+
 	if (likely(g_apr_stderr)) {
-		apr_file_flush(g_apr_stderr);
-		/* Error level */
-		apr_file_puts(strlevel(level), g_apr_stderr);
-		apr_file_puts(": ", g_apr_stderr);
-		/* Program name */
-		if (likely(progname)) {
-			apr_file_puts(progname, g_apr_stderr);
-			apr_file_puts(": ", g_apr_stderr);
+		/* Fatal errors are the last words, always wait for those */
+		if ((error_mode & NGIM_ERROR_NONBLOCK) && level < FATAL &&
+				!stderr_writable()) {
+			++error_dropped;
+			return;
+		}
+
+		/* Report earlier losses in the same write */
+		if (unlikely(error_dropped > 0)) {
+			*append_number(number, &number[sizeof(number) - 1],
+				error_dropped) = '\0';
+			dropped[0] = number;
+			p = format_message(p, &buffer[ERROR_NOTICESIZE - 1], WARNING,
+					dropped, NELEMS(dropped));
+		}
+
+		p = format_message(p, &buffer[sizeof(buffer) - 1], level, parts,
+				NELEMS(parts));
+		len = p - buffer;
+
+		if (!APR_FAIL_N(apr_file_write_full(g_apr_stderr, buffer, len,
+				NULL))) {
+			error_dropped = 0;
 		}
-		/* Messages */
-		if (likely(s1)) apr_file_puts(s1, g_apr_stderr);
-		if (s2) apr_file_puts(s2, g_apr_stderr);
-		if (s3) apr_file_puts(s3, g_apr_stderr);
-		if (s4) apr_file_puts(s4, g_apr_stderr);
-		if (s5) apr_file_puts(s5, g_apr_stderr);
-		if (s6) apr_file_puts(s6, g_apr_stderr);
-		apr_file_puts("\n", g_apr_stderr);
-		apr_file_flush(g_apr_stderr);
 	} else {
 		/* TODO: Use stdio? */
 	}
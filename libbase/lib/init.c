@@ -8,6 +8,7 @@
 #include "base.h"
 #include <apr_general.h>
 #include <apr_env.h>
+#include <apr_strings.h>
 #include <apr_thread_proc.h>
 
 #define MAX_POOL_FREE	32
@@ -59,6 +60,33 @@ static void seterrorlevel()
 	}
 }
 
+static void seterrormode()
+{
+	char *value, *word, *last;
+	int mode = 0;
+
+	if (APR_FAIL_N(apr_env_get(&value, NGIM_ENV_ERROR_MODE, g_pool))) {
+		return;
+	}
+
+	for (word = apr_strtok(value, ",", &last); word;
+			word = apr_strtok(NULL, ",", &last)) {
+		if (!strcmp(word, "text")) {
+			mode &= ~NGIM_ERROR_STRUCTURED;
+		} else if (!strcmp(word, "structured")) {
+			mode |= NGIM_ERROR_STRUCTURED;
+		} else if (!strcmp(word, "nonblock")) {
+			mode |= NGIM_ERROR_NONBLOCK;
+		} else {
+			warn_error1("invalid value for environment variable "
+				NGIM_ENV_ERROR_MODE);
+			return;
+		}
+	}
+
+	ngim_seterrormode(mode);
+}
+
 static void init()
 {
 	apr_status_t status;
@@ -85,8 +113,9 @@ static void init()
 		die_syserror1("atexit failed");
 	}
 
-	/* Error level from environment */
+	/* Error level and mode from environment */
 	seterrorlevel();
+	seterrormode();
 }
 
 void ngim_base_init()
@@ -8,71 +8,94 @@
 #include "base.h"
 
 /*
- * Formats apr_time_exp_t to ISO 8601:2004 format with at least four-digit
- * year and microsecond precision (if present).
+ * Formats a date as YYYY[Y]-MM-DD followed by a space. Returns a pointer
+ * to the end of the output.
  */
-static void format_iso8601(char *s, const apr_time_exp_t *exp)
+static inline char *format_date(char *s, int year, int month, int day)
 {
-	int tmp;
-	die_assert(s && exp);
-
-	/* Year */
-	tmp = exp->tm_year + 1900;
-	if (unlikely(tmp > 9999)) {
-		warn_assert(tmp < 100000); /* Y100K bug */
-		*s++ = tmp / 10000 + '0';
-		*s++ = tmp % 10000 / 1000 + '0';
+	if (unlikely(year > 9999)) {
+		warn_assert(year < 100000); /* Y100K bug */
+		*s++ = year / 10000 + '0';
+		*s++ = year % 10000 / 1000 + '0';
 	} else {
-		*s++ = tmp / 1000 + '0';
+		*s++ = year / 1000 + '0';
 	}
-	*s++ = tmp % 1000 / 100 + '0';
-	*s++ = tmp % 100 / 10 + '0';
-	*s++ = tmp % 10 + '0';
+	*s++ = year % 1000 / 100 + '0';
+	*s++ = year % 100 / 10 + '0';
+	*s++ = year % 10 + '0';
 	*s++ = '-';
 	/* Month */
-	tmp = exp->tm_mon + 1;
-	*s++ = tmp / 10 + '0';
-	*s++ = tmp % 10 + '0';
+	*s++ = month / 10 + '0';
+	*s++ = month % 10 + '0';
 	*s++ = '-';
 	/* Day */
-	*s++ = exp->tm_mday / 10 + '0';
-	*s++ = exp->tm_mday % 10 + '0';
+	*s++ = day / 10 + '0';
+	*s++ = day % 10 + '0';
 	*s++ = ' ';
+
+	return s;
+}
+
+/*
+ * Formats a time of day as hh:mm:ss. Returns a pointer to the end of the
+ * output.
+ */
+static inline char *format_time(char *s, int hour, int min, int sec)
+{
 	/* Hours */
-	*s++ = exp->tm_hour / 10 + '0';
-	*s++ = exp->tm_hour % 10 + '0';
+	*s++ = hour / 10 + '0';
+	*s++ = hour % 10 + '0';
 	*s++ = ':';
 	/* Minutes */
-	*s++ = exp->tm_min / 10 + '0';
-	*s++ = exp->tm_min % 10 + '0';
+	*s++ = min / 10 + '0';
+	*s++ = min % 10 + '0';
 	*s++ = ':';
 	/* Seconds */
-	*s++ = exp->tm_sec / 10 + '0';
-	*s++ = exp->tm_sec % 10 + '0';
-	/* Microseconds */
-	if (exp->tm_usec > 0) {
+	*s++ = sec / 10 + '0';
+	*s++ = sec % 10 + '0';
+
+	return s;
+}
+
+/*
+ * Formats microseconds, if present. Returns a pointer to the end of the
+ * output.
+ */
+static inline char *format_usec(char *s, int usec)
+{
+	if (usec > 0) {
 		*s++ = '.';
-		*s++ = exp->tm_usec / 100000 + '0';
-		*s++ = exp->tm_usec % 100000 / 10000 + '0';
-		*s++ = exp->tm_usec % 10000 / 1000 + '0';
-		*s++ = exp->tm_usec % 1000 / 100 + '0';
-		*s++ = exp->tm_usec % 100 / 10 + '0';
-		*s++ = exp->tm_usec % 10 + '0';
-	}
-	/* Time zone offset */
-	if (exp->tm_gmtoff != 0) {
+		*s++ = usec / 100000 + '0';
+		*s++ = usec % 100000 / 10000 + '0';
+		*s++ = usec % 10000 / 1000 + '0';
+		*s++ = usec % 1000 / 100 + '0';
+		*s++ = usec % 100 / 10 + '0';
+		*s++ = usec % 10 + '0';
+	}
+
+	return s;
+}
+
+/*
+ * Formats the offset from UTC and NUL-terminates the string.
+ */
+static inline void format_zone(char *s, apr_int32_t gmtoff)
+{
+	int tmp;
+
+	if (gmtoff != 0) {
 		/* Sign */
-		if (exp->tm_gmtoff > 0) {
+		if (gmtoff > 0) {
 			*s++ = '+';
 		} else {
 			*s++ = '-';
 		}
 		/* Hours */
-		tmp = exp->tm_gmtoff / 3600;
+		tmp = gmtoff / 3600;
 		*s++ = tmp / 10 + '0';
 		*s++ = tmp % 10 + '0';
 		/* Minutes */
-		tmp = exp->tm_gmtoff % 3600 / 60;
+		tmp = gmtoff % 3600 / 60;
 		if (tmp > 0) {
 			*s++ = tmp / 10 + '0';
 			*s++ = tmp % 10 + '0';
@@ -85,6 +108,20 @@ static void format_iso8601(char *s, const apr_time_exp_t *exp)
 	*s = '\0';
 }
 
+/*
+ * Formats apr_time_exp_t to ISO 8601:2004 format with at least four-digit
+ * year and microsecond precision (if present).
+ */
+static void format_iso8601(char *s, const apr_time_exp_t *exp)
+{
+	die_assert(s && exp);
+
+	s = format_date(s, exp->tm_year + 1900, exp->tm_mon + 1, exp->tm_mday);
+	s = format_time(s, exp->tm_hour, exp->tm_min, exp->tm_sec);
+	s = format_usec(s, exp->tm_usec);
+	format_zone(s, exp->tm_gmtoff);
+}
+
 /*
  * Formats an ISO 8601 date and time string in the UTC time zone.
  */
@@ -116,3 +153,368 @@ void ngim_iso8601_local_format(char *s, apr_time_t t)
 	}
 	format_iso8601(s, &exp);
 }
+
+/*
+ * Tests if a character is a decimal digit. The subtraction wraps around
+ * for characters below '0', which leaves a single comparison.
+ */
+#define is_digit(c) \
+	((unsigned char)((c) - '0') <= 9)
+
+/*
+ * Converts two digits at s. Sets *bad instead of branching if either is
+ * not a digit, so fixed fields can be checked together.
+ */
+static inline int parse_2digits(const char *s, int *bad)
+{
+	unsigned int a = (unsigned char)(s[0] - '0');
+	unsigned int b = (unsigned char)(s[1] - '0');
+
+	*bad |= (a > 9) | (b > 9);
+	return a * 10 + b;
+}
+
+/*
+ * Returns the number of days from 1970-01-01 to the given date in the
+ * proleptic Gregorian calendar.
+ */
+static inline apr_int64_t days_from_civil(apr_int64_t year, int month,
+		int day)
+{
+	apr_int64_t era, yoe, doy, doe;
+
+	year -= (month <= 2);
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + doe - 719468;
+}
+
+/*
+ * Finds the offset from UTC in effect at the local time t, treating t as
+ * if it was UTC. Returns zero if the time zone lookup fails.
+ */
+static int local_offset(apr_time_t t, apr_int32_t *offset)
+{
+	apr_time_exp_t local;
+
+	if (APR_FAIL_N(apr_time_exp_lt(&local, t)) ||
+		APR_FAIL_N(apr_time_exp_lt(&local,
+				t - apr_time_from_sec(local.tm_gmtoff)))) {
+		warn_error1("apr_time_exp_lt failed"); /* Huh? */
+		return 0;
+	}
+
+	*offset = local.tm_gmtoff;
+	return 1;
+}
+
+/*
+ * Divides a by a positive b, rounding toward negative infinity, so that
+ * times before 1970 fall into the right quarter of an hour.
+ */
+static inline apr_int64_t floor_div(apr_int64_t a, apr_int64_t b)
+{
+	apr_int64_t q = a / b;
+
+	return (a % b < 0) ? q - 1 : q;
+}
+
+/*
+ * Returns the offset from UTC in effect during the quarter of an hour that
+ * contains sec, or NGIM_ISO8601_MIXED if the offset changes within it.
+ * The offsets are sampled from both ends of the quarter and kept in a
+ * small table, so the time zone lookup is needed only once per quarter.
+ */
+static apr_int32_t context_offset(ngim_iso8601_context_t *ctx,
+		apr_int64_t sec)
+{
+	apr_int64_t block = floor_div(sec, 900);
+	int slot = (int)(block - floor_div(block, NGIM_ISO8601_OFFSETS) *
+		NGIM_ISO8601_OFFSETS);
+	apr_time_exp_t first, last;
+
+	if (likely(ctx->cached[slot] && ctx->block[slot] == block)) {
+		return ctx->offset[slot];
+	}
+
+	if (APR_FAIL_N(apr_time_exp_lt(&first,
+				apr_time_from_sec(block * 900))) ||
+		APR_FAIL_N(apr_time_exp_lt(&last,
+				apr_time_from_sec(block * 900 + 899)))) {
+		warn_error1("apr_time_exp_lt failed"); /* Huh? */
+		return NGIM_ISO8601_MIXED;
+	}
+
+	ctx->cached[slot] = 1;
+	ctx->block[slot] = block;
+
+	if (first.tm_gmtoff == last.tm_gmtoff) {
+		ctx->offset[slot] = first.tm_gmtoff;
+	} else {
+		ctx->offset[slot] = NGIM_ISO8601_MIXED;
+	}
+
+	return ctx->offset[slot];
+}
+
+/*
+ * Converts a local time to apr_time_t, treating t as if it was UTC. With a
+ * context, the two lookups of local_offset use its table of offsets, and
+ * only quarters of an hour during which the offset changes are left to
+ * the C library.
+ */
+static apr_time_t local_to_apr(ngim_iso8601_context_t *ctx, apr_time_t t)
+{
+	apr_int64_t sec;
+	apr_int32_t offset;
+
+	if (ctx) {
+		sec = floor_div(t, APR_USEC_PER_SEC);
+		offset = context_offset(ctx, sec);
+
+		if (likely(offset != NGIM_ISO8601_MIXED)) {
+			offset = context_offset(ctx, sec - offset);
+
+			if (likely(offset != NGIM_ISO8601_MIXED)) {
+				return t - apr_time_from_sec(offset);
+			}
+		}
+	}
+
+	if (!local_offset(t, &offset)) {
+		return t;
+	}
+
+	return t - apr_time_from_sec(offset);
+}
+
+/*
+ * Parses an ISO 8601 date and time string, using the offsets cached in
+ * ctx if it's given.
+ */
+static apr_size_t iso8601_parse(ngim_iso8601_context_t *ctx, const char *s,
+		apr_size_t len, apr_time_t *t, int utc)
+{
+	const char *p = s;
+	const char *end = s + len;
+	apr_int64_t year, seconds = 0, usec = 0;
+	int month, day, offset = 0, sign, digits, bad = 0;
+	int zone = 0;
+
+	die_assert(s && t);
+
+	/* Date, the fixed fields are checked together */
+	if (unlikely(len < 10)) {
+		return 0;
+	}
+
+	year = parse_2digits(p, &bad) * 100 + parse_2digits(p + 2, &bad);
+	p += 4;
+
+	if (is_digit(*p) && end - p >= 7) {
+		/* Five-digit year */
+		year = year * 10 + (*p++ - '0');
+	}
+
+	bad |= (p[0] != '-') | (p[3] != '-');
+	month = parse_2digits(p + 1, &bad);
+	day = parse_2digits(p + 4, &bad);
+	p += 6;
+
+	if (bad || month < 1 || month > 12 || day < 1 || day > 31) {
+		return 0;
+	}
+
+	/* Time, defaults to midnight */
+	if (end - p >= 6 && (*p == ' ' || *p == 'T') && p[3] == ':') {
+		seconds = 3600 * parse_2digits(p + 1, &bad) +
+			60 * parse_2digits(p + 4, &bad);
+
+		if (bad || seconds >= 86400 || p[4] > '5') {
+			return 0;
+		}
+		p += 6;
+
+		if (end - p >= 3 && *p == ':' && is_digit(p[1])) {
+			digits = parse_2digits(p + 1, &bad);
+			/* Allow for a leap second */
+			if (bad || digits > 60) {
+				return 0;
+			}
+			seconds += digits;
+			p += 3;
+
+			if (p + 1 < end && (*p == '.' || *p == ',') && is_digit(p[1])) {
+				/* Fraction, precision beyond microseconds is ignored */
+				for (++p, digits = 0; p < end && is_digit(*p);
+						++p, ++digits) {
+					if (digits < 6) {
+						usec = usec * 10 + (*p - '0');
+					}
+				}
+				for (; digits < 6; ++digits) {
+					usec *= 10;
+				}
+			}
+		}
+	}
+
+	/* Offset from UTC */
+	if (p < end && *p == 'Z') {
+		++p;
+		zone = 1;
+	} else if (end - p >= 3 && (*p == '+' || *p == '-') &&
+			is_digit(p[1]) && is_digit(p[2])) {
+		sign = (*p == '+') ? 1 : -1;
+		digits = parse_2digits(p + 1, &bad);
+		/* No zone is further than 14 hours from UTC */
+		if (digits > 14) {
+			return 0;
+		}
+		offset = 3600 * digits;
+		p += 3;
+
+		if (end - p >= 3 && *p == ':' && is_digit(p[1]) && is_digit(p[2])) {
+			++p;
+		}
+		if (end - p >= 2 && is_digit(p[0]) && is_digit(p[1])) {
+			digits = parse_2digits(p, &bad);
+			if (digits > 59) {
+				return 0;
+			}
+			offset += 60 * digits;
+			p += 2;
+		}
+
+		offset *= sign;
+		zone = 1;
+	}
+
+	seconds += 86400 * days_from_civil(year, month, day);
+	*t = apr_time_from_sec(seconds - offset) + usec;
+
+	if (!zone && !utc) {
+		*t = local_to_apr(ctx, *t);
+	}
+
+	return p - s;
+}
+
+/*
+ * Parses an ISO 8601 date and time string.
+ */
+apr_size_t ngim_iso8601_parse(const char *s, apr_size_t len, apr_time_t *t,
+		int utc)
+{
+	return iso8601_parse(NULL, s, len, t, utc);
+}
+
+/*
+ * Parses an ISO 8601 date and time string using a context.
+ */
+apr_size_t ngim_iso8601_context_parse(ngim_iso8601_context_t *ctx,
+		const char *s, apr_size_t len, apr_time_t *t)
+{
+	die_assert(ctx);
+
+	return iso8601_parse(ctx, s, len, t, ctx->utc);
+}
+
+/*
+ * Converts the number of days since 1970-01-01 to a date in the proleptic
+ * Gregorian calendar, the inverse of days_from_civil.
+ */
+static inline void civil_from_days(apr_int64_t days, int *year, int *month,
+		int *day)
+{
+	apr_int64_t era, doe, yoe, doy, mp;
+
+	days += 719468;
+	era = (days >= 0 ? days : days - 146096) / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+
+	*day = doy - (153 * mp + 2) / 5 + 1;
+	*month = mp < 10 ? mp + 3 : mp - 9;
+	*year = yoe + era * 400 + (*month <= 2);
+}
+
+/*
+ * Sets up a formatting context.
+ */
+void ngim_iso8601_context_init(ngim_iso8601_context_t *ctx, int utc)
+{
+	die_assert(ctx);
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->utc = utc;
+	ctx->second = -1;
+	ctx->day = -1;
+}
+
+/*
+ * Formats an ISO 8601 date and time string using a formatting context.
+ */
+void ngim_iso8601_context_format(ngim_iso8601_context_t *ctx, char *s,
+		apr_time_t t)
+{
+	apr_int64_t sec, local, day;
+	apr_int32_t offset = 0;
+	int year, month, mday;
+	char *p;
+
+	die_assert(ctx && s);
+
+	/* Leave times outside 1970-01-02..9999-12-30 to the C library, which
+	 * makes the cached parts always the same width */
+	if (unlikely(t < apr_time_from_sec(86400) ||
+			t >= apr_time_from_sec(NGIM_ISO8601_LAST))) {
+		goto slow;
+	}
+
+	sec = apr_time_sec(t);
+
+	if (sec != ctx->second) {
+		if (!ctx->utc) {
+			offset = context_offset(ctx, sec);
+
+			if (unlikely(offset == NGIM_ISO8601_MIXED)) {
+				goto slow;
+			}
+		}
+
+		local = sec + offset;
+		day = local / 86400;
+
+		if (day != ctx->day) {
+			civil_from_days(day, &year, &month, &mday);
+			ctx->length = format_date(ctx->text, year, month, mday) -
+				ctx->text;
+			ctx->day = day;
+		}
+
+		local %= 86400;
+		format_time(&ctx->text[ctx->length], local / 3600,
+			local % 3600 / 60, local % 60);
+		format_zone(ctx->zone, offset);
+		ctx->second = sec;
+	}
+
+	/* Date and time up to seconds, then the rest */
+	memcpy(s, ctx->text, ctx->length + NGIM_ISO8601_TIME);
+	p = format_usec(&s[ctx->length + NGIM_ISO8601_TIME], apr_time_usec(t));
+	strcpy(p, ctx->zone);
+	return;
+
+slow:
+	if (ctx->utc) {
+		ngim_iso8601_utc_format(s, t);
+	} else {
+		ngim_iso8601_local_format(s, t);
+	}
+}
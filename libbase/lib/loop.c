@@ -0,0 +1,584 @@
+/*
+ * loop.c
+ *
+ * Copyright  2005, 2006, 2007  Sami Tolvanen <sami@ngim.org>
+ */
+
+#include "common.h"
+#include "base.h"
+#include <apr_poll.h>
+#include <apr_portable.h>
+#include <apr_signal.h>
+
+/* The maximum number of files and children watched at once */
+#define LOOP_MAX_FILES		64
+
+/* Kinds of events */
+#define LOOP_FILE			1
+#define LOOP_SIGNAL			2
+#define LOOP_TIMER			3
+#define LOOP_CHILD			4
+#define LOOP_SIGREAD		5	/* Internal, reads delivered signals */
+
+/* Signals are read from a signalfd if the mask can be restored for child
+ * processes, otherwise the handler writes them to a pipe */
+#if HAVE_SYS_SIGNALFD_H && HAVE_SIGNALFD && HAVE_PTHREAD_ATFORK
+	#define LOOP_SIGNALFD	1
+#endif
+
+/* Child processes can be watched with a pidfd */
+#if HAVE_SYS_SYSCALL_H && defined(SYS_pidfd_open)
+	#define LOOP_PIDFD		1
+#endif
+
+struct ngim_event {
+	ngim_event_t *next;		/* In the list of signals, dead or free */
+	ngim_loop_t *loop;
+	int type;
+	int active;				/* Zero after cancelled or fired once */
+	ngim_event_func_t func;
+	void *data;
+	apr_pollfd_t pfd;		/* Files, children and the signal reader */
+	apr_pool_t *pool;		/* Children, holds the pidfd */
+	int sig;				/* Signals */
+	ngim_timer_t timer;		/* Timers, on ngim_clock_monotonic */
+	apr_interval_time_t repeat;
+};
+
+struct ngim_loop {
+	apr_pool_t *pool;
+	apr_pollset_t *pset;
+	int stop;
+	int count;				/* Active events, not counting internal */
+	ngim_event_t *signals;
+	ngim_wheel_t *wheel;	/* Timers */
+	ngim_event_t *dead;		/* Cancelled files, children and timers */
+	ngim_event_t *free;
+	ngim_event_t *sigread;	/* Reader for delivered signals */
+};
+
+/* Signals are process-wide, so is the state for delivering them */
+#if LOOP_SIGNALFD
+static sigset_t loop_sigmask;		/* Signals read from the signalfd */
+static sigset_t loop_sigorig;		/* Mask before the first signal */
+static int loop_sigfd = -1;
+#else
+static int loop_sigpipe[2] = { -1, -1 };
+#endif
+
+/*
+ * Signal delivery
+ */
+
+#if LOOP_SIGNALFD
+/* Restores the original signal mask in a forked child, which would
+ * otherwise keep the signals blocked even after exec */
+static void loop_atfork_child(void)
+{
+	sigprocmask(SIG_SETMASK, &loop_sigorig, NULL);
+}
+
+/* Starts reading sig from the signalfd, creating it if needed. Returns the
+ * descriptor, or -1 in case of failure. */
+static int loop_sigwatch(int sig)
+{
+	static int registered = 0;
+	sigset_t add;
+	int fd;
+
+	if (!registered) {
+		sigemptyset(&loop_sigmask);
+		sigprocmask(SIG_BLOCK, NULL, &loop_sigorig);
+
+		if (pthread_atfork(NULL, NULL, loop_atfork_child)) {
+			warn_error1("pthread_atfork failed");
+			return -1;
+		}
+		registered = 1;
+	}
+
+	sigaddset(&loop_sigmask, sig);
+
+	/* Block first, or a signal arriving before it is blocked would get
+	 * its default action instead of being read from the descriptor */
+	sigemptyset(&add);
+	sigaddset(&add, sig);
+	sigprocmask(SIG_BLOCK, &add, NULL);
+
+	if ((fd = signalfd(loop_sigfd, &loop_sigmask,
+			SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+		sigdelset(&loop_sigmask, sig);
+		if (!sigismember(&loop_sigorig, sig)) {
+			sigprocmask(SIG_UNBLOCK, &add, NULL);
+		}
+		warn_syserror1("signalfd failed");
+		return -1;
+	}
+	loop_sigfd = fd;
+
+	return fd;
+}
+
+/* Reads one delivered signal, returns zero if there are none. */
+static int loop_sigread(void)
+{
+	struct signalfd_siginfo info;
+
+	if (read(loop_sigfd, &info, sizeof(info)) != sizeof(info)) {
+		return 0;
+	}
+
+	return info.ssi_signo;
+}
+#else
+/* Writes the signal to the pipe, to be dispatched from the loop */
+static void loop_handler(int sig)
+{
+	unsigned char ch = sig;
+	int saved = errno;
+
+	if (write(loop_sigpipe[1], &ch, 1) == -1) {
+		/* The pipe is full, the signal will be lost */
+	}
+
+	errno = saved;
+}
+
+/* Starts delivering sig to the pipe, creating it if needed. Returns the
+ * read end, or -1 in case of failure. */
+static int loop_sigwatch(int sig)
+{
+	int i;
+
+	if (loop_sigpipe[0] == -1) {
+		if (pipe(loop_sigpipe) == -1) {
+			warn_syserror1("failed to create a pipe");
+			return -1;
+		}
+
+		for (i = 0; i < 2; ++i) {
+			fcntl(loop_sigpipe[i], F_SETFL, O_NONBLOCK);
+			fcntl(loop_sigpipe[i], F_SETFD, FD_CLOEXEC);
+		}
+	}
+
+	apr_signal(sig, loop_handler);
+	return loop_sigpipe[0];
+}
+
+/* Reads one delivered signal, returns zero if there are none. */
+static int loop_sigread(void)
+{
+	unsigned char ch;
+
+	if (read(loop_sigpipe[0], &ch, 1) != 1) {
+		return 0;
+	}
+
+	return ch;
+}
+#endif
+
+/*
+ * Events
+ */
+
+/* Returns an unused event, dies if out of memory */
+static ngim_event_t * loop_event(ngim_loop_t *loop, int type,
+		ngim_event_func_t func, void *data)
+{
+	ngim_event_t *ev;
+
+	if (loop->free) {
+		ev = loop->free;
+		loop->free = ev->next;
+	} else if (ALLOC_FAIL(ev, apr_palloc(loop->pool, sizeof(*ev)))) {
+		die_allocerror0();
+	}
+
+	memset(ev, 0, sizeof(*ev));
+	ev->loop = loop;
+	ev->type = type;
+	ev->active = 1;
+	ev->func = func;
+	ev->data = data;
+
+	if (type != LOOP_SIGREAD) {
+		++loop->count;
+	}
+
+	return ev;
+}
+
+/* Adds an event for a file to the pollset. Returns non-zero if
+ * successful. */
+static int loop_watch(ngim_loop_t *loop, ngim_event_t *ev, apr_file_t *file,
+		apr_int16_t events)
+{
+	apr_status_t status;
+
+	ev->pfd.desc_type = APR_POLL_FILE;
+	ev->pfd.reqevents = events;
+	ev->pfd.desc.f = file;
+	ev->pfd.client_data = ev;
+
+	if (APR_FAIL(status, apr_pollset_add(loop->pset, &ev->pfd))) {
+		warn_aprerror1(status, "failed to add a file to pollset");
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Returns an event that could not be set up to the free list */
+static void loop_discard(ngim_loop_t *loop, ngim_event_t *ev)
+{
+	--loop->count;
+	ev->active = 0;
+	ev->next = loop->free;
+	loop->free = ev;
+}
+
+/* Wraps a descriptor owned by the loop to apr_file_t */
+static apr_file_t * loop_file(int fd, apr_pool_t *pool)
+{
+	apr_status_t status;
+	apr_os_file_t os = fd;
+	apr_file_t *file;
+
+	if (APR_FAIL(status, apr_os_file_put(&file, &os, APR_FOPEN_READ,
+			pool))) {
+		warn_aprerror1(status, "apr_os_file_put failed");
+		return NULL;
+	}
+
+	return file;
+}
+
+/* Deactivates an event. Memory is reused only after the current round of
+ * dispatching, as the pollset results may still point to it. */
+static void loop_deactivate(ngim_event_t *ev)
+{
+	ngim_loop_t *loop = ev->loop;
+
+	if (!ev->active) {
+		return;
+	}
+
+	ev->active = 0;
+
+	if (ev->type != LOOP_SIGREAD) {
+		--loop->count;
+	}
+
+	switch (ev->type) {
+	case LOOP_FILE:
+	case LOOP_CHILD:
+		apr_pollset_remove(loop->pset, &ev->pfd);
+		break;
+	case LOOP_TIMER:
+		ngim_timer_cancel(&ev->timer);
+		break;
+	default:
+		/* Signals are unlinked by loop_collect */
+		return;
+	}
+
+	ev->next = loop->dead;
+	loop->dead = ev;
+}
+
+/* Moves inactive events to the free list. */
+static void loop_collect(ngim_loop_t *loop)
+{
+	ngim_event_t **p, *ev;
+
+	while ((ev = loop->dead)) {
+		loop->dead = ev->next;
+
+		if (ev->type == LOOP_CHILD) {
+			/* The pidfd belongs to the loop */
+			apr_file_close(ev->pfd.desc.f);
+			apr_pool_destroy(ev->pool);
+		}
+
+		ev->next = loop->free;
+		loop->free = ev;
+	}
+
+	for (p = &loop->signals; *p; ) {
+		if (!(*p)->active) {
+			ev = *p;
+			*p = ev->next;
+			ev->next = loop->free;
+			loop->free = ev;
+		} else {
+			p = &(*p)->next;
+		}
+	}
+}
+
+/* Dispatches delivered signals. */
+static void loop_signals(ngim_loop_t *loop)
+{
+	ngim_event_t *ev;
+	int sig;
+
+	while ((sig = loop_sigread()) > 0) {
+		for (ev = loop->signals; ev; ev = ev->next) {
+			if (ev->active && ev->sig == sig) {
+				ev->func(loop, ev, ev->data);
+			}
+		}
+	}
+}
+
+/* Calls the function of an expired timer. */
+static void loop_expired(ngim_timer_t *timer, void *data)
+{
+	ngim_loop_t *loop = data;
+	ngim_event_t *ev = (ngim_event_t *)
+		((char *)timer - APR_OFFSETOF(ngim_event_t, timer));
+	apr_time_t now;
+
+	if (loop->stop) {
+		/* Run later, unless cancelled before that */
+		ngim_wheel_add(loop->wheel, timer, timer->deadline);
+		return;
+	}
+
+	if (ev->repeat > 0) {
+		now = ngim_clock_monotonic();
+		timer->deadline += ev->repeat;
+		if (timer->deadline <= now) {
+			/* Missed some, don't try to catch up */
+			timer->deadline = now + ev->repeat;
+		}
+		ngim_wheel_add(loop->wheel, timer, timer->deadline);
+	} else {
+		loop_deactivate(ev);
+	}
+
+	ev->func(loop, ev, ev->data);
+}
+
+/*
+ * Public interface
+ */
+
+int ngim_loop_create(ngim_loop_t **loop, apr_pool_t *pool)
+{
+	apr_status_t status;
+	ngim_loop_t *l;
+
+	die_assert(loop);
+	die_assert(pool);
+
+	if (ALLOC_FAIL(l, apr_pcalloc(pool, sizeof(*l)))) {
+		die_allocerror0();
+	}
+
+	l->pool = pool;
+
+	if (ngim_wheel_create(&l->wheel, ngim_clock_monotonic(), pool) < 0) {
+		die_allocerror0();
+	}
+
+	if (APR_FAIL(status, apr_pollset_create(&l->pset, LOOP_MAX_FILES,
+			pool, 0))) {
+		warn_aprerror1(status, "failed to create pollset");
+		return -1;
+	}
+
+	*loop = l;
+	return 0;
+}
+
+ngim_event_t * ngim_loop_file(ngim_loop_t *loop, apr_file_t *file,
+		ngim_event_func_t func, void *data)
+{
+	ngim_event_t *ev;
+
+	die_assert(loop && file && func);
+
+	ev = loop_event(loop, LOOP_FILE, func, data);
+
+	if (!loop_watch(loop, ev, file, APR_POLLIN)) {
+		loop_discard(loop, ev);
+		return NULL;
+	}
+
+	return ev;
+}
+
+ngim_event_t * ngim_loop_signal(ngim_loop_t *loop, int sig,
+		ngim_event_func_t func, void *data)
+{
+	ngim_event_t *ev;
+	apr_file_t *file;
+	int fd;
+
+	die_assert(loop && func);
+	die_assert(sig > 0 && sig < NSIG);
+
+	if ((fd = loop_sigwatch(sig)) == -1) {
+		return NULL;
+	}
+
+	/* Start reading delivered signals */
+	if (!loop->sigread) {
+		if (!(file = loop_file(fd, loop->pool))) {
+			return NULL;
+		}
+
+		ev = loop_event(loop, LOOP_SIGREAD, NULL, NULL);
+
+		if (!loop_watch(loop, ev, file, APR_POLLIN)) {
+			ev->next = loop->free;
+			loop->free = ev;
+			return NULL;
+		}
+		loop->sigread = ev;
+	}
+
+	ev = loop_event(loop, LOOP_SIGNAL, func, data);
+	ev->sig = sig;
+	ev->next = loop->signals;
+	loop->signals = ev;
+
+	return ev;
+}
+
+ngim_event_t * ngim_loop_timer(ngim_loop_t *loop, apr_interval_time_t after,
+		apr_interval_time_t repeat, ngim_event_func_t func, void *data)
+{
+	ngim_event_t *ev;
+
+	die_assert(loop && func);
+
+	ev = loop_event(loop, LOOP_TIMER, func, data);
+	ev->repeat = repeat;
+	ngim_wheel_add(loop->wheel, &ev->timer,
+		ngim_clock_monotonic() + (after > 0 ? after : 0));
+
+	return ev;
+}
+
+ngim_event_t * ngim_loop_child(ngim_loop_t *loop, apr_proc_t *proc,
+		ngim_event_func_t func, void *data)
+{
+#if LOOP_PIDFD
+	apr_status_t status;
+	apr_pool_t *pool;
+	ngim_event_t *ev;
+	apr_file_t *file;
+	int fd;
+
+	die_assert(loop && proc && func);
+
+	if ((fd = syscall(SYS_pidfd_open, proc->pid, 0)) == -1) {
+		/* ENOSYS on older kernels, the caller should use SIGCHLD */
+		return NULL;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	/* Each child has a pool of its own, as a long running loop may watch
+	 * any number of them */
+	if (APR_FAIL(status, apr_pool_create(&pool, loop->pool))) {
+		warn_aprerror1(status, "failed to create a memory pool");
+		close(fd);
+		return NULL;
+	}
+
+	if (!(file = loop_file(fd, pool))) {
+		close(fd);
+		apr_pool_destroy(pool);
+		return NULL;
+	}
+
+	ev = loop_event(loop, LOOP_CHILD, func, data);
+	ev->pool = pool;
+
+	if (!loop_watch(loop, ev, file, APR_POLLIN)) {
+		apr_file_close(file);
+		apr_pool_destroy(pool);
+		loop_discard(loop, ev);
+		return NULL;
+	}
+
+	return ev;
+#else
+	die_assert(loop && proc && func);
+	return NULL;
+#endif
+}
+
+void ngim_loop_cancel(ngim_event_t *ev)
+{
+	if (ev) {
+		loop_deactivate(ev);
+	}
+}
+
+void ngim_loop_stop(ngim_loop_t *loop)
+{
+	die_assert(loop);
+	loop->stop = 1;
+}
+
+int ngim_loop_run(ngim_loop_t *loop)
+{
+	apr_status_t status;
+	apr_int32_t i, signaled;
+	const apr_pollfd_t *fds;
+	ngim_event_t *ev;
+
+	die_assert(loop);
+
+	loop->stop = 0;
+
+	while (!loop->stop && loop->count > 0) {
+		if (APR_FAIL(status, apr_pollset_poll(loop->pset,
+				ngim_wheel_timeout(loop->wheel, ngim_clock_monotonic()),
+				&signaled, &fds))) {
+			if (!APR_STATUS_IS_EINTR(status) &&
+				!APR_STATUS_IS_TIMEUP(status)) {
+				warn_aprerror1(status, "failed to poll for events");
+				return -1;
+			}
+			signaled = 0;
+		}
+
+		for (i = 0; i < signaled && !loop->stop; ++i) {
+			ev = fds[i].client_data;
+
+			if (!ev->active) {
+				/* Cancelled by an earlier callback */
+				continue;
+			}
+
+			switch (ev->type) {
+			case LOOP_SIGREAD:
+				loop_signals(loop);
+				break;
+			case LOOP_CHILD:
+				/* Fires only once */
+				loop_deactivate(ev);
+				/* No break */
+			default:
+				ev->func(loop, ev, ev->data);
+				break;
+			}
+		}
+
+		if (!loop->stop) {
+			ngim_wheel_expire(loop->wheel, ngim_clock_monotonic(),
+				loop_expired, loop);
+		}
+
+		loop_collect(loop);
+	}
+
+	return 0;
+}
@@ -12,46 +12,65 @@
 #include <apr_general.h>
 #include <apr_time.h>
 
-/* The maximum value for seconds in a TAI64 label */
-#define TAI_MAX_SEC		APR_UINT64_C(9223372036854775807) /* 2^63 - 1 */
-/* The maximum value for nano/attoseconds in a TAI64N(A) label */
-#define TAI_MAX_NA		UINT32_C(999999999)
 /* The maximum value for microseconds in apr_time_t */
 #define APR_MAX_U		UINT32_C(999999)
 
 
-/* Helper: converts from binary external format to textual external format */
-static inline void format_textual(char *s, const unsigned char *p, int l)
-{
-	static const char nibble_to_hex[] = "0123456789abcdef";
-	s[0] = '@';
-
-	while (--l >= 0) {
-		s[2 * l + 1] = nibble_to_hex[(p[l] >> 4) & 0xF];
-		s[2 * l + 2] = nibble_to_hex[ p[l]       & 0xF];
-	}
-}
-
-#define hex_to_nibble(c) \
-	((unsigned char)(((c) >= 'a') ? ((c) - 'a' + 10) : ((c) - '0')))
-
-/* Helper: converts from a textual external format to binary external format */
-static inline int unformat_textual(const char *s, unsigned char *p,
-		apr_off_t plen)
-{
-	apr_off_t i;
-
-	if (s[0] != '@') {
-		return 0;
-	}
-
-	for (i = 0; i < plen; ++i) {
-		p[i] = (hex_to_nibble(s[2 * i + 1]) << 4) |
-			   (hex_to_nibble(s[2 * i + 2]) & 0xF);
-	}
-
-	return 1;
-}
+/* Values of lowercase hex digits, other characters have NGIM_TAI_HEX_BAD
+ * set */
+const unsigned char ngim_tai_hex_value[256] = {
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+};
+
+/* Each byte as two lowercase hex digits */
+const char ngim_tai_hex_pair[512] =
+	"0001020304050607"
+	"08090a0b0c0d0e0f"
+	"1011121314151617"
+	"18191a1b1c1d1e1f"
+	"2021222324252627"
+	"28292a2b2c2d2e2f"
+	"3031323334353637"
+	"38393a3b3c3d3e3f"
+	"4041424344454647"
+	"48494a4b4c4d4e4f"
+	"5051525354555657"
+	"58595a5b5c5d5e5f"
+	"6061626364656667"
+	"68696a6b6c6d6e6f"
+	"7071727374757677"
+	"78797a7b7c7d7e7f"
+	"8081828384858687"
+	"88898a8b8c8d8e8f"
+	"9091929394959697"
+	"98999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7"
+	"a8a9aaabacadaeaf"
+	"b0b1b2b3b4b5b6b7"
+	"b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7"
+	"c8c9cacbcccdcecf"
+	"d0d1d2d3d4d5d6d7"
+	"d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7"
+	"e8e9eaebecedeeef"
+	"f0f1f2f3f4f5f6f7"
+	"f8f9fafbfcfdfeff";
 
 /* Helper: converts APR seconds to TAI seconds */
 #define tai_sec_from_apr(a) \
@@ -75,8 +94,12 @@ void ngim_tai_from_apr(ngim_tai_t *t, apr_time_t a)
 
 void ngim_tai_now(ngim_tai_t *t)
 {
+	ngim_tain_t now;
+
 	die_assert(t);
-	t->x = tai_sec_from_apr(apr_time_now());
+
+	ngim_clock_now(&now);
+	*t = now.sec;
 }
 
 int ngim_tai_less(const ngim_tai_t *t, const ngim_tai_t *u)
@@ -118,26 +141,19 @@ int ngim_tai_unpack(const unsigned char *s, ngim_tai_t *t)
 	x <<= 8; x += s[7];
 	t->x = x;
 
-	return (x <= TAI_MAX_SEC);
+	return (x <= NGIM_TAI_MAX_SEC);
 }
 
 void ngim_tai_format(char *s, const ngim_tai_t *t)
 {
-	unsigned char p[NGIM_TAI_PACK];
-
 	die_assert(s && t);
-
-	ngim_tai_pack(p, t);
-	format_textual(s, p, NGIM_TAI_PACK);
+	ngim_tai_encode(s, t);
 }
 
 int ngim_tai_unformat(const char *s, ngim_tai_t *t)
 {
-	unsigned char p[NGIM_TAI_PACK];
-
 	die_assert(s && t);
-
-	return (unformat_textual(s, p, NGIM_TAI_PACK) && ngim_tai_unpack(p, t));
+	return ngim_tai_decode(s, t);
 }
 
 void ngim_tain_from_apr(ngim_tain_t *t, apr_time_t a)
@@ -175,7 +191,7 @@ void ngim_tain_to_tai(const ngim_tain_t *ta, ngim_tai_t *t)
 
 void ngim_tain_now(ngim_tain_t *t)
 {
-	ngim_tain_from_apr(t, apr_time_now());
+	ngim_clock_now(t);
 }
 
 int ngim_tain_less(const ngim_tain_t *t, const ngim_tain_t *u)
@@ -239,7 +255,7 @@ int ngim_tain_unpack(const unsigned char *s, ngim_tain_t *t)
 		x <<= 8; x += s[3];
 		t->nano = x;
 
-		return (x <= TAI_MAX_NA);
+		return (x <= NGIM_TAI_MAX_NANO);
 	}
 
 	return 0;
@@ -247,19 +263,42 @@ int ngim_tain_unpack(const unsigned char *s, ngim_tain_t *t)
 
 void ngim_tain_format(char *s, const ngim_tain_t *t)
 {
-	unsigned char p[NGIM_TAIN_PACK];
+	die_assert(s && t);
+	ngim_tain_encode(s, t);
+}
+
+int ngim_tain_unformat(const char *s, ngim_tain_t *t)
+{
+	die_assert(s && t);
+	return ngim_tain_decode(s, t);
+}
 
+void ngim_tain_format_n(char *s, apr_size_t stride, const ngim_tain_t *t,
+		apr_size_t n)
+{
 	die_assert(s && t);
+	die_assert(stride >= NGIM_TAIN_FORMAT);
 
-	ngim_tain_pack(p, t);
-	format_textual(s, p, NGIM_TAIN_PACK);
+	while (n-- > 0) {
+		ngim_tain_encode(s, t++);
+		s += stride;
+	}
 }
 
-int ngim_tain_unformat(const char *s, ngim_tain_t *t)
+apr_size_t ngim_tain_unformat_n(const char *s, apr_size_t stride,
+		ngim_tain_t *t, apr_size_t n)
 {
-	unsigned char p[NGIM_TAIN_PACK];
+	apr_size_t i;
 
 	die_assert(s && t);
+	die_assert(stride >= NGIM_TAIN_FORMAT);
+
+	for (i = 0; i < n; ++i) {
+		if (!ngim_tain_decode(s, &t[i])) {
+			break;
+		}
+		s += stride;
+	}
 
-	return (unformat_textual(s, p, NGIM_TAIN_PACK) && ngim_tain_unpack(p, t));
+	return i;
 }
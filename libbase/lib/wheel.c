@@ -0,0 +1,320 @@
+/*
+ * wheel.c
+ *
+ * Copyright  2005, 2006, 2007  Sami Tolvanen <sami@ngim.org>
+ */
+
+#include "common.h"
+#include "base.h"
+
+/* A tick is one millisecond, each level has 64 slots, and five levels cover
+ * more than 12 days. Timers further away wait in an overflow list. */
+#define WHEEL_RESOLUTION	1000
+#define WHEEL_BITS			6
+#define WHEEL_SLOTS			(1 << WHEEL_BITS)
+#define WHEEL_MASK			(WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS		5
+
+/* Bit position of a level in a tick */
+#define WHEEL_SHIFT(level)	((level) * WHEEL_BITS)
+
+struct ngim_wheel {
+	apr_uint64_t tick;		/* Next tick to process */
+	apr_size_t count;		/* Pending timers */
+	apr_uint64_t used[WHEEL_LEVELS];	/* Slots that may have timers */
+	ngim_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	ngim_timer_t *overflow;
+};
+
+/* Returns the tick of a time, rounded up so that timers never expire
+ * early */
+static inline apr_uint64_t wheel_tick(apr_time_t t)
+{
+	if (t <= 0) {
+		return 0;
+	}
+	return ((apr_uint64_t)t + WHEEL_RESOLUTION - 1) / WHEEL_RESOLUTION;
+}
+
+/* Links a timer to the head of a list */
+static inline void wheel_link(ngim_timer_t **head, ngim_timer_t *timer)
+{
+	timer->next = *head;
+	timer->prev = head;
+
+	if (*head) {
+		(*head)->prev = &timer->next;
+	}
+	*head = timer;
+}
+
+/* Unlinks a timer from the list it is in */
+static inline void wheel_unlink(ngim_timer_t *timer)
+{
+	*timer->prev = timer->next;
+
+	if (timer->next) {
+		timer->next->prev = timer->prev;
+	}
+
+	timer->next = NULL;
+	timer->prev = NULL;
+}
+
+/* Puts a timer to the slot matching its deadline. A timer goes to the
+ * lowest level on which it shares all higher bits with the current tick,
+ * so it moves down a level each time the wheel turns to its slot. */
+static void wheel_place(ngim_wheel_t *wheel, ngim_timer_t *timer)
+{
+	apr_uint64_t tick = wheel_tick(timer->deadline);
+	unsigned int level, slot;
+
+	if (tick < wheel->tick) {
+		/* Already due, expires on the next tick */
+		tick = wheel->tick;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS; ++level) {
+		if ((tick >> WHEEL_SHIFT(level + 1)) ==
+				(wheel->tick >> WHEEL_SHIFT(level + 1))) {
+			slot = (tick >> WHEEL_SHIFT(level)) & WHEEL_MASK;
+			wheel_link(&wheel->slots[level][slot], timer);
+			wheel->used[level] |= APR_UINT64_C(1) << slot;
+			return;
+		}
+	}
+
+	wheel_link(&wheel->overflow, timer);
+}
+
+/* Moves timers from a list back to the wheel. The list is detached
+ * first, as timers still out of range return to the overflow list. */
+static void wheel_cascade(ngim_wheel_t *wheel, ngim_timer_t **head)
+{
+	ngim_timer_t *list = *head, *timer;
+
+	*head = NULL;
+
+	if (list) {
+		list->prev = &list;
+	}
+
+	while ((timer = list)) {
+		wheel_unlink(timer);
+		wheel_place(wheel, timer);
+	}
+}
+
+/* Returns the index of the first used slot at or after slot on a level,
+ * or -1 if there are none before the level turns around. Clears bits of
+ * slots that have become empty. */
+static int wheel_next(ngim_wheel_t *wheel, unsigned int level,
+		unsigned int slot)
+{
+	apr_uint64_t used;
+	int i;
+
+	while (slot < WHEEL_SLOTS) {
+		used = wheel->used[level] >> slot;
+
+		if (!used) {
+			break;
+		}
+
+		/* Skip to the next set bit */
+		for (i = slot; !(used & 1); ++i) {
+			used >>= 1;
+		}
+
+		if (wheel->slots[level][i]) {
+			return i;
+		}
+
+		wheel->used[level] &= ~(APR_UINT64_C(1) << i);
+		slot = i + 1;
+	}
+
+	return -1;
+}
+
+/* Returns the next tick at which a timer expires or moves between levels.
+ * Returns zero if there are no timers. */
+static apr_uint64_t wheel_due(ngim_wheel_t *wheel)
+{
+	apr_uint64_t base;
+	unsigned int level, slot;
+	int next;
+
+	if (!wheel->count) {
+		return 0;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS; ++level) {
+		slot = (wheel->tick >> WHEEL_SHIFT(level)) & WHEEL_MASK;
+
+		/* Timers on higher levels are always in later slots, and the
+		 * current slot on the lowest level is still to be processed */
+		if ((next = wheel_next(wheel, level, level ? slot + 1 : slot)) < 0) {
+			continue;
+		}
+
+		base = wheel->tick >> WHEEL_SHIFT(level + 1) << WHEEL_SHIFT(level + 1);
+		return base | ((apr_uint64_t)next << WHEEL_SHIFT(level));
+	}
+
+	/* Only overflowing timers, which are looked at when the top level turns
+	 * around */
+	base = wheel->tick >> WHEEL_SHIFT(WHEEL_LEVELS);
+	return (base + 1) << WHEEL_SHIFT(WHEEL_LEVELS);
+}
+
+/* Moves the wheel to a tick, cascading timers from each level that turns
+ * on the way */
+static void wheel_turn(ngim_wheel_t *wheel, apr_uint64_t tick)
+{
+	int level;
+
+	wheel->tick = tick;
+
+	if (tick & WHEEL_MASK) {
+		return;
+	}
+
+	/* Level n turns when the bits of all levels below it are zero. Find
+	 * the highest level that turned, and cascade from the top so that
+	 * timers pass through each level between. */
+	for (level = 1; level < WHEEL_LEVELS; ++level) {
+		if (tick & ((apr_uint64_t)WHEEL_MASK << WHEEL_SHIFT(level))) {
+			break;
+		}
+	}
+
+	if (level == WHEEL_LEVELS) {
+		wheel_cascade(wheel, &wheel->overflow);
+		--level;
+	}
+
+	for (; level > 0; --level) {
+		wheel_cascade(wheel, &wheel->slots[level]
+			[(tick >> WHEEL_SHIFT(level)) & WHEEL_MASK]);
+	}
+}
+
+/*
+ * Public interface
+ */
+
+int ngim_wheel_create(ngim_wheel_t **wheel, apr_time_t now, apr_pool_t *pool)
+{
+	ngim_wheel_t *w;
+
+	die_assert(wheel);
+	die_assert(pool);
+
+	if (ALLOC_FAIL(w, apr_pcalloc(pool, sizeof(*w)))) {
+		return -1;
+	}
+
+	w->tick = wheel_tick(now);
+
+	*wheel = w;
+	return 0;
+}
+
+void ngim_wheel_add(ngim_wheel_t *wheel, ngim_timer_t *timer,
+		apr_time_t deadline)
+{
+	die_assert(wheel);
+	die_assert(timer);
+
+	if (timer->prev) {
+		/* Moved to a new deadline */
+		wheel_unlink(timer);
+	} else {
+		++wheel->count;
+	}
+
+	timer->wheel = wheel;
+	timer->deadline = deadline;
+	wheel_place(wheel, timer);
+}
+
+void ngim_timer_cancel(ngim_timer_t *timer)
+{
+	die_assert(timer);
+
+	if (!timer->prev) {
+		return;
+	}
+
+	wheel_unlink(timer);
+	--timer->wheel->count;
+}
+
+apr_interval_time_t ngim_wheel_timeout(ngim_wheel_t *wheel, apr_time_t now)
+{
+	apr_uint64_t due;
+	apr_time_t at;
+
+	die_assert(wheel);
+
+	if (!(due = wheel_due(wheel))) {
+		return -1;
+	}
+
+	at = (apr_time_t)(due * WHEEL_RESOLUTION);
+	return (at > now) ? at - now : 0;
+}
+
+apr_size_t ngim_wheel_expire(ngim_wheel_t *wheel, apr_time_t now,
+		ngim_timer_func_t func, void *data)
+{
+	apr_uint64_t due, last;
+	apr_size_t expired = 0;
+	ngim_timer_t *batch, *timer;
+	unsigned int slot;
+
+	die_assert(wheel);
+	die_assert(func);
+
+	if (now < 0) {
+		return 0;
+	}
+
+	/* The last tick that has fully passed */
+	last = (apr_uint64_t)now / WHEEL_RESOLUTION;
+
+	while ((due = wheel_due(wheel)) && due <= last) {
+		if (due != wheel->tick) {
+			wheel_turn(wheel, due);
+			continue;
+		}
+
+		/* Take the whole slot at once and move on, so that timers the
+		 * callbacks add for now expire on the next tick */
+		slot = due & WHEEL_MASK;
+		batch = wheel->slots[0][slot];
+		wheel->slots[0][slot] = NULL;
+		wheel->used[0] &= ~(APR_UINT64_C(1) << slot);
+
+		if (batch) {
+			batch->prev = &batch;
+		}
+
+		wheel_turn(wheel, due + 1);
+
+		while ((timer = batch)) {
+			wheel_unlink(timer);
+			--wheel->count;
+			++expired;
+			func(timer, data);
+		}
+	}
+
+	if (last >= wheel->tick) {
+		/* Nothing more is due, the levels between are empty */
+		wheel_turn(wheel, last + 1);
+	}
+
+	return expired;
+}
@@ -63,6 +63,9 @@
 #if HAVE_SYS_RESOURCE_H
 	#include <sys/resource.h>
 #endif
+#if HAVE_SYS_WAIT_H
+	#include <sys/wait.h>
+#endif
 
 /* Make sure we have RLIM_NLIMITS */
 #if !defined(RLIM_NLIMITS)
@@ -100,6 +103,18 @@
 	#include <arpa/inet.h>
 #endif
 
+#if HAVE_SYS_INOTIFY_H
+	#include <sys/inotify.h>
+#endif
+
+#if HAVE_SYS_IOCTL_H
+	#include <sys/ioctl.h>
+#endif
+
+#if HAVE_REGEX_H
+	#include <regex.h>
+#endif
+
 #if !HAVE_ALARM
 	#error Function missing: alarm
 #endif
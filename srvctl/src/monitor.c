@@ -6,11 +6,14 @@
 
 #include "common.h"
 #include "srvctl.h"
+#include <apr_env.h>
 #include <apr_general.h>
 #include <apr_file_info.h>
 #include <apr_file_io.h>
+#include <apr_mmap.h>
+#include <apr_network_io.h>
 #include <apr_poll.h>
-#include <apr_signal.h>
+#include <apr_portable.h>
 #include <apr_strings.h>
 #include <apr_thread_proc.h>
 #include <ngim/base.h>
@@ -20,40 +23,200 @@
 
 /* Parameters, times are in seconds */
 #define PAUSE_FAILURE		5		/* Pause if command poll/read fails */
-#define PAUSE_RESPAWN		1		/* Pause after starting a child */
-#define PAUSE_TERMWAIT		10		/* Max. time to wait for a child to die */
-#define TIMEOUT_POLL		3600	/* Timeout for polling commands */
-#define TIMER_CHILD			10		/* Time between suspension checks */
-#define CHILD_MAXSTARTS		2		/* Max. allowed restarts in TIMER_CHILD */
-#define CHILD_SUSPENSION	3		/* Number of TIMER_CHILD's to suspend */
+#define PAUSE_TERMWAIT		10		/* Default time to wait for a signal to work */
+
+/* Files in the service directory */
+#define SETTING_MAXSIZE		1024	/* Max. bytes read from a file */
+#define SETTING_SEPARATORS	" \t\r\n"
+
+/* Restart policy defaults, times are in milliseconds */
+#define RESTART_DELAY		1000	/* Delay after the first failure */
+#define RESTART_MULTIPLIER	2.0		/* Growth of the delay per failure */
+#define RESTART_MAXDELAY	60000	/* Max. delay */
+#define RESTART_JITTER		0.1		/* Max. random change, as a fraction */
+#define RESTART_STABLE		10000	/* Uptime after which exits don't count */
+
+/* Listening sockets */
+#define SOCKETS_MAX			16		/* Max. sockets passed to run */
+#define SOCKETS_BACKLOG		128		/* Max. pending connections */
+
+/* Output of run while log is down, sizes are in kilobytes */
+#define LOG_PIPESIZE		256		/* Requested size of pipe_runlog */
+#define LOG_SPOOLSIZE		1024	/* Max. output kept for log */
+#define LOG_CHUNK			4096	/* Bytes read or written at a time */
+#define LOG_MARGIN			16384	/* Room left for run when replaying */
+#define LOG_DRAINREADS		64		/* Max. reads when log is started */
+#define LOG_RETRY			100		/* Milliseconds between replays */
+
+/* Health check defaults, times are in milliseconds */
+#define CHECK_INTERVAL		10000	/* Time between checks */
+#define CHECK_TIMEOUT		5000	/* Time a check may take */
+#define CHECK_FAILURES		3		/* Failures in a row before a restart */
+
+/* Termination */
+#define STOP_MAXSIGNALS		16		/* Max. length of the signal sequence */
+#define STOP_NONE			0		/* Not being terminated */
+#define STOP_ACTIVE			1		/* Signals are being sent */
+#define STOP_ABANDONED		2		/* Survived the whole sequence */
+
+/* Readiness notification */
+#define READY_NONE			0		/* Not notifying */
+#define READY_WAITING		1		/* Started, hasn't notified yet */
+#define READY_DONE			2		/* Notified */
+#define READY_TIMEOUT		3		/* Didn't notify in time */
 
 /* Flags */
 static int flag_stop = 0;		/* Stop monitor, i.e. exit the main loop */
 static int flag_intr = 0;		/* Received a signal, don't restart children */
 static int flag_forward = 0;	/* Output of run is forwarded to pipe_runlog */
-static int flag_ignchld = 0;	/* Do nothing on SIGCHLD */
-static int flag_timer = 0;		/* Suspension timer active */
+static int flag_overlap = 0;	/* Restart run by starting a new one first */
+
+/* Event loop */
+static ngim_loop_t *loop = NULL;
+static ngim_event_t *signal_chld = NULL;	/* Until children have pidfds */
+static ngim_event_t *control_watch = NULL;	/* Reads pipe_control */
+static apr_pool_t *pool_loop = NULL;	/* Cleared after each event */
 
 /* Files and pipes */
 static apr_file_t *file_lock = NULL;
 static apr_file_t *pipe_control = NULL;
 static apr_file_t *pipe_stdin = NULL;	/* To run's stdin */
 static apr_file_t *pipe_runlog[2] = { NULL, NULL }; /* From run to logger */
-static apr_pollset_t *pset_control = NULL;
 static apr_pool_t *pool_runlog = NULL;
+static apr_size_t pipe_size = 0;		/* Of pipe_runlog, zero if unknown */
+static char *spool_buf = NULL;		/* Output of run while log is down */
+static apr_size_t spool_len = 0;		/* Bytes in spool_buf */
+static apr_uint64_t spool_dropped = 0;	/* Bytes that didn't fit */
+static int spool_full = 0;			/* Dropping output, warned once */
+static ngim_event_t *spool_watch = NULL;	/* Reads pipe_runlog */
+static ngim_event_t *spool_replay = NULL;	/* Timer for replaying the rest */
+static monitor_status *status_record = NULL;	/* FILE_STATUS in memory */
+static apr_socket_t *sockets[SOCKETS_MAX];	/* Passed to run */
+static apr_size_t sockets_count = 0;
+static apr_file_t *pipe_notify[2] = { NULL, NULL }; /* From run to monitor */
+static apr_pool_t *pool_notify = NULL;
+static ngim_event_t *notify_watch = NULL;	/* Reads pipe_notify */
+static char notify_buf[sizeof(MONITOR_NOTIFY_READY) - 1];
+static apr_size_t notify_len = 0;		/* Bytes in notify_buf */
 
 /* Children */
 typedef struct {
 	const char *progname;	/* Name of the program to execute */
 	apr_proc_t proc;		/* Process information */
 	ngim_tain_t changed;	/* Last started or stopped */
-	apr_uint32_t starts;	/* Start attempts within TIMER_CHILD */
-	int suspended;			/* Process suspended? */
-	int suspended_periods;	/* Number of TIMER_CHILD's suspended */
+	apr_time_t started;		/* Last started, from ngim_clock_monotonic */
+	apr_time_t stopped;		/* Last reaped, from ngim_clock_monotonic */
+	apr_uint32_t starts;	/* Times started */
+	monitor_usage usage;	/* Resources used by the last exited process */
+	monitor_usage total;	/* Resources used by all exited processes */
+	apr_uint32_t failures;	/* Exits before a stable uptime in a row */
+	apr_interval_time_t delay;	/* Time to wait after stopped */
+	ngim_event_t *respawn;	/* Timer for a delayed start */
+	ngim_event_t *exited;	/* Watches the process for exit */
+	ngim_event_t *escalate;	/* Timer for the next signal when stopping */
+	int stopping;			/* STOP_NONE, STOP_ACTIVE or STOP_ABANDONED */
+	apr_size_t stopstep;	/* Signals sent while stopping */
+	int ready;				/* READY_NONE, READY_WAITING, ... */
+	ngim_tain_t readied;	/* Last notified ready */
+	ngim_event_t *unready;	/* Timer for not notifying in time */
 } child_proc;
 
 static child_proc run;
 static child_proc log;
+static child_proc retired;	/* Old run in an overlapping restart */
+
+/* Health checks of run with FILE_CHECK */
+typedef struct {
+	apr_proc_t proc;		/* Process information */
+	apr_time_t started;		/* From ngim_clock_monotonic */
+	ngim_event_t *timer;	/* Next check, or the timeout of a running one */
+	ngim_event_t *exited;	/* Watches the process for exit */
+	int discard;			/* Ignore the result of the running check */
+	apr_uint32_t count;		/* Checks done */
+	apr_uint32_t failures;	/* Checks failed in a row */
+	apr_uint32_t latency;	/* Milliseconds the last check took */
+	apr_uint32_t result;	/* MONITOR_CHECK_* */
+	ngim_tain_t checked;	/* Last check done */
+} health_probe;
+
+static health_probe probe;
+
+/* Signals sent to terminate a child, and the time to wait after each */
+typedef struct {
+	apr_size_t count;
+	int sigs[STOP_MAXSIGNALS];
+	apr_interval_time_t waits[STOP_MAXSIGNALS];
+} stop_sequence;
+
+static stop_sequence stop_seq;
+
+/* When to restart a child that exits */
+typedef struct {
+	apr_interval_time_t delay;
+	double multiplier;
+	apr_interval_time_t maxdelay;
+	double jitter;
+	apr_interval_time_t stable;
+} restart_policy;
+
+static restart_policy restart = {
+	RESTART_DELAY * 1000,
+	RESTART_MULTIPLIER,
+	RESTART_MAXDELAY * 1000,
+	RESTART_JITTER,
+	RESTART_STABLE * 1000
+};
+
+/* How run is checked, if FILE_CHECK exists */
+typedef struct {
+	int enabled;
+	apr_interval_time_t interval;
+	apr_interval_time_t timeout;
+	apr_uint32_t failures;
+} check_policy;
+
+static check_policy checking = {
+	0,
+	CHECK_INTERVAL * 1000,
+	CHECK_TIMEOUT * 1000,
+	CHECK_FAILURES
+};
+
+/* Whether run notifies when it's ready, and how long to wait for it */
+typedef struct {
+	int enabled;
+	apr_interval_time_t timeout;	/* Zero waits forever */
+} notify_policy;
+
+static notify_policy notify = { 0, 0 };
+
+/* How run's output is kept while log is down, from FILE_LOGPOLICY */
+typedef struct {
+	apr_size_t pipesize;	/* Zero keeps the default */
+	apr_size_t spoolsize;	/* Zero disables spooling */
+} log_policy;
+
+static log_policy logging = {
+	LOG_PIPESIZE * 1024,
+	LOG_SPOOLSIZE * 1024
+};
+
+/* Signal names accepted in FILE_STOPSIGNALS, in addition to numbers */
+static const struct {
+	const char *name;
+	int sig;
+} stop_signames[] = {
+	{ "HUP",	SIGHUP },
+	{ "INT",	SIGINT },
+	{ "QUIT",	SIGQUIT },
+	{ "KILL",	SIGKILL },
+	{ "USR1",	SIGUSR1 },
+	{ "USR2",	SIGUSR2 },
+	{ "ALRM",	SIGALRM },
+	{ "TERM",	SIGTERM },
+	{ "CONT",	SIGCONT },
+	{ NULL,		0 }
+};
 
 /* Error function called on platforms using fork in case exec fails (in the
  * child process). */
@@ -128,8 +291,47 @@ static void create_lockfile()
 	}
 }
 
-/* Makes sure DIR_MONITOR exists with proper permissions, sets up a control
- * pipe, pollset for it, a pipe for run's stdin, and a pipe subpool. */
+/* Opens FILE_STATUS and maps it to memory for updating in place. Dies in
+ * case of failure. */
+static void create_statusfile()
+{
+	apr_status_t status;
+	apr_file_t *file;
+	apr_mmap_t *mm;
+
+	if (APR_FAIL(status,
+			apr_file_open(&file, FILE_STATUS, APR_FOPEN_CREATE |
+				APR_FOPEN_READ | APR_FOPEN_WRITE | APR_FOPEN_BINARY,
+				FPROT_FILE_STATUS, g_pool))) {
+		die_aprerror1(status, "failed to open " FILE_STATUS);
+	}
+#if MONITOR_SET_PERMS_FOR_EXISTING
+	if (APR_FAIL(status, apr_file_perms_set(FILE_STATUS, FPROT_FILE_STATUS))) {
+		die_aprerror2(status, "failed to set permissions for ", FILE_STATUS);
+	}
+#endif
+
+	/* The size never changes after this, so readers can't map past the
+	 * end of the file */
+	if (APR_FAIL(status, apr_file_trunc(file, MONITOR_STATUS_SIZE)) ||
+		APR_FAIL(status, apr_mmap_create(&mm, file, 0, MONITOR_STATUS_SIZE,
+				APR_MMAP_READ | APR_MMAP_WRITE, g_pool))) {
+		die_aprerror1(status, "failed to map " FILE_STATUS);
+	}
+
+	/* The mapping stays */
+	apr_file_close(file);
+
+	status_record = mm->mm;
+
+	/* A previous monitor may have died in the middle of an update */
+	if (status_record->sequence & 1) {
+		++status_record->sequence;
+	}
+}
+
+/* Makes sure DIR_MONITOR exists with proper permissions, sets up the status
+ * record, a control pipe, a pipe for run's stdin, and a pipe subpool. */
 static void setup_monitor(apr_pool_t *pool)
 {
 	apr_status_t status;
@@ -144,20 +346,20 @@ static void setup_monitor(apr_pool_t *pool)
 	/* Make sure there is only one monitor running for each service */
 	create_lockfile();
 
+	/* Map the status record */
+	create_statusfile();
+
 	/* Create the control pipe */
 	create_namedpipe(&pipe_control, PIPE_CONTROL, FPROT_PIPE_CONTROL, pool);
 
-	/* Create a pollset for polling the control pipe */
-	if (ngim_create_pollset_file_in(&pset_control, pipe_control, g_pool) < 0) {
-		die_error1("failed to set up polling for " PIPE_CONTROL);
-	}
-
 	/* Create a pipe to run's stdin */
 	create_namedpipe(&pipe_stdin, PIPE_STDIN, FPROT_PIPE_STDIN, pool);
 
-	/* Create a subpool for storing pipe_runlog, which may need to be stored
-	 * for a while, yet is possibly repeatedly recreated */
-	if (APR_FAIL(status, apr_pool_create(&pool_runlog, g_pool))) {
+	/* Create subpools for storing pipe_runlog and pipe_notify, which may
+	 * need to be stored for a while, yet are possibly repeatedly
+	 * recreated */
+	if (APR_FAIL(status, apr_pool_create(&pool_runlog, g_pool)) ||
+		APR_FAIL(status, apr_pool_create(&pool_notify, g_pool))) {
 		die_aprerror1(status, "failed to create a memory pool");
 	}
 }
@@ -169,6 +371,13 @@ static inline void close_pipe()
 {
 	die_assert(pool_runlog);
 
+	/* Whatever is spooled waits for the next pipe */
+	ngim_loop_cancel(spool_watch);
+	spool_watch = NULL;
+	ngim_loop_cancel(spool_replay);
+	spool_replay = NULL;
+	pipe_size = 0;
+
 	if (pipe_runlog[0]) {
 		apr_file_close(pipe_runlog[0]);
 		pipe_runlog[0] = NULL;
@@ -184,6 +393,31 @@ static inline void close_pipe()
 	apr_pool_clear(pool_runlog);
 }
 
+/* Resizes pipe_runlog as requested in FILE_LOGPOLICY, so that run can
+ * write more before it blocks if log falls behind. */
+static void size_pipe()
+{
+#if defined(F_SETPIPE_SZ) && defined(F_GETPIPE_SZ)
+	apr_os_file_t fd;
+	int size;
+
+	die_assert(pipe_runlog[1]);
+
+	if (apr_os_file_get(&fd, pipe_runlog[1]) != APR_SUCCESS) {
+		return;
+	}
+
+	if (logging.pipesize &&
+		fcntl(fd, F_SETPIPE_SZ, (int)logging.pipesize) == -1) {
+		warn_aprerror1(apr_get_os_error(), "failed to resize the pipe");
+	}
+
+	if ((size = fcntl(fd, F_GETPIPE_SZ)) > 0) {
+		pipe_size = (apr_size_t)size;
+	}
+#endif
+}
+
 /* Creates pipe_runlog for interprocess communication between run and
  * log, if it doesn't exist already. Returns non-zero if the pipe was
  * already open or was successfully created. */
@@ -208,12 +442,123 @@ static inline int create_pipe()
 
 		die_assert(pipe_runlog[0]);
 		die_assert(pipe_runlog[1]);
+
+		size_pipe();
 	}
 
 	/* The pipe is ready */
 	return 1;
 }
 
+/* Stops reading pipe_notify, closes both ends, and clears pool_notify. */
+static void close_notify()
+{
+	die_assert(pool_notify);
+
+	ngim_loop_cancel(notify_watch);
+	notify_watch = NULL;
+
+	pipe_notify[0] = NULL;
+	pipe_notify[1] = NULL;
+	notify_len = 0;
+
+	/* The pipe goes with the pool */
+	apr_pool_clear(pool_notify);
+}
+
+/* Creates pipe_notify for run to tell when it's ready, and puts the
+ * number of its inherited writing end to ENV_SRVCTL_NOTIFY. Returns
+ * non-zero if successful. */
+static int create_notify(apr_pool_t *pool)
+{
+	apr_status_t status;
+	apr_os_file_t fd;
+	char *str;
+
+	die_assert(pool);
+
+	close_notify();
+
+	if (APR_FAIL(status,
+			apr_file_pipe_create(&pipe_notify[0], &pipe_notify[1],
+				pool_notify)) ||
+		APR_FAIL(status, apr_file_inherit_unset(pipe_notify[0])) ||
+		APR_FAIL(status, apr_file_inherit_set(pipe_notify[1])) ||
+		APR_FAIL(status, apr_os_file_get(&fd, pipe_notify[1]))) {
+		warn_aprerror1(status, "failed to create a readiness channel");
+		close_notify();
+		return 0;
+	}
+
+	if (ALLOC_FAIL(str, apr_psprintf(pool, "%i", fd))) {
+		warn_allocerror0();
+		close_notify();
+		return 0;
+	}
+
+	if (APR_FAIL(status, apr_env_set(ENV_SRVCTL_NOTIFY, str, pool))) {
+		warn_aprerror1(status, "failed to set " ENV_SRVCTL_NOTIFY);
+		close_notify();
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Lets run inherit the listening sockets, and puts their numbers in
+ * ENV_SRVCTL_LISTEN, separated by spaces. Returns non-zero if
+ * successful. */
+static int pass_sockets(apr_pool_t *pool)
+{
+	apr_status_t status;
+	apr_os_sock_t fd;
+	apr_size_t i;
+	char *list = "";
+
+	die_assert(pool);
+
+	for (i = 0; i < sockets_count; ++i) {
+		if (APR_FAIL(status, apr_socket_inherit_set(sockets[i])) ||
+			APR_FAIL(status, apr_os_sock_get(&fd, sockets[i]))) {
+			warn_aprerror1(status, "failed to pass sockets");
+			return 0;
+		}
+
+		if (ALLOC_FAIL(list,
+				apr_psprintf(pool, i ? "%s %i" : "%s%i", list, fd))) {
+			warn_allocerror0();
+			return 0;
+		}
+	}
+
+	if (APR_FAIL(status, apr_env_set(ENV_SRVCTL_LISTEN, list, pool))) {
+		warn_aprerror1(status, "failed to set " ENV_SRVCTL_LISTEN);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Keeps the listening sockets from other children after run has been
+ * started. */
+static void keep_sockets(apr_pool_t *pool)
+{
+	apr_status_t status;
+	apr_size_t i;
+
+	die_assert(pool);
+
+	for (i = 0; i < sockets_count; ++i) {
+		if (APR_FAIL(status, apr_socket_inherit_unset(sockets[i]))) {
+			warn_aprerror1(status, "failed to keep sockets");
+		}
+	}
+
+	if (APR_FAIL(status, apr_env_delete(ENV_SRVCTL_LISTEN, pool))) {
+		warn_aprerror1(status, "failed to unset " ENV_SRVCTL_LISTEN);
+	}
+}
+
 /* Returns non-zero if FILE_UP exists. */
 static inline int check_fileup(apr_pool_t *pool)
 {
@@ -235,68 +580,313 @@ static inline int check_fileup(apr_pool_t *pool)
 	return 1;
 }
 
-/* Writes current status to FILE_STATUS. Should be called only when something
- * has changed. */
-static void write_status(apr_pool_t *pool)
+/* Returns non-zero if FILE_LOG exists, whether it's running or not. */
+static inline int check_filelog(apr_pool_t *pool)
 {
-	apr_status_t status;
-	apr_file_t *file;
-	char *tmpname;
-	ngim_tain_t updated;
-	unsigned char buffer[MONITOR_STATUS_SIZE];
+	apr_finfo_t info;
 
 	die_assert(pool);
-	memset(buffer, 0, sizeof(buffer));
 
-	/* Time stamps */
+	return (apr_stat(&info, FILE_LOG, APR_FINFO_TYPE, pool) == APR_SUCCESS);
+}
+
+/* Updates the status record. Readers see either the old or the new
+ * contents, never a mix. */
+static void write_status()
+{
+	monitor_status *rec = status_record;
+	ngim_tain_t updated;
+
+	die_assert(rec);
 	ngim_tain_now(&updated);
-	ngim_tain_pack(&buffer[MONITOR_STATUS_UPDATED], &updated);
-	ngim_tain_pack(&buffer[MONITOR_STATUS_CHG_RUN], &run.changed);
-	ngim_tain_pack(&buffer[MONITOR_STATUS_CHG_LOG], &log.changed);
+
+	ngim_seqlock_write_begin(&rec->sequence);
+
+	rec->magic = MONITOR_STATUS_MAGIC;
+	rec->version = MONITOR_STATUS_VERSION;
+	rec->size = sizeof(monitor_status);
 	/* PIDs */
-	*(apr_uint32_t*)&buffer[MONITOR_STATUS_PID_RUN] =
-		(apr_uint32_t)run.proc.pid;
-	*(apr_uint32_t*)&buffer[MONITOR_STATUS_PID_LOG] =
-		(apr_uint32_t)log.proc.pid;
+	rec->pid_run = (apr_uint32_t)run.proc.pid;
+	rec->pid_log = (apr_uint32_t)log.proc.pid;
+	/* Restart backoff */
+	rec->failures_run = run.failures;
+	rec->failures_log = log.failures;
+	rec->delay_run = (apr_uint32_t)apr_time_as_msec(run.delay);
+	rec->delay_log = (apr_uint32_t)apr_time_as_msec(log.delay);
+	/* Counters */
+	rec->starts_run = run.starts;
+	rec->starts_log = log.starts;
+	/* Resource usage */
+	rec->usage_run = run.usage;
+	rec->usage_log = log.usage;
+	rec->total_run = run.total;
+	rec->total_log = log.total;
 	/* Flags */
-	if (flag_forward) {
-		buffer[MONITOR_STATUS_FORWARD] = 1;
+	rec->flags = (flag_forward ? MONITOR_STATUS_FORWARD : 0) |
+		(notify.enabled ? MONITOR_STATUS_NOTIFY : 0) |
+		(run.ready == READY_DONE ? MONITOR_STATUS_READY : 0) |
+		(checking.enabled ? MONITOR_STATUS_CHECK : 0);
+	/* Sockets */
+	rec->sockets = (apr_uint32_t)sockets_count;
+	rec->pid_replaced = (apr_uint32_t)retired.proc.pid;
+	/* Spool */
+	rec->pipe_size = (pipe_size > APR_UINT32_MAX) ? APR_UINT32_MAX :
+		(apr_uint32_t)pipe_size;
+	rec->spooled = (spool_len > APR_UINT32_MAX) ? APR_UINT32_MAX :
+		(apr_uint32_t)spool_len;
+	rec->dropped = spool_dropped;
+	/* Health checks */
+	rec->checks = probe.count;
+	rec->check_failures = probe.failures;
+	rec->check_latency = probe.latency;
+	rec->check_result = probe.result;
+	ngim_tain_pack(rec->checked, &probe.checked);
+	/* Time stamps */
+	ngim_tain_pack(rec->updated, &updated);
+	ngim_tain_pack(rec->changed_run, &run.changed);
+	ngim_tain_pack(rec->changed_log, &log.changed);
+	ngim_tain_pack(rec->ready_run, &run.readied);
+
+	ngim_seqlock_write_end(&rec->sequence);
+}
+
+/* Returns a random number between -1 and 1 */
+static double random_unit(void)
+{
+	static apr_uint64_t state = 0;
+
+	if (!state) {
+		state = (apr_uint64_t)ngim_clock_monotonic() ^
+			((apr_uint64_t)getpid() << 32) ^ APR_UINT64_C(0x9e3779b97f4a7c15);
 	}
 
-	/* Write to file */
-	if (ALLOC_FAIL(tmpname, apr_psprintf(pool, FILE_STATUS ".XXXXXX"))) {
-		warn_allocerror1(" while updating " FILE_STATUS);
-		return;
+	/* xorshift64 */
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+
+	return (double)(state >> 11) / (double)(APR_UINT64_C(1) << 52) - 1.0;
+}
+
+/* Counts a failed start or a premature exit, and sets the delay before the
+ * child is started again. */
+static void child_failed(child_proc *child)
+{
+	double delay;
+	apr_uint32_t i;
+
+	die_assert(child);
+
+	delay = (double)restart.delay;
+	++child->failures;
+
+	for (i = 1; i < child->failures && delay < restart.maxdelay; ++i) {
+		delay *= restart.multiplier;
 	}
 
-	if (APR_FAIL(status, apr_file_mktemp(&file, tmpname, APR_FOPEN_CREATE |
-			APR_EXCL | APR_FOPEN_WRITE | APR_FOPEN_BINARY, pool))) {
-		warn_aprerror1(status, "failed to update " FILE_STATUS);
-		return;
+	if (delay > restart.maxdelay) {
+		delay = restart.maxdelay;
 	}
 
-	if (APR_FAIL(status, apr_file_perms_set(tmpname, FPROT_FILE_STATUS))) {
-		apr_file_close(file);
-		warn_aprerror2(status, "failed to set permissions for ", tmpname);
-		return;
+	delay += delay * restart.jitter * random_unit();
+
+	child->delay = (delay > 0) ? (apr_interval_time_t)delay : 0;
+	child->stopped = ngim_clock_monotonic();
+}
+
+/* Adds an exit to the ring in the status record. */
+static void record_exit(child_proc *child, apr_exit_why_e exitwhy,
+		int exitcode)
+{
+	monitor_status *rec = status_record;
+	monitor_exit *entry;
+	apr_time_t uptime;
+
+	die_assert(child);
+	die_assert(rec);
+
+	uptime = apr_time_as_msec(ngim_clock_monotonic() - child->started);
+
+	ngim_seqlock_write_begin(&rec->sequence);
+
+	entry = &rec->exit[rec->exits % MONITOR_EXITS];
+	memset(entry, 0, sizeof(*entry));
+
+	ngim_tain_pack(entry->time, &child->changed);
+	entry->pid = (apr_uint32_t)child->proc.pid;
+	entry->uptime = (uptime < 0) ? 0 :
+		(uptime > APR_UINT32_MAX) ? APR_UINT32_MAX : (apr_uint32_t)uptime;
+
+	if (APR_PROC_CHECK_SIGNALED(exitwhy)) {
+		entry->signal = (apr_uint32_t)exitcode;
+	} else {
+		entry->code = (apr_uint32_t)exitcode;
 	}
 
-	if (APR_FAIL(status,
-			apr_file_write_full(file, buffer, sizeof(buffer), NULL))) {
-		apr_file_close(file);
-		warn_aprerror2(status, "failed to write to ", tmpname);
-		return;
+	if (APR_PROC_CHECK_CORE_DUMP(exitwhy)) {
+		entry->flags |= MONITOR_EXIT_CORE;
 	}
 
-	apr_file_close(file);
+	if (child == &log) {
+		entry->flags |= MONITOR_EXIT_LOG;
+	}
+
+	++rec->exits;
+
+	ngim_seqlock_write_end(&rec->sequence);
+}
+
+/* Adds the resources used by an exited process to the totals of a
+ * child. */
+static void account_usage(child_proc *child, const monitor_usage *usage)
+{
+	die_assert(child);
+	die_assert(usage);
+
+	child->usage = *usage;
+
+	child->total.utime += usage->utime;
+	child->total.stime += usage->stime;
+	child->total.minflt += usage->minflt;
+	child->total.majflt += usage->majflt;
+	child->total.nvcsw += usage->nvcsw;
+	child->total.nivcsw += usage->nivcsw;
+
+	if (child->total.maxrss < usage->maxrss) {
+		child->total.maxrss = usage->maxrss;
+	}
+}
+
+/* Forgets a child process that has been reaped, after recording how it
+ * exited and what it used. */
+static inline void child_reaped(child_proc *child, apr_exit_why_e exitwhy,
+		int exitcode, const monitor_usage *usage)
+{
+	ngim_tain_now(&child->changed);
+	record_exit(child, exitwhy, exitcode);
+	account_usage(child, usage);
+	memset(&child->proc, 0, sizeof(child->proc));
+
+	if (child->ready == READY_TIMEOUT) {
+		/* Stopped for not being ready in time, which is a failure */
+		child_failed(child);
+	} else if (child->stopping != STOP_NONE) {
+		/* Stopped on purpose, start again right away */
+		child->failures = 0;
+		child->delay = 0;
+	} else if (ngim_clock_monotonic() - child->started >= restart.stable) {
+		/* Ran long enough, a fresh start */
+		child->failures = 0;
+		child->delay = 0;
+	} else {
+		child_failed(child);
+	}
+
+	ngim_loop_cancel(child->exited);
+	child->exited = NULL;
+
+	ngim_loop_cancel(child->escalate);
+	child->escalate = NULL;
+	child->stopping = STOP_NONE;
+
+	if (child->ready != READY_NONE) {
+		close_notify();
+		ngim_loop_cancel(child->unready);
+		child->unready = NULL;
+		child->ready = READY_NONE;
+	}
+}
 
-	if (APR_FAIL(status, apr_file_rename(tmpname, FILE_STATUS, pool))) {
-		warn_aprerror3(status, "failed to rename ", tmpname,
-			" -> " FILE_STATUS);
-		if (APR_FAIL(status, apr_file_remove(tmpname, pool))) {
-			warn_aprerror2(status, "failed to remove ", tmpname);
+#if HAVE_WAIT4
+/* Converts microseconds in a struct timeval. */
+static inline apr_uint64_t timeval_usec(const struct timeval *tv)
+{
+	return (apr_uint64_t)tv->tv_sec * APR_USEC_PER_SEC +
+		(apr_uint64_t)tv->tv_usec;
+}
+#endif
+
+/* Like apr_proc_wait_all_procs without waiting, but also collects the
+ * resources the process used, which are left zero if the system can't
+ * tell. */
+static apr_status_t reap_child(apr_proc_t *proc, int *exitcode,
+		apr_exit_why_e *exitwhy, monitor_usage *usage, apr_pool_t *pool)
+{
+#if HAVE_WAIT4
+	struct rusage ru;
+	pid_t pid;
+	int status;
+
+	die_assert(proc);
+	die_assert(exitcode);
+	die_assert(exitwhy);
+	die_assert(usage);
+	die_assert(pool);
+
+	do {
+		pid = wait4(-1, &status, WNOHANG, &ru);
+	} while (pid == -1 && errno == EINTR);
+
+	if (pid == 0) {
+		return APR_CHILD_NOTDONE;
+	} else if (pid == -1) {
+		return apr_get_os_error();
+	}
+
+	proc->pid = pid;
+
+	if (WIFEXITED(status)) {
+		*exitwhy = APR_PROC_EXIT;
+		*exitcode = WEXITSTATUS(status);
+	} else if (WIFSIGNALED(status)) {
+		*exitwhy = APR_PROC_SIGNAL;
+#ifdef WCOREDUMP
+		if (WCOREDUMP(status)) {
+			*exitwhy = (apr_exit_why_e)(APR_PROC_SIGNAL |
+				APR_PROC_SIGNAL_CORE);
 		}
+#endif
+		*exitcode = WTERMSIG(status);
+	} else {
+		/* Not traced, so it didn't just stop */
+		return APR_CHILD_NOTDONE;
 	}
+
+	usage->utime = timeval_usec(&ru.ru_utime);
+	usage->stime = timeval_usec(&ru.ru_stime);
+	usage->maxrss = (apr_uint64_t)ru.ru_maxrss;
+	usage->minflt = (apr_uint64_t)ru.ru_minflt;
+	usage->majflt = (apr_uint64_t)ru.ru_majflt;
+	usage->nvcsw = (apr_uint64_t)ru.ru_nvcsw;
+	usage->nivcsw = (apr_uint64_t)ru.ru_nivcsw;
+
+	return APR_CHILD_DONE;
+#else
+	die_assert(usage);
+	memset(usage, 0, sizeof(*usage));
+
+	return apr_proc_wait_all_procs(proc, exitcode, exitwhy, APR_NOWAIT,
+				pool);
+#endif
+}
+
+static void stop_probe(void);
+static void probe_reaped(apr_exit_why_e exitwhy, int exitcode);
+
+/* Forgets the run replaced in an overlapping restart once it's reaped,
+ * after recording how it exited and what it used. */
+static void retired_reaped(apr_exit_why_e exitwhy, int exitcode,
+		const monitor_usage *usage)
+{
+	ngim_tain_now(&retired.changed);
+	record_exit(&retired, exitwhy, exitcode);
+	account_usage(&run, usage);
+
+	ngim_loop_cancel(retired.exited);
+	ngim_loop_cancel(retired.escalate);
+
+	memset(&retired, 0, sizeof(retired));
+	retired.progname = FILE_RUN;
 }
 
 /* Sees if either of the children has died, reports accordingly. */
@@ -305,24 +895,32 @@ static void check_children(apr_pool_t *pool)
 	apr_proc_t child;
 	apr_exit_why_e exitwhy;
 	int exitcode;
+	monitor_usage usage;
 	const char *name;
 	char *str;
 
 	die_assert(pool);
 
-	while (APR_STATUS_IS_CHILD_DONE(apr_proc_wait_all_procs(&child,
-				&exitcode, &exitwhy, APR_NOWAIT, pool))) {
+	while (APR_STATUS_IS_CHILD_DONE(reap_child(&child, &exitcode, &exitwhy,
+				&usage, pool))) {
 		if (child.pid == run.proc.pid) {
 			/* run has died */
-			ngim_tain_now(&run.changed);
-			memset(&run.proc, 0, sizeof(run.proc));
+			child_reaped(&run, exitwhy, exitcode, &usage);
 			flag_forward = 0; /* Forwarding no more */
+			stop_probe(); /* Checking no more */
 			name = run.progname;
 		} else if (child.pid == log.proc.pid) {
 			/* log has died */
-			ngim_tain_now(&log.changed);
-			memset(&log.proc, 0, sizeof(log.proc));
+			child_reaped(&log, exitwhy, exitcode, &usage);
 			name = log.progname;
+		} else if (retired.proc.pid && child.pid == retired.proc.pid) {
+			/* The replaced run has died */
+			retired_reaped(exitwhy, exitcode, &usage);
+			name = run.progname;
+		} else if (probe.proc.pid && child.pid == probe.proc.pid) {
+			/* A health check is done */
+			probe_reaped(exitwhy, exitcode);
+			continue;
 		} else {
 			/* Weird stuff */
 			warn_error1("unknown child process exited");
@@ -330,7 +928,7 @@ static void check_children(apr_pool_t *pool)
 		}
 
 		/* A process has died, report */
-		write_status(pool);
+		write_status();
 
 		if (ALLOC_FAIL(str,
 				apr_psprintf(pool, "%s [pid %i] exited %s with code %i",
@@ -366,8 +964,20 @@ static apr_procattr_t * create_procattr_run(apr_procattr_t **attr,
 		return NULL;
 	}
 
-	/* Forward stdout/err to pipe_runlog only if log is running */
-	if (log.proc.pid) {
+	/* Pass a readiness channel if run notifies */
+	if (notify.enabled && !create_notify(pool)) {
+		return NULL;
+	}
+
+	/* Pass the listening sockets */
+	if (sockets_count && !pass_sockets(pool)) {
+		return NULL;
+	}
+
+	/* Forward stdout/err to pipe_runlog if log is running, or if log is
+	 * down and the output can be spooled until it's back */
+	if (log.proc.pid || (logging.spoolsize && check_filelog(pool) &&
+			create_pipe())) {
 		/* If log is running, we must have a pipe already */
 		die_assert(pipe_runlog[1]);
 		if (APR_FAIL(status,
@@ -414,191 +1024,1247 @@ static apr_procattr_t * create_procattr_log(apr_procattr_t **attr,
 	return *attr;
 }
 
-/* Starts a program from the working directory with given process
- * attributes. */
-static void start_child(child_proc *child, apr_procattr_t *attr,
-		apr_pool_t *pool)
+static void update(void);
+static void on_wakeup(ngim_loop_t *l, ngim_event_t *ev, void *data);
+
+/* Reads once from pipe_runlog into the spool, or drops what was read if
+ * the spool is full. */
+static apr_status_t read_spool()
 {
 	apr_status_t status;
-	apr_finfo_t info;
-	char *str;
-	const char *args[] = { NULL, NULL };
+	char discard[LOG_CHUNK];
+	apr_size_t len;
 
-	die_assert(child);
-	die_assert(attr);
-	die_assert(pool);
-	warn_assert(child->proc.pid == 0); /* Already running? */
-	warn_assert(TIMER_CHILD > 0); /* Sanity check */
+	die_assert(pipe_runlog[0]);
+	die_assert(spool_buf);
 
-	/* Start the suspension timer if it's inactive */
-	if (!flag_timer) {
-		alarm(TIMER_CHILD);
-		flag_timer = 1;
+	if (!spool_full && spool_len < logging.spoolsize) {
+		len = logging.spoolsize - spool_len;
+		status = apr_file_read(pipe_runlog[0], spool_buf + spool_len, &len);
+		spool_len += len;
+	} else {
+		len = sizeof(discard);
+		status = apr_file_read(pipe_runlog[0], discard, &len);
+		spool_dropped += len;
+
+		if (len && !spool_full) {
+			spool_full = 1;
+			warn_error1("spool is full, dropping output");
+
+			/* The rest of the last line is gone, so is the beginning */
+			while (spool_len > 0 && spool_buf[spool_len - 1] != '\n') {
+				--spool_len;
+				++spool_dropped;
+			}
+		}
 	}
-	++child->starts;
 
-	/* See if the file exists */
-	if (APR_FAIL(status,
-			apr_stat(&info, child->progname, APR_FINFO_NORM, pool))) {
-		if (!APR_STATUS_IS_ENOENT(status)) {
-			warn_aprerror2(status, "stat failed for ", child->progname);
-		}
-		/* The file doesn't exist, just ignore it */
+	if (status != APR_SUCCESS && !APR_STATUS_IS_EAGAIN(status) &&
+		!APR_STATUS_IS_EOF(status)) {
+		warn_aprerror1(status, "failed to read from the pipe to log");
+	}
+
+	return status;
+}
+
+/* Called when run has written to pipe_runlog while log is down */
+static void on_spool(ngim_loop_t *l, ngim_event_t *ev, void *data)
+{
+	apr_status_t status;
+
+	status = read_spool();
+
+	if (status != APR_SUCCESS && !APR_STATUS_IS_EAGAIN(status)) {
+		/* Don't spin on a broken pipe */
+		ngim_loop_cancel(spool_watch);
+		spool_watch = NULL;
+	}
+
+	write_status();
+	update();
+}
+
+/* Starts reading pipe_runlog into the spool while log is down, so that
+ * run won't block when the pipe is full. */
+static void watch_spool()
+{
+	apr_status_t status;
+
+	if (spool_watch || !pipe_runlog[0] || !logging.spoolsize) {
 		return;
-	} else if (info.filetype != APR_REG) {
-		warn_error3("failed to start ", child->progname,
-				": Invalid file type");
+	}
+
+	if (!spool_buf && ALLOC_FAIL(spool_buf,
+			apr_palloc(g_pool, logging.spoolsize))) {
+		warn_allocerror0();
 		return;
 	}
 
-	/* Don't start the child if we have been instructed to stop */
-	if (flag_intr) {
+	/* Replaying can wait until log is back */
+	ngim_loop_cancel(spool_replay);
+	spool_replay = NULL;
+
+	/* Nobody else reads the pipe while log is down */
+	if (APR_FAIL(status, apr_file_pipe_timeout_set(pipe_runlog[0], 0))) {
+		warn_aprerror1(status, "failed to set up spooling");
 		return;
 	}
 
-	/* Command line arguments */
-	args[0] = child->progname;
+	if (!(spool_watch = ngim_loop_file(loop, pipe_runlog[0], on_spool,
+			NULL))) {
+		warn_error1("failed to watch the pipe to log");
+		apr_file_pipe_timeout_set(pipe_runlog[0], -1);
+	}
+}
 
-	/* Start a child process */
+/* Stops spooling before log is started, picks up what's still in
+ * pipe_runlog and makes the pipe block again for log. */
+static void stop_spool()
+{
+	apr_status_t status;
+	int i;
+
+	if (!spool_watch) {
+		return;
+	}
+
+	ngim_loop_cancel(spool_watch);
+	spool_watch = NULL;
+
+	for (i = 0; i < LOG_DRAINREADS && read_spool() == APR_SUCCESS; ++i) {
+		/* Older than anything written from now on */
+	}
+
+	if (APR_FAIL(status, apr_file_pipe_timeout_set(pipe_runlog[0], -1))) {
+		warn_aprerror1(status, "failed to stop spooling");
+	}
+
+	spool_full = 0;
+}
+
+/* Returns the number of bytes that can be written to pipe_runlog without
+ * blocking, leaving LOG_MARGIN for run, and sets measured. If the pipe
+ * can't be inspected, returns LOG_CHUNK, which may block until log has
+ * read a bit, and clears measured. */
+static apr_size_t pipe_room(int *measured)
+{
+#if defined(FIONREAD)
+	apr_os_file_t fd;
+	int queued;
+#endif
+
+	die_assert(measured);
+	*measured = 0;
+
+#if defined(FIONREAD)
+	die_assert(pipe_runlog[0]);
+
+	if (pipe_size && apr_os_file_get(&fd, pipe_runlog[0]) == APR_SUCCESS &&
+		ioctl(fd, FIONREAD, &queued) != -1) {
+		*measured = 1;
+
+		if ((apr_size_t)queued + LOG_MARGIN >= pipe_size) {
+			return 0;
+		}
+
+		return pipe_size - (apr_size_t)queued - LOG_MARGIN;
+	}
+#endif
+
+	return LOG_CHUNK;
+}
+
+static void replay_spool();
+
+/* Called when it's time to replay more of the spool */
+static void on_replay(ngim_loop_t *l, ngim_event_t *ev, void *data)
+{
+	spool_replay = NULL;
+
+	if (log.proc.pid && pipe_runlog[1]) {
+		replay_spool();
+	}
+
+	update();
+}
+
+/* Writes spooled output to pipe_runlog for log as long as it fits, and
+ * comes back for the rest. Nothing is written before log is running, as
+ * the pipe blocks and would never be emptied. If the room in the pipe
+ * can't be measured, one chunk is written at a time, so the monitor waits
+ * at most until log has read it. Output that run writes in the meantime
+ * may end up between spooled lines, but not inside them if it can be
+ * helped. */
+static void replay_spool()
+{
+	apr_status_t status;
+	apr_size_t len, room;
+	int measured;
+
+	die_assert(pipe_runlog[1]);
+
+	if (!spool_len || !log.proc.pid) {
+		return;
+	}
+
+	do {
+		if (!(room = pipe_room(&measured))) {
+			break;
+		}
+
+		len = (spool_len < room) ? spool_len : room;
+
+		/* Stop at the end of a line if there is one */
+		if (len < spool_len) {
+			while (len > 0 && spool_buf[len - 1] != '\n') {
+				--len;
+			}
+
+			if (!len) {
+				len = (spool_len < room) ? spool_len : room;
+			}
+		}
+
+		if (APR_FAIL(status, apr_file_write(pipe_runlog[1], spool_buf,
+				&len))) {
+			warn_aprerror1(status, "failed to replay the spool");
+			break;
+		}
+
+		memmove(spool_buf, spool_buf + len, spool_len - len);
+		spool_len -= len;
+	} while (spool_len && measured);
+
+	if (spool_len && !spool_replay) {
+		spool_replay = ngim_loop_timer(loop, LOG_RETRY * 1000, 0, on_replay,
+			NULL);
+	}
+
+	write_status();
+}
+
+/* Spools run's output while log is down, and hands it to log when it's
+ * back. */
+static void update_spool()
+{
+	if (!log.proc.pid) {
+		watch_spool();
+	} else if (spool_len && !spool_replay && pipe_runlog[1]) {
+		replay_spool();
+	}
+}
+
+/* Called when a delayed start is due */
+static void on_respawn(ngim_loop_t *l, ngim_event_t *ev, void *data)
+{
+	child_proc *child = data;
+
+	die_assert(child);
+	child->respawn = NULL;
+
+	update();
+}
+
+/* Called when a child process exits */
+static void on_exited(ngim_loop_t *l, ngim_event_t *ev, void *data)
+{
+	child_proc *child = data;
+
+	die_assert(child);
+	child->exited = NULL;
+
+	/* Reap it and start again */
+	update();
+}
+
+/* Returns non-zero if the restart delay of a child has passed. Otherwise,
+ * sets a timer to try again when it has. */
+static int pace_child(child_proc *child)
+{
+	apr_time_t elapsed;
+
+	die_assert(child);
+
+	if (child->respawn) {
+		/* Already waiting */
+		return 0;
+	}
+
+	if (!child->delay) {
+		return 1;
+	}
+
+	elapsed = ngim_clock_monotonic() - child->stopped;
+
+	if (elapsed >= 0 && elapsed < child->delay) {
+		child->respawn = ngim_loop_timer(loop, child->delay - elapsed, 0,
+			on_respawn, child);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Watches for SIGCHLD if a child process can't be watched otherwise. */
+static void watch_sigchld(void)
+{
+	if ((run.proc.pid && !run.exited) || (log.proc.pid && !log.exited) ||
+		(retired.proc.pid && !retired.exited) ||
+		(probe.proc.pid && !probe.exited)) {
+		if (!signal_chld) {
+			signal_chld = ngim_loop_signal(loop, SIGCHLD, on_wakeup, NULL);
+		}
+	} else if (signal_chld) {
+		ngim_loop_cancel(signal_chld);
+		signal_chld = NULL;
+	}
+}
+
+/* Starts a program from the working directory with given process
+ * attributes. */
+static void start_child(child_proc *child, apr_procattr_t *attr,
+		apr_pool_t *pool)
+{
+	apr_status_t status;
+	apr_finfo_t info;
+	char *str;
+	const char *args[] = { NULL, NULL };
+
+	die_assert(child);
+	die_assert(attr);
+	die_assert(pool);
+	warn_assert(child->proc.pid == 0); /* Already running? */
+
+	/* See if the file exists */
+	if (APR_FAIL(status,
+			apr_stat(&info, child->progname, APR_FINFO_NORM, pool))) {
+		if (!APR_STATUS_IS_ENOENT(status)) {
+			warn_aprerror2(status, "stat failed for ", child->progname);
+		}
+		/* The file doesn't exist, just ignore it */
+		return;
+	} else if (info.filetype != APR_REG) {
+		warn_error3("failed to start ", child->progname,
+				": Invalid file type");
+		return;
+	}
+
+	/* Don't start the child if we have been instructed to stop */
+	if (flag_intr) {
+		return;
+	}
+
+	/* Command line arguments */
+	args[0] = child->progname;
+
+	/* Start a child process */
 	if (APR_FAIL(status, apr_proc_create(&child->proc, child->progname,
 				args, NULL, attr, pool))) {
 		child->proc.pid = 0;
 		warn_aprerror2(status, "failed to start ", child->progname);
+		child_failed(child);
+		write_status();
+	} else {
+		/* Start time */
+		ngim_tain_now(&child->changed);
+		child->started = ngim_clock_monotonic();
+		++child->starts;
+
+		/* Learn about the exit directly from the process, SIGCHLD is only
+		 * needed for children the system can't watch that way */
+		child->exited = ngim_loop_child(loop, &child->proc, on_exited, child);
+		watch_sigchld();
+
+		/* Process started, report */
+		write_status();
+
+		if (ALLOC_FAIL(str,
+				apr_psprintf(pool, "started %s [pid %i]",
+					child->progname, child->proc.pid))) {
+			warn_allocerror0();
+			error2(INFO, "started ", child->progname);
+		} else {
+			error1(INFO, str);
+		}
+	}
+}
+
+static void read_stop_sequence(apr_pool_t *pool);
+static void stop_child(child_proc *child, apr_pool_t *pool);
+
+/* Sets run aside so that a new one is started while the old one still
+ * serves, and stopped only once the new one is up. */
+static void retire_run(void)
+{
+	die_assert(run.proc.pid);
+	die_assert(!retired.proc.pid);
+
+	stop_probe();
+	ngim_loop_cancel(run.exited);
+	ngim_loop_cancel(run.unready);
+	ngim_loop_cancel(run.respawn);
+
+	if (run.ready != READY_NONE) {
+		close_notify();
+	}
+
+	retired.proc = run.proc;
+	retired.changed = run.changed;
+	retired.started = run.started;
+	retired.exited = ngim_loop_child(loop, &retired.proc, on_exited,
+		&retired);
+
+	/* Start a new one right away */
+	memset(&run.proc, 0, sizeof(run.proc));
+	run.exited = NULL;
+	run.unready = NULL;
+	run.respawn = NULL;
+	run.ready = READY_NONE;
+	run.failures = 0;
+	run.delay = 0;
+
+	watch_sigchld();
+	write_status();
+}
+
+/* Stops the run replaced in an overlapping restart, now that a new one is
+ * up. */
+static void release_retired(apr_pool_t *pool)
+{
+	char *str;
+
+	die_assert(pool);
+
+	if (!retired.proc.pid || retired.stopping != STOP_NONE) {
+		return;
+	}
+
+	if (ALLOC_FAIL(str,
+			apr_psprintf(pool, "stopping replaced %s [pid %i]",
+				retired.progname, retired.proc.pid))) {
+		warn_allocerror0();
+		error2(INFO, "stopping replaced ", retired.progname);
+	} else {
+		error1(INFO, str);
+	}
+
+	if (run.stopping != STOP_ACTIVE && log.stopping != STOP_ACTIVE) {
+		read_stop_sequence(pool);
+	}
+
+	stop_child(&retired, pool);
+}
+
+/* Called when run writes to pipe_notify */
+static void on_notify(ngim_loop_t *l, ngim_event_t *ev, void *data)
+{
+	apr_status_t status;
+	apr_size_t size;
+	child_proc *child = data;
+	char *str;
+
+	die_assert(child);
+	die_assert(pipe_notify[0]);
+
+	size = sizeof(notify_buf) - notify_len;
+
+	if (APR_FAIL(status, apr_file_read(pipe_notify[0],
+				notify_buf + notify_len, &size))) {
+		if (APR_STATUS_IS_EOF(status)) {
+			warn_error2(child->progname,
+				" closed the readiness channel without notifying");
+		} else {
+			warn_aprerror1(status, "failed to read the readiness channel");
+		}
+		close_notify();
+		return;
+	}
+
+	notify_len += size;
+
+	if (memcmp(notify_buf, MONITOR_NOTIFY_READY, notify_len)) {
+		warn_error2("invalid notification from ", child->progname);
+		close_notify();
+		return;
+	} else if (notify_len < sizeof(notify_buf)) {
+		/* The rest is yet to come */
+		return;
+	}
+
+	/* Nothing else is expected */
+	close_notify();
+	ngim_loop_cancel(child->unready);
+	child->unready = NULL;
+
+	child->ready = READY_DONE;
+	ngim_tain_now(&child->readied);
+	write_status();
+
+	if (ALLOC_FAIL(str,
+			apr_psprintf(pool_loop, "%s [pid %i] is ready",
+				child->progname, child->proc.pid))) {
+		warn_allocerror0();
+		error2(INFO, child->progname, " is ready");
+	} else {
+		error1(INFO, str);
+	}
+
+	/* The old run is no longer needed */
+	release_retired(pool_loop);
+
+	update();
+}
+
+/* Called when run has not notified in time */
+static void on_unready(ngim_loop_t *l, ngim_event_t *ev, void *data)
+{
+	child_proc *child = data;
+
+	die_assert(child);
+	child->unready = NULL;
+
+	warn_error2(child->progname, " did not notify it was ready in time");
+	close_notify();
+
+	/* Restart with a delay as if it had exited */
+	child->ready = READY_TIMEOUT;
+
+	if (run.stopping != STOP_ACTIVE && log.stopping != STOP_ACTIVE) {
+		read_stop_sequence(pool_loop);
+	}
+
+	stop_child(child, pool_loop);
+
+	update();
+}
+
+/* Closes the monitor's writing end of pipe_notify after run has been
+ * started, and waits for run to notify. */
+static void watch_notify(child_proc *child, apr_pool_t *pool)
+{
+	apr_status_t status;
+
+	die_assert(child);
+	die_assert(pool);
+
+	if (APR_FAIL(status, apr_env_delete(ENV_SRVCTL_NOTIFY, pool))) {
+		warn_aprerror1(status, "failed to unset " ENV_SRVCTL_NOTIFY);
+	}
+
+	if (!pipe_notify[0] || !child->proc.pid) {
+		/* Failed to start */
+		close_notify();
+		return;
+	}
+
+	apr_file_close(pipe_notify[1]);
+	pipe_notify[1] = NULL;
+
+	child->ready = READY_WAITING;
+
+	if (!(notify_watch = ngim_loop_file(loop, pipe_notify[0], on_notify,
+				child))) {
+		warn_error1("failed to watch the readiness channel");
+		close_notify();
+	}
+
+	if (notify.timeout) {
+		child->unready = ngim_loop_timer(loop, notify.timeout, 0,
+			on_unready, child);
+	}
+}
+
+static void terminate_child(child_proc *child, apr_pool_t *pool);
+
+/* Records the result of a health check, and restarts run after too many
+ * failures in a row. */
+static void finish_probe(apr_uint32_t result)
+{
+	apr_time_t latency;
+
+	latency = apr_time_as_msec(ngim_clock_monotonic() - probe.started);
+
+	probe.latency = (latency < 0) ? 0 :
+		(latency > APR_UINT32_MAX) ? APR_UINT32_MAX : (apr_uint32_t)latency;
+	probe.result = result;
+	++probe.count;
+	ngim_tain_now(&probe.checked);
+
+	if (result == MONITOR_CHECK_PASSED) {
+		probe.failures = 0;
+	} else if (++probe.failures >= checking.failures &&
+			run.stopping == STOP_NONE) {
+		warn_error2(run.progname, " failed its health checks, restarting");
+
+		if (log.stopping != STOP_ACTIVE) {
+			read_stop_sequence(pool_loop);
+		}
+
+		terminate_child(&run, pool_loop);
+	}
+
+	write_status();
+}
+
+static void on_probe(ngim_loop_t *l, ngim_event_t *ev, void *data);
+
+/* Sets a timer for the next health check, if run is up and has notified
+ * it's ready if it does that. */
+static void schedule_probe(void)
+{
+	if (!checking.enabled || flag_stop || probe.proc.pid || probe.timer ||
+		!run.proc.pid || run.stopping != STOP_NONE ||
+		(notify.enabled && run.ready != READY_DONE)) {
+		return;
+	}
+
+	probe.timer = ngim_loop_timer(loop, checking.interval, 0, on_probe,
+		NULL);
+}
+
+/* Cancels the next health check, and kills a running one without waiting
+ * for its result. */
+static void stop_probe(void)
+{
+	ngim_loop_cancel(probe.timer);
+	probe.timer = NULL;
+	probe.failures = 0;
+
+	if (probe.proc.pid && !probe.discard) {
+		apr_proc_kill(&probe.proc, SIGKILL);
+		probe.discard = 1;
+	}
+}
+
+/* Forgets a health check that has been reaped, after recording its
+ * result. */
+static void probe_reaped(apr_exit_why_e exitwhy, int exitcode)
+{
+	ngim_loop_cancel(probe.exited);
+	probe.exited = NULL;
+
+	ngim_loop_cancel(probe.timer);
+	probe.timer = NULL;
+
+	memset(&probe.proc, 0, sizeof(probe.proc));
+
+	if (probe.discard) {
+		/* Already handled */
+	} else if (APR_PROC_CHECK_EXIT(exitwhy) && exitcode == 0) {
+		finish_probe(MONITOR_CHECK_PASSED);
+	} else {
+		warn_error2(FILE_CHECK, " failed");
+		finish_probe(MONITOR_CHECK_FAILED);
+	}
+
+	probe.discard = 0;
+}
+
+/* Called when a health check has not finished in time */
+static void on_probe_timeout(ngim_loop_t *l, ngim_event_t *ev, void *data)
+{
+	probe.timer = NULL;
+
+	warn_error2(FILE_CHECK, " did not finish in time");
+
+	/* Reaped later */
+	apr_proc_kill(&probe.proc, SIGKILL);
+	probe.discard = 1;
+	finish_probe(MONITOR_CHECK_TIMEOUT);
+
+	update();
+}
+
+/* Called when a health check exits */
+static void on_probe_exited(ngim_loop_t *l, ngim_event_t *ev, void *data)
+{
+	probe.exited = NULL;
+	update();
+}
+
+/* Called when the next health check is due */
+static void on_probe(ngim_loop_t *l, ngim_event_t *ev, void *data)
+{
+	apr_status_t status;
+	apr_procattr_t *attr;
+	const char *args[] = { FILE_CHECK, NULL };
+
+	probe.timer = NULL;
+	probe.started = ngim_clock_monotonic();
+
+	if (APR_FAIL(status, apr_procattr_create(&attr, pool_loop)) ||
+		APR_FAIL(status, apr_procattr_cmdtype_set(attr, APR_PROGRAM_ENV)) ||
+		APR_FAIL(status, apr_procattr_error_check_set(attr, 1)) ||
+		APR_FAIL(status, apr_procattr_child_errfn_set(attr, aprprocerror)) ||
+		APR_FAIL(status, apr_proc_create(&probe.proc, FILE_CHECK, args,
+				NULL, attr, pool_loop))) {
+		warn_aprerror2(status, "failed to start ", FILE_CHECK);
+		probe.proc.pid = 0;
+		finish_probe(MONITOR_CHECK_FAILED);
+	} else {
+		probe.exited = ngim_loop_child(loop, &probe.proc, on_probe_exited,
+			NULL);
+		watch_sigchld();
+
+		probe.timer = ngim_loop_timer(loop, checking.timeout, 0,
+			on_probe_timeout, NULL);
+	}
+
+	update();
+}
+
+/* Starts children if the service is requested to be up. */
+static void start_children(apr_pool_t *pool)
+{
+	apr_procattr_t *attr;
+	die_assert(pool);
+
+	if (flag_intr || !check_fileup(pool)) {
+		return;
+	}
+
+	/* Wait until both children are gone if they are being restarted */
+	if (run.stopping == STOP_ACTIVE || log.stopping == STOP_ACTIVE) {
+		return;
+	}
+
+	/* If a process exits before it has been up for restart.stable, or
+	 * can't be started at all, it will be restarted after a delay that
+	 * grows with each failure in a row, up to restart.maxdelay. */
+
+	/* Don't start log if run was already started without forwarding its
+	 * output to pipe_runlog */
+	if (!log.proc.pid && (!run.proc.pid || flag_forward) && pace_child(&log)) {
+		stop_spool();
+
+		if (ALLOC_FAIL(attr, create_procattr_log(&attr, pool))) {
+			warn_error2("failed to start ", log.progname);
+		} else {
+			start_child(&log, attr, pool);
+
+			/* Replay once log has had a moment to start reading the pipe,
+			 * rather than leaving spooled output in it if log fails to
+			 * start */
+			if (log.proc.pid && spool_len && !spool_replay) {
+				spool_replay = ngim_loop_timer(loop, LOG_RETRY * 1000, 0,
+					on_replay, NULL);
+			}
+		}
+	}
+
+	/* Always start run if not already running */
+	if (!run.proc.pid && pace_child(&run)) {
+		if (ALLOC_FAIL(attr, create_procattr_run(&attr, pool))) {
+			warn_error2("failed to start ", run.progname);
+		} else {
+			start_child(&run, attr, pool);
+		}
+
+		if (sockets_count) {
+			keep_sockets(pool);
+		}
+
+		if (notify.enabled) {
+			watch_notify(&run, pool);
+		} else if (run.proc.pid) {
+			release_retired(pool);
+		}
+	}
+}
+
+/* Sends a signal to a child process if its pid is non-zero, prints out a log
+ * message. */
+static void signal_child(child_proc *child, int sig, apr_pool_t *pool)
+{
+	char *str;
+
+	die_assert(child);
+	die_assert(pool);
+	warn_assert(sig > 0 && sig < NSIG);
+
+	if (!child->proc.pid) {
+		/* Process not running */
+		return;
+	}
+
+	if (ALLOC_FAIL(str,
+			apr_psprintf(pool, "sending signal %i to %s [pid %i]",
+				sig, child->progname, child->proc.pid))) {
+		warn_allocerror0();
+		error2(INFO, "sending a signal to ", child->progname);
+	} else {
+		error1(INFO, str);
+	}
+
+	apr_proc_kill(&child->proc, sig);
+}
+
+/* Reads a file from the service directory. Returns its contents, or NULL
+ * if it doesn't exist or can't be read. */
+static char * read_setting(const char *name, apr_pool_t *pool)
+{
+	apr_status_t status;
+	apr_file_t *file;
+	apr_size_t size = SETTING_MAXSIZE;
+	char *buf;
+
+	die_assert(name);
+	die_assert(pool);
+
+	if (APR_FAIL(status, apr_file_open(&file, name,
+			APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT, pool))) {
+		if (!APR_STATUS_IS_ENOENT(status)) {
+			warn_aprerror2(status, "failed to open ", name);
+		}
+		return NULL;
+	}
+
+	if (ALLOC_FAIL(buf, apr_palloc(pool, size + 1))) {
+		warn_allocerror0();
+		apr_file_close(file);
+		return NULL;
+	}
+
+	if (APR_FAIL(status, apr_file_read_full(file, buf, size, &size)) &&
+		!APR_STATUS_IS_EOF(status)) {
+		warn_aprerror2(status, "failed to read from ", name);
+		apr_file_close(file);
+		return NULL;
+	}
+
+	apr_file_close(file);
+
+	buf[size] = '\0';
+	return buf;
+}
+
+/* Converts a signal name or number to a signal, returns zero if invalid */
+static int parse_signal(const char *s)
+{
+	apr_int64_t num;
+	char *end;
+	int i;
+
+	die_assert(s);
+
+	if (apr_isdigit(*s)) {
+		num = apr_strtoi64(s, &end, 10);
+		return (*end == '\0' && num > 0 && num < NSIG) ? (int)num : 0;
+	}
+
+	if (!strncasecmp(s, "SIG", 3)) {
+		s += 3;
+	}
+
+	for (i = 0; stop_signames[i].name; ++i) {
+		if (!strcasecmp(s, stop_signames[i].name)) {
+			return stop_signames[i].sig;
+		}
+	}
+
+	return 0;
+}
+
+/* Sets up the signals used for terminating children. The defaults follow
+ * the postgresql signaling scheme, as services are expected to handle
+ * SIGTERM and exit gracefully:
+ * http://www.postgresql.org/docs/8.1/interactive/app-postmaster.html
+ * FILE_STOPSIGNALS can replace the sequence with signal names or numbers,
+ * and FILE_STOPTIMEOUTS the seconds to wait after each, the last one
+ * applying to the rest. */
+static void read_stop_sequence(apr_pool_t *pool)
+{
+	int sigs[] = { SIGTERM, SIGTERM, SIGINT, SIGQUIT, SIGKILL };
+	apr_interval_time_t wait = apr_time_from_sec(PAUSE_TERMWAIT);
+	apr_int64_t num;
+	apr_size_t i;
+	char *buf, *tok, *state, *end;
+
+	die_assert(pool);
+
+	stop_seq.count = 0;
+
+	if ((buf = read_setting(FILE_STOPSIGNALS, pool))) {
+		for (tok = apr_strtok(buf, SETTING_SEPARATORS, &state); tok;
+				tok = apr_strtok(NULL, SETTING_SEPARATORS, &state)) {
+			if (stop_seq.count == STOP_MAXSIGNALS ||
+				!(stop_seq.sigs[stop_seq.count++] = parse_signal(tok))) {
+				warn_error3("invalid signal in " FILE_STOPSIGNALS ": ", tok,
+					", using defaults");
+				stop_seq.count = 0;
+				break;
+			}
+		}
+	}
+
+	if (!stop_seq.count) {
+		stop_seq.count = sizeof(sigs) / sizeof(int);
+		memcpy(stop_seq.sigs, sigs, sizeof(sigs));
+	}
+
+	i = 0;
+
+	if ((buf = read_setting(FILE_STOPTIMEOUTS, pool))) {
+		for (tok = apr_strtok(buf, SETTING_SEPARATORS, &state);
+				tok && i < stop_seq.count;
+				tok = apr_strtok(NULL, SETTING_SEPARATORS, &state)) {
+			num = apr_strtoi64(tok, &end, 10);
+
+			if (*end != '\0' || num < 0 || num > APR_INT32_MAX) {
+				warn_error3("invalid timeout in " FILE_STOPTIMEOUTS ": ", tok,
+					", using defaults");
+				i = 0;
+				wait = apr_time_from_sec(PAUSE_TERMWAIT);
+				break;
+			}
+
+			wait = apr_time_from_sec(num);
+			stop_seq.waits[i++] = wait;
+		}
+	}
+
+	while (i < stop_seq.count) {
+		stop_seq.waits[i++] = wait;
+	}
+}
+
+/* Creates a listening socket of a type and an address read from
+ * FILE_SOCKETS. Dies in case of failure. */
+static void open_socket(const char *type, const char *addr,
+		apr_pool_t *pool)
+{
+	apr_status_t status;
+	apr_sockaddr_t *sa;
+	apr_socket_t *sock;
+	apr_port_t port;
+	char *host, *scope;
+#if APR_HAVE_SOCKADDR_UN
+	apr_finfo_t info;
+#endif
+
+	die_assert(type);
+	die_assert(addr);
+	die_assert(pool);
+
+	if (sockets_count == SOCKETS_MAX) {
+		die_error1("too many sockets in " FILE_SOCKETS);
+	}
+
+	if (!strcmp(type, "tcp")) {
+		if (APR_FAIL(status,
+				apr_parse_addr_port(&host, &scope, &port, addr, pool)) ||
+			!port) {
+			die_error3("invalid address in " FILE_SOCKETS ": ", addr, "");
+		}
+
+		if (APR_FAIL(status, apr_sockaddr_info_get(&sa, host, APR_UNSPEC,
+					port, 0, pool)) ||
+			APR_FAIL(status, apr_socket_create(&sock, sa->family,
+					SOCK_STREAM, APR_PROTO_TCP, pool)) ||
+			APR_FAIL(status, apr_socket_opt_set(sock, APR_SO_REUSEADDR, 1))) {
+			die_aprerror2(status, "failed to create a socket for ", addr);
+		}
+#if APR_HAVE_SOCKADDR_UN
+	} else if (!strcmp(type, "unix")) {
+		/* Replace a socket left behind by an earlier monitor, which can't
+		 * be using it while we hold FILE_LOCK */
+		if (apr_stat(&info, addr, APR_FINFO_TYPE, pool) == APR_SUCCESS &&
+			info.filetype == APR_SOCK) {
+			apr_file_remove(addr, pool);
+		}
+
+		if (APR_FAIL(status, apr_sockaddr_info_get(&sa, addr, APR_UNIX, 0,
+					0, pool)) ||
+			APR_FAIL(status, apr_socket_create(&sock, APR_UNIX, SOCK_STREAM,
+					0, pool))) {
+			die_aprerror2(status, "failed to create a socket for ", addr);
+		}
+#endif
 	} else {
-		/* Start time */
-		ngim_tain_now(&child->changed);
+		die_error3("invalid socket type in " FILE_SOCKETS ": ", type, "");
+	}
 
-		/* Process started, report */
-		write_status(pool);
+	if (APR_FAIL(status, apr_socket_bind(sock, sa)) ||
+		APR_FAIL(status, apr_socket_listen(sock, SOCKETS_BACKLOG)) ||
+		APR_FAIL(status, apr_socket_inherit_unset(sock))) {
+		die_aprerror2(status, "failed to listen on ", addr);
+	}
 
-		if (ALLOC_FAIL(str,
-				apr_psprintf(pool, "started %s [pid %i]",
-					child->progname, child->proc.pid))) {
-			warn_allocerror0();
-			error2(INFO, "started ", child->progname);
+	sockets[sockets_count++] = sock;
+}
+
+/* Reads FILE_SOCKETS, which has pairs of types and addresses of sockets to
+ * listen on and pass to run: tcp with an address and a port, or unix with
+ * a path. The sockets stay open over restarts of run. overlap alone makes
+ * restarts start a new run before stopping the old one. */
+static void open_sockets(apr_pool_t *pool)
+{
+	char *buf, *type, *addr, *state;
+
+	die_assert(pool);
+
+	if (!(buf = read_setting(FILE_SOCKETS, pool))) {
+		return;
+	}
+
+	for (type = apr_strtok(buf, SETTING_SEPARATORS, &state); type;
+			type = apr_strtok(NULL, SETTING_SEPARATORS, &state)) {
+		if (!strcmp(type, "overlap")) {
+			flag_overlap = 1;
+		} else if (!(addr = apr_strtok(NULL, SETTING_SEPARATORS, &state))) {
+			die_error3("missing address in " FILE_SOCKETS ": ", type, "");
 		} else {
-			error1(INFO, str);
+			/* Kept until the monitor exits */
+			open_socket(type, addr, g_pool);
 		}
 	}
 }
 
-/* Starts children if the service is requested to be up. */
-static void start_children(apr_pool_t *pool)
+/* Enables health checks if FILE_CHECK exists, and reads FILE_CHECKPOLICY,
+ * which has pairs of names and values: interval and timeout in seconds,
+ * and the number of failures in a row before run is restarted. */
+static void read_check_policy(apr_pool_t *pool)
 {
-	apr_procattr_t *attr;
+	apr_status_t status;
+	apr_finfo_t info;
+	char *buf, *name, *value, *state, *end;
+	double num;
+
 	die_assert(pool);
 
-	if (flag_intr || !check_fileup(pool)) {
+	if (APR_FAIL(status, apr_stat(&info, FILE_CHECK, APR_FINFO_TYPE, pool))) {
+		if (!APR_STATUS_IS_ENOENT(status)) {
+			warn_aprerror2(status, "stat failed for ", FILE_CHECK);
+		}
+		return;
+	} else if (info.filetype != APR_REG) {
+		warn_error2(FILE_CHECK, " is not a file");
 		return;
 	}
 
-	/* If starting a process fails before apr_proc_create returns with a
-	 * success, we won't attempt to restart it. Instead, the user should
-	 * manually tell us to restart it after fixing the problem.
-	 *
-	 * However, if we actually manage to start a new process, which dies
-	 * on us, we will try to restart it upon receiving SIGCHLD.  Respawn
-	 * rate is limited by PAUSE_RESPAWN below.
-	 *
-	 * If a process respawns over CHILD_MAXSTARTS times in TIMER_CHILD
-	 * seconds after it was first started, it will be suspended. This is
-	 * handled by a suspension timer started in start_child. */
+	checking.enabled = 1;
 
-	/* Don't start log if run was already started without forwarding its
-	 * output to pipe_runlog */
-	if (!log.suspended && !log.proc.pid && (!run.proc.pid || flag_forward)) {
-		if (ALLOC_FAIL(attr, create_procattr_log(&attr, pool))) {
-			warn_error2("failed to start ", log.progname);
-		} else {
-			start_child(&log, attr, pool);
-		}
+	if (!(buf = read_setting(FILE_CHECKPOLICY, pool))) {
+		return;
 	}
 
-	/* Always start run if not already running */
-	if (!run.suspended && !run.proc.pid) {
-		if (ALLOC_FAIL(attr, create_procattr_run(&attr, pool))) {
-			warn_error2("failed to start ", run.progname);
+	for (name = apr_strtok(buf, SETTING_SEPARATORS, &state); name;
+			name = apr_strtok(NULL, SETTING_SEPARATORS, &state)) {
+		if (!(value = apr_strtok(NULL, SETTING_SEPARATORS, &state))) {
+			warn_error3("missing value in " FILE_CHECKPOLICY ": ", name, "");
+			break;
+		}
+
+		num = strtod(value, &end);
+
+		if (*end != '\0' || num <= 0 || num > APR_INT32_MAX) {
+			warn_error3("invalid value in " FILE_CHECKPOLICY ": ", value, "");
+		} else if (!strcmp(name, "interval")) {
+			checking.interval = (apr_interval_time_t)(num * APR_USEC_PER_SEC);
+		} else if (!strcmp(name, "timeout")) {
+			checking.timeout = (apr_interval_time_t)(num * APR_USEC_PER_SEC);
+		} else if (!strcmp(name, "failures")) {
+			if (num < 1) {
+				warn_error3("invalid value in " FILE_CHECKPOLICY ": ", value,
+					"");
+			} else {
+				checking.failures = (apr_uint32_t)num;
+			}
 		} else {
-			start_child(&run, attr, pool);
+			warn_error3("invalid setting in " FILE_CHECKPOLICY ": ", name,
+				"");
 		}
 	}
-
-	/* Limit respawn rate. This is only an issue if exec repeatedly fails
-	 * after a child process has been created */
-	apr_sleep(apr_time_from_sec(PAUSE_RESPAWN));
 }
 
-/* Sends a signal to a child process if its pid is non-zero, prints out a log
- * message. */
-static void signal_child(child_proc *child, int sig, apr_pool_t *pool)
+/* Reads FILE_NOTIFY, which enables readiness notification for run. It may
+ * have the seconds to wait for run to notify before restarting it, or
+ * nothing to wait for as long as it takes. */
+static void read_notify_policy(apr_pool_t *pool)
 {
-	char *str;
+	char *buf, *value, *state, *end;
+	double num;
 
-	die_assert(child);
 	die_assert(pool);
-	warn_assert(sig > 0 && sig < NSIG);
 
-	if (!child->proc.pid) {
-		/* Process not running */
+	if (!(buf = read_setting(FILE_NOTIFY, pool))) {
 		return;
 	}
 
-	if (ALLOC_FAIL(str,
-			apr_psprintf(pool, "sending signal %i to %s [pid %i]",
-				sig, child->progname, child->proc.pid))) {
-		warn_allocerror0();
-		error2(INFO, "sending a signal to ", child->progname);
-	} else {
-		error1(INFO, str);
+	notify.enabled = 1;
+
+	if (!(value = apr_strtok(buf, SETTING_SEPARATORS, &state))) {
+		return;
 	}
 
-	apr_proc_kill(&child->proc, sig);
+	num = strtod(value, &end);
+
+	if (*end != '\0' || num < 0 || num > APR_INT32_MAX) {
+		warn_error3("invalid value in " FILE_NOTIFY ": ", value, "");
+	} else {
+		notify.timeout = (apr_interval_time_t)(num * APR_USEC_PER_SEC);
+	}
 }
 
-/* Terminates a child and waits until it exits. */
-static void terminate_child(child_proc *child, apr_pool_t *pool)
+/* Reads FILE_LOGPOLICY, which has pairs of names and values in kilobytes:
+ * pipe for the size of the pipe from run to log, and spool for the output
+ * of run kept in memory while log is down. Zero keeps the default pipe
+ * size and disables spooling. */
+static void read_log_policy(apr_pool_t *pool)
 {
-	/* Services are expected to handle SIGTERM and exit gracefully.
-	 * Otherwise, we follow the postgresql signaling scheme:
-	 * http://www.postgresql.org/docs/8.1/interactive/app-postmaster.html */
-
-	int sigs[] = { SIGTERM, SIGTERM, SIGINT, SIGQUIT, SIGKILL };
-	int i = 0;
+	char *buf, *name, *value, *state, *end;
+	double num;
 
-	die_assert(child);
 	die_assert(pool);
 
-	/* Do not try to wake up the process on SIGCHLD */
-	flag_ignchld = 1;
+	if (!(buf = read_setting(FILE_LOGPOLICY, pool))) {
+		return;
+	}
+
+	for (name = apr_strtok(buf, SETTING_SEPARATORS, &state); name;
+			name = apr_strtok(NULL, SETTING_SEPARATORS, &state)) {
+		if (!(value = apr_strtok(NULL, SETTING_SEPARATORS, &state))) {
+			warn_error3("missing value in " FILE_LOGPOLICY ": ", name, "");
+			break;
+		}
+
+		num = strtod(value, &end);
+
+		if (*end != '\0' || num < 0 || num > APR_INT32_MAX / 1024) {
+			warn_error3("invalid value in " FILE_LOGPOLICY ": ", value, "");
+		} else if (!strcmp(name, "pipe")) {
+			logging.pipesize = (apr_size_t)num * 1024;
+		} else if (!strcmp(name, "spool")) {
+			logging.spoolsize = (apr_size_t)num * 1024;
+		} else {
+			warn_error3("invalid setting in " FILE_LOGPOLICY ": ", name, "");
+		}
+	}
+}
 
-	while (child->proc.pid) {
-		/* Send a signal */
-		signal_child(child, sigs[i], pool);
+/* Reads the restart policy from FILE_RESTART, which has pairs of names and
+ * values: delay, maxdelay and stable in seconds, multiplier, and jitter as
+ * a fraction of the delay. Unknown or invalid entries are skipped. */
+static void read_restart_policy(apr_pool_t *pool)
+{
+	char *buf, *name, *value, *state, *end;
+	double num;
 
-		/* Wait for the process to exit */
-		apr_signal_unblock(SIGCHLD);
-		apr_sleep(apr_time_from_sec(PAUSE_TERMWAIT));
-		apr_signal_block(SIGCHLD);
+	die_assert(pool);
 
-		/* See if it really did */
-		check_children(pool);
+	if (!(buf = read_setting(FILE_RESTART, pool))) {
+		return;
+	}
 
-		/* Just give up if SIGKILL had no effect */
-		if (sigs[i] == SIGKILL) {
+	for (name = apr_strtok(buf, SETTING_SEPARATORS, &state); name;
+			name = apr_strtok(NULL, SETTING_SEPARATORS, &state)) {
+		if (!(value = apr_strtok(NULL, SETTING_SEPARATORS, &state))) {
+			warn_error3("missing value in " FILE_RESTART ": ", name, "");
 			break;
+		}
+
+		num = strtod(value, &end);
+
+		if (*end != '\0' || num < 0 || num > APR_INT32_MAX) {
+			warn_error3("invalid value in " FILE_RESTART ": ", value, "");
+		} else if (!strcmp(name, "delay")) {
+			restart.delay = (apr_interval_time_t)(num * APR_USEC_PER_SEC);
+		} else if (!strcmp(name, "multiplier")) {
+			if (num < 1) {
+				warn_error3("invalid value in " FILE_RESTART ": ", value, "");
+			} else {
+				restart.multiplier = num;
+			}
+		} else if (!strcmp(name, "maxdelay")) {
+			restart.maxdelay = (apr_interval_time_t)(num * APR_USEC_PER_SEC);
+		} else if (!strcmp(name, "jitter")) {
+			if (num > 1) {
+				warn_error3("invalid value in " FILE_RESTART ": ", value, "");
+			} else {
+				restart.jitter = num;
+			}
+		} else if (!strcmp(name, "stable")) {
+			restart.stable = (apr_interval_time_t)(num * APR_USEC_PER_SEC);
 		} else {
-			/* Try again */
-			++i;
+			warn_error3("invalid setting in " FILE_RESTART ": ", name, "");
 		}
 	}
 
-	/* Reset suspension */
-	child->starts = 0;
-	child->suspended = 0;
-	child->suspended_periods = 0;
+	if (restart.maxdelay < restart.delay) {
+		restart.maxdelay = restart.delay;
+	}
+}
+
+static void on_escalate(ngim_loop_t *l, ngim_event_t *ev, void *data);
+
+/* Sends the next signal in the termination sequence to a child, and sets a
+ * timer for the one after it. Gives up when there are none left. */
+static void escalate_child(child_proc *child, apr_pool_t *pool)
+{
+	die_assert(child);
+	die_assert(pool);
+
+	if (child->stopstep >= stop_seq.count) {
+		warn_error2("failed to terminate ", child->progname);
+		child->stopping = STOP_ABANDONED;
+		return;
+	}
+
+	signal_child(child, stop_seq.sigs[child->stopstep], pool);
+
+	child->escalate = ngim_loop_timer(loop, stop_seq.waits[child->stopstep],
+		0, on_escalate, child);
+	++child->stopstep;
+}
+
+/* Called when a child has not exited in time after a signal */
+static void on_escalate(ngim_loop_t *l, ngim_event_t *ev, void *data)
+{
+	child_proc *child = data;
+
+	die_assert(child);
+	child->escalate = NULL;
+
+	escalate_child(child, pool_loop);
+	update();
+}
+
+/* Starts the termination sequence for a child, unless it's already
+ * running. Returns immediately, the child is signaled again each time a
+ * timeout passes, until it exits. */
+static void stop_child(child_proc *child, apr_pool_t *pool)
+{
+	die_assert(child);
+	die_assert(pool);
+
+	if (!child->proc.pid || child->stopping == STOP_ACTIVE) {
+		return;
+	}
+
+	child->stopping = STOP_ACTIVE;
+	child->stopstep = 0;
+	escalate_child(child, pool);
+}
+
+/* Starts terminating a child on request. */
+static void terminate_child(child_proc *child, apr_pool_t *pool)
+{
+	die_assert(child);
+	die_assert(pool);
 
-	/* Continue with normal behavior */
-	flag_ignchld = 0;
+	/* Forget earlier failures, the child is restarted on request */
+	child->failures = 0;
+	child->delay = 0;
+	ngim_loop_cancel(child->respawn);
+	child->respawn = NULL;
+
+	stop_child(child, pool);
+}
+
+/* Returns non-zero if a child is not running, or can't be stopped */
+static inline int child_stopped(child_proc *child)
+{
+	return (!child->proc.pid || child->stopping == STOP_ABANDONED);
 }
 
 /* Performs actions based on the received control command. */
@@ -622,12 +2288,26 @@ static void parse_command(unsigned char cmd, apr_pool_t *pool)
 		}
 	}
 
-	if (cmd == MONITOR_CMD_KILL || flag_stop) {
+	if (cmd == MONITOR_CMD_KILL && flag_overlap && !flag_stop &&
+		run.proc.pid && run.stopping == STOP_NONE && !retired.proc.pid) {
+		/* Start a new run first, the old one is stopped when it's up */
+		retire_run();
+	} else if (cmd == MONITOR_CMD_KILL || flag_stop) {
 		/* Close pipe_runlog, so the children receive EOF in case they are
 		 * waiting for I/O on the pipe (i.e. after one of them exits) */
 		close_pipe();
+
+		/* Settings can change between restarts, but not in the middle of
+		 * one */
+		if (run.stopping != STOP_ACTIVE && log.stopping != STOP_ACTIVE) {
+			read_stop_sequence(pool);
+		}
+
+		/* Both at the same time */
+		stop_probe();
 		terminate_child(&run, pool);
 		terminate_child(&log, pool);
+		terminate_child(&retired, pool);
 	} else if (cmd == MONITOR_CMD_WAKEUP) {
 		/* Do nothing */
 	} else if (cmd > 0 && cmd < NSIG) {
@@ -638,44 +2318,109 @@ static void parse_command(unsigned char cmd, apr_pool_t *pool)
 	}
 }
 
-/* Waits for input to the control pipe, reads one byte and tries to process it
- * as a command. */
-static void wait_for_command(apr_pool_t *pool)
+/* Called after each event. Checks for dead children, starts the service if
+ * requested, and stops the loop when done. */
+static void update(void)
+{
+	die_assert(pool_loop);
+
+	check_children(pool_loop);
+
+	if (!flag_stop) {
+		start_children(pool_loop);
+		schedule_probe();
+		update_spool();
+	} else if (child_stopped(&run) && child_stopped(&log) &&
+			child_stopped(&retired)) {
+		ngim_loop_stop(loop);
+	}
+
+	apr_pool_clear(pool_loop);
+}
+
+static void on_command(ngim_loop_t *l, ngim_event_t *ev, void *data);
+
+/* Watches the control pipe again after a pause */
+static void on_control_retry(ngim_loop_t *l, ngim_event_t *ev, void *data)
+{
+	if (!(control_watch = ngim_loop_file(loop, pipe_control, on_command,
+			NULL))) {
+		warn_error1("failed to set up polling for " PIPE_CONTROL);
+		ngim_loop_timer(loop, apr_time_from_sec(PAUSE_FAILURE), 0,
+			on_control_retry, NULL);
+	}
+}
+
+/* Reads one byte from the control pipe and tries to process it as a
+ * command. */
+static void on_command(ngim_loop_t *l, ngim_event_t *ev, void *data)
 {
 	apr_status_t status;
 	unsigned char cmd;
-	int signaled = 0;
 
-	die_assert(pool);
-	die_assert(pset_control);
 	die_assert(pipe_control);
 
-	apr_signal_unblock(SIGCHLD);
+	if (APR_FAIL(status, apr_file_read_full(pipe_control, &cmd, 1, NULL))) {
+		warn_aprerror1(status, "failed to read from " PIPE_CONTROL);
+		/* Pause reading commands, but keep running the children */
+		ngim_loop_cancel(control_watch);
+		control_watch = NULL;
+		ngim_loop_timer(loop, apr_time_from_sec(PAUSE_FAILURE), 0,
+			on_control_retry, NULL);
+	} else {
+		parse_command(cmd, pool_loop);
+	}
 
-	/* Wait for a command from pipe_control */
-	if (APR_FAIL(status, apr_pollset_poll(pset_control,
-			apr_time_from_sec(TIMEOUT_POLL), &signaled, NULL))) {
-		apr_signal_block(SIGCHLD);
+	update();
+}
 
-		if (APR_STATUS_IS_EINTR(status) || APR_STATUS_IS_TIMEUP(status)) {
-			/* Interrupt or timeout */
-			return;
-		} else {
-			/* Sleep for a while and try again */
-			warn_aprerror1(status, "failed to poll for " PIPE_CONTROL
-						", sleeping");
-			apr_sleep(apr_time_from_sec(PAUSE_FAILURE));
-		}
-	} else {
-		apr_signal_block(SIGCHLD);
-		warn_assert(signaled == 1);
+/* Called on SIGHUP, and SIGCHLD if needed */
+static void on_wakeup(ngim_loop_t *l, ngim_event_t *ev, void *data)
+{
+	update();
+}
 
-		if (APR_FAIL(status,
-				apr_file_read_full(pipe_control, &cmd, 1, NULL))) {
-			warn_aprerror1(status, "failed to read from " PIPE_CONTROL);
-			apr_sleep(apr_time_from_sec(PAUSE_FAILURE));
-		} else {
-			parse_command(cmd, pool);
+/* Called on SIGINT, SIGTERM, and SIGQUIT */
+static void on_terminate(ngim_loop_t *l, ngim_event_t *ev, void *data)
+{
+	/* Try to terminate gracefully, although a command would have been
+	 * preferred instead of a signal */
+	warn_error1("received a signal");
+	/* Set the flag to prevent us from restarting children that have
+	 * possibly also been signaled to terminate, usually in case of a
+	 * system wide shutdown */
+	flag_intr = 1;
+	parse_command(MONITOR_CMD_TERMINATE, pool_loop);
+
+	update();
+}
+
+/* Registers the control pipe and signals with the event loop */
+static void setup_loop(apr_pool_t *pool)
+{
+	int sigs_terminate[] = { SIGINT, SIGTERM, SIGQUIT };
+	unsigned int i;
+
+	die_assert(pool);
+
+	if (ngim_loop_create(&loop, pool) < 0) {
+		die_error1("failed to create an event loop");
+	}
+
+	if (!(control_watch = ngim_loop_file(loop, pipe_control, on_command,
+			NULL))) {
+		die_error1("failed to set up polling for " PIPE_CONTROL);
+	}
+
+	/* Children are watched with SIGCHLD until the first one is started */
+	if (!(signal_chld = ngim_loop_signal(loop, SIGCHLD, on_wakeup, NULL)) ||
+		!ngim_loop_signal(loop, SIGHUP, on_wakeup, NULL)) {
+		die_error1("failed to set up signal handling");
+	}
+
+	for (i = 0; i < sizeof(sigs_terminate) / sizeof(int); ++i) {
+		if (!ngim_loop_signal(loop, sigs_terminate[i], on_terminate, NULL)) {
+			die_error1("failed to set up signal handling");
 		}
 	}
 }
@@ -702,134 +2447,49 @@ static int monitor(const char *root)
 		die_syserror3("chdir to ", root, " failed");
 	}
 
-	/* Drop unneeded privileges */
-	if (ngim_priv_drop(NGIM_PRIV_SRVCTL, NULL, NULL) < 0) {
-		warn_error1("failed to drop privileges");
-	}
-
 	if (APR_FAIL(status, apr_pool_create(&pool, g_pool))) {
 		die_aprerror1(status, "failed to create a memory pool");
 	}
 
-	/* Setup */
+	/* Setup, sockets may need privileges for binding */
 	setup_monitor(pool);
+	open_sockets(pool);
+
+	/* Drop unneeded privileges */
+	if (ngim_priv_drop(NGIM_PRIV_SRVCTL, NULL, NULL) < 0) {
+		warn_error1("failed to drop privileges");
+	}
+
+	read_restart_policy(pool);
+	read_notify_policy(pool);
+	read_check_policy(pool);
+	read_log_policy(pool);
+	setup_loop(g_pool);
 	child_init(&run, FILE_RUN);
 	child_init(&log, FILE_LOG);
+	child_init(&retired, FILE_RUN);
 
 	/* Initial status */
-	write_status(pool);
+	write_status();
 
 	apr_pool_clear(pool);
+	pool_loop = pool;
 
-	/* After this point, the program should not die in vain */
-	do {
-		/* Check for dead children, and start service if requested */
-		check_children(pool);
-		start_children(pool);
-
-		/* Clear the pool before sleeping */
-		apr_pool_clear(pool);
+	/* After this point, the program should not die in vain. Start the
+	 * service if requested, and then act on commands, signals, and timers */
+	update();
 
-		/* Wait for some action */
-		wait_for_command(pool);
-	} while (!flag_stop);
+	if (ngim_loop_run(loop) < 0) {
+		/* Don't leave the service unsupervised, even though nothing will
+		 * wait for it to stop */
+		warn_error1("event loop failed");
+		parse_command(MONITOR_CMD_TERMINATE, pool);
+	}
 
 	error1(INFO, "exiting");
 	return EXIT_SUCCESS;
 }
 
-/* Writes a command to pipe_control */
-static inline void write_command(unsigned char cmd)
-{
-	apr_status_t status;
-	die_assert(pipe_control);
-
-	if (APR_FAIL(status, apr_file_putc(cmd, pipe_control))) {
-		die_aprerror1(status, "failed to write a command to " PIPE_CONTROL);
-	}
-}
-
-/* Checks if a child process should be suspended, i.e. if it has been restarted
- * more than CHILD_MAXSTARTS times during the past TIMER_CHILD period. If timer
- * is not needed by this child anymore, returns zero. Otherwise, the suspension
- * timer should be restarted by the caller. */
-static int check_suspension(child_proc *child)
-{
-	if (child->suspended) {
-		/* Should the suspension be lifted */
-		if (++child->suspended_periods >= CHILD_SUSPENSION) {
-			child->suspended = 0;
-			child->suspended_periods = 0;
-			write_command(MONITOR_CMD_WAKEUP);
-			/* Timer should be restarted later if needed */
-			return 0;
-		}
-		/* Suspension in progress */
-		return 1;
-	} else {
-		if (child->starts > 0) {
-			/* Should the process be suspended */
-			if (child->starts > CHILD_MAXSTARTS) {
-				child->suspended = 1;
-				error3(WARNING, "suspended ", child->progname,
-						", respawning too fast");
-			}
-			child->starts = 0;
-			/* There were restarts */
-			return 1;
-		}
-		/* No restarts lately */
-		return 0;
-	}
-}
-
-/* Handler for SIGALRM */
-static inline void handle_alarm()
-{
-	/* Check for suspension, restart the timer if necessary */
-	int restart = check_suspension(&log);
-
-	if (check_suspension(&run) || restart) {
-		alarm(TIMER_CHILD);
-	} else {
-		flag_timer = 0;
-	}
-}
-
-/* Signal handler */
-static void handler(int sig)
-{
-	switch (sig) {
-	case SIGALRM:
-		handle_alarm();
-		break;
-	case SIGCHLD:
-		if (flag_ignchld) {
-			/* Don't wake up the process */
-			return;
-		}
-		/* No break */
-	case SIGHUP:
-		/* Wake up the process */
-		write_command(MONITOR_CMD_WAKEUP);
-		break;
-	case SIGINT:
-	case SIGTERM:
-	case SIGQUIT:
-		/* Try to terminate gracefully, although a command would have been
-		 * preferred instead of a signal */
-		warn_error1("received a signal");
-		/* Set the flag to prevent us from restarting children that have
-		 * possibly also been signaled to terminate, usually in case of a
-		 * system wide shutdown */
-		flag_intr = 1;
-		write_command(MONITOR_CMD_TERMINATE);
-		break;
-	default:
-		break;
-	}
-}
-
 /* Find a display name for the service */
 const char * service_displayname(const char *root)
 {
@@ -856,19 +2516,13 @@ int main(int argc, const char * const * argv, const char * const *env)
 
 	ngim_base_app_init(PROGRAM_MONITOR, &argc, &argv, &env);
 
+	/* A full log pipe must not stop the monitor from doing its job */
+	ngim_seterrormode(ngim_geterrormode() | NGIM_ERROR_NONBLOCK);
+
 	if (argc < 2 || argc > 3) {
 		die_error3("usage: ", argv[0], " directory [ name ]");
 	}
 
-	/* Signals */
-	apr_signal_block(SIGCHLD);
-	apr_signal(SIGALRM,	handler);
-	apr_signal(SIGCHLD, handler);
-	apr_signal(SIGHUP,	handler);
-	apr_signal(SIGINT,  handler);
-	apr_signal(SIGTERM, handler);
-	apr_signal(SIGQUIT, handler);
-
 	if (argc > 2) {
 		dispname = argv[2];
 	} else {
@@ -10,11 +10,14 @@
 #include <apr_env.h>
 #include <apr_file_info.h>
 #include <apr_file_io.h>
+#include <apr_mmap.h>
 #include <apr_portable.h>
 #include <apr_strings.h>
 
 /* Misc. definitions */
 #define PRIORITY_MAXLEN		512
+#define WAIT_MAXSECONDS		86400	/* Max. value for --wait */
+#define WAIT_INTERVAL		100		/* Milliseconds between status checks */
 
 /* Function pointer type for the ISO 8601 conversion */
 typedef void (*iso8601_format)(char *s, apr_time_t t);
@@ -37,7 +40,10 @@ enum {
 	cmd_stop		= 1 << 13,
 	cmd_term		= 1 << 14,
 	cmd_up			= 1 << 15,
-	cmd_utc			= 1 << 16
+	cmd_utc			= 1 << 16,
+	cmd_exits		= 1 << 17,
+	cmd_usage		= 1 << 18,
+	cmd_wait		= 1 << 19
 };
 
 /* Variables for command line arguments */
@@ -45,7 +51,11 @@ static const char *arg_base = NULL;
 static const char *arg_sign = NULL;
 static const char *arg_name = NULL;
 static const char *arg_priority = NULL;
+static const char *arg_wait = NULL;
 static int arg_signum = 0;
+static int arg_exits = 0;
+static int arg_usage = 0;
+static apr_interval_time_t arg_waittime = 0;
 static iso8601_format arg_func_format = NULL;
 
 /* Command line parameters and arguments */
@@ -54,6 +64,7 @@ static ngim_cmdline_params_t service_params[] = {
 	{ "-h",			cmd_help,		NULL },
 	{ "--base",		cmd_base,		&arg_base },
 	{ "--down",		cmd_down,		NULL },
+	{ "--exits",	cmd_exits,		NULL },
 	{ "--kill-all",	cmd_killall,	NULL },
 	{ "--kill",		cmd_kill,		NULL },
 	{ "--list",		cmd_list,		NULL },
@@ -66,7 +77,9 @@ static ngim_cmdline_params_t service_params[] = {
 	{ "--status",	cmd_status,		NULL },
 	{ "--stop", 	cmd_stop,		NULL },
 	{ "--term",		cmd_term,		NULL },
+	{ "--usage",	cmd_usage,		NULL },
 	{ "--up",		cmd_up,			NULL },
+	{ "--wait",		cmd_wait,		&arg_wait },
 	{ "--utc",		cmd_utc,		NULL },
 	{ NULL,			0,				NULL }
 };
@@ -77,7 +90,7 @@ static ngim_cmdline_args_t service_args[] = {
 
 #define CMDLINE_USAGE \
 	"--help | [ --base directory ] {1}\n" \
-	"    1: --list | --status [ --utc ] | {2} [ --name ] service | --kill-all\n" \
+	"    1: --list | --status [ --utc ] [ --exits ] [ --usage ] | {2} [ --wait seconds ] [ --name ] service | --kill-all\n" \
 	"    2: --priority number | --up | --down | --start | --restart | --stop | --kill | {3} | --term\n" \
 	"    3: --signal {4} | --sigterm {4}\n" \
 	"    4: ALRM | CONT | HUP | STOP | TERM | USR1 | USR2 | WINCH\n" \
@@ -88,6 +101,8 @@ static ngim_cmdline_args_t service_args[] = {
 	"      --list      prints information about available services\n" \
 	"      --status    prints information about active services\n" \
 	"      --utc       prints status times in the UTC time zone\n" \
+	"      --exits     prints the latest exits of each service with status\n" \
+	"      --usage     prints the resources used by each service with status\n" \
 	"      --name      sets the name of the targeted service\n" \
 	"      --kill-all  restarts all active services and monitors\n" \
 	"\n" \
@@ -101,7 +116,9 @@ static ngim_cmdline_args_t service_args[] = {
 	"      --kill      restarts a service and its monitor\n" \
     "      --signal    sends a signal to a service process\n" \
     "      --sigterm   same as --down followed by --signal\n" \
-	"      --term      same as --sigterm TERM\n"
+	"      --term      same as --sigterm TERM\n" \
+	"      --wait      waits until the service is ready after --up, --start, or\n" \
+	"                  --restart\n"
 
 /* Signals allowed to be sent to services */
 static const struct {
@@ -132,7 +149,36 @@ static const struct {
 		"\t\trun %s\n" \
 		"\t\tlog %s\n" \
 		"\t\tlogging %s\n" \
-		"\t\twants %s\n"
+		"\t\twants %s\n" \
+		"\t\tstarted run %u log %u times\n"
+#define STATUS_MESSAGE_READY_FORMAT \
+		"\t\tready %s\n"
+#define STATUS_MESSAGE_NOTREADY			"no"
+#define STATUS_MESSAGE_CHECK_FORMAT \
+		"\t\tchecked %s %s after %u.%03u s, %u failures in a row, %u checks\n"
+#define STATUS_MESSAGE_NOTCHECKED \
+		"\t\tchecked never\n"
+#define STATUS_MESSAGE_SOCKETS_FORMAT \
+		"\t\tsockets %u\n"
+#define STATUS_MESSAGE_REPLACING_FORMAT \
+		"\t\treplacing pid %u\n"
+#define STATUS_MESSAGE_SPOOL_FORMAT \
+		"\t\tspooled %u bytes, dropped %" APR_UINT64_T_FMT " bytes," \
+		" pipe %u bytes\n"
+#define STATUS_MESSAGE_EXIT_FORMAT \
+		"\t\texited %s %s [pid %u] %s after %u.%03u s\n"
+#define STATUS_MESSAGE_USAGE_FORMAT \
+		"\t\tused %s %s user %" APR_UINT64_T_FMT ".%03u s" \
+		" system %" APR_UINT64_T_FMT ".%03u s" \
+		" rss %" APR_UINT64_T_FMT " kB" \
+		" faults %" APR_UINT64_T_FMT " minor %" APR_UINT64_T_FMT " major" \
+		" switches %" APR_UINT64_T_FMT " voluntary" \
+		" %" APR_UINT64_T_FMT " involuntary\n"
+#define STATUS_MESSAGE_USAGE_LAST		"last"
+#define STATUS_MESSAGE_USAGE_TOTAL		"total"
+#define STATUS_MESSAGE_EXIT_CODE		"with code %u"
+#define STATUS_MESSAGE_EXIT_SIGNAL		"on signal %u"
+#define STATUS_MESSAGE_EXIT_CORE		"on signal %u, core dumped"
 #define STATUS_MESSAGE_RUNNING_FORMAT_M \
 	"pid %u up %u min %u s"
 #define STATUS_MESSAGE_RUNNING_FORMAT_H \
@@ -140,6 +186,9 @@ static const struct {
 #define STATUS_MESSAGE_RUNNING_FORMAT_D \
 	"pid %u up %" APR_UINT64_T_FMT " d %u h %u min %u s"
 #define STATUS_MESSAGE_NOTRUNNING		"not running"
+#define STATUS_READ_TRIES		1000	/* Attempts to get a consistent copy */
+#define STATUS_MESSAGE_BACKOFF_FORMAT \
+	"not running, %u failures, restart delay %u.%03u s"
 
 /* Finds a signal number for a signal name from the list of allowed signals. */
 static int service_signal_byname(const char *name)
@@ -230,6 +279,30 @@ static int validate_cmdline(const apr_uint32_t selected)
 		++commands;
 	}
 
+	/* Wait only for a service to come up */
+	if (selected & cmd_wait) {
+		die_assert(arg_wait);
+
+		if (!(selected & (cmd_up | cmd_start | cmd_restart))) {
+			warn_error1("--wait needs --up, --start, or --restart");
+			return -1;
+		}
+
+		for (i = 0; arg_wait[i] != '\0'; ++i) {
+			if (arg_wait[i] < '0' || arg_wait[i] > '9') {
+				warn_error1("invalid value for --wait");
+				return -1;
+			}
+		}
+
+		if (i == 0 || i > 9 || atoi(arg_wait) > WAIT_MAXSECONDS) {
+			warn_error1("invalid value for --wait");
+			return -1;
+		}
+
+		arg_waittime = apr_time_from_sec(atoi(arg_wait));
+	}
+
 	/* Must have either list, status, killall, or name */
 	if ((selected & cmd_list    && arg_name) ||
 		(selected & cmd_status  && arg_name) ||
@@ -237,7 +310,9 @@ static int validate_cmdline(const apr_uint32_t selected)
 		(selected & cmd_status  && selected & cmd_list) ||
 		(selected & cmd_list    && selected & cmd_killall) ||
 		(selected & cmd_killall && selected & cmd_status) ||
-		(selected & cmd_utc     && !(selected & cmd_status))) {
+		(selected & cmd_utc     && !(selected & cmd_status)) ||
+		(selected & cmd_exits   && !(selected & cmd_status)) ||
+		(selected & cmd_usage   && !(selected & cmd_status))) {
 		warn_error1("invalid parameters");
 		return -1;
 	} else if (selected & cmd_status) {
@@ -246,6 +321,8 @@ static int validate_cmdline(const apr_uint32_t selected)
 			warn_error1("invalid parameters");
 			return -1;
 		}
+		arg_exits = (selected & cmd_exits) != 0;
+		arg_usage = (selected & cmd_usage) != 0;
 		/* Default to local time zone */
 		if (selected & cmd_utc) {
 			arg_func_format = ngim_iso8601_utc_format;
@@ -769,15 +846,15 @@ static inline const char * format_priority()
 
 /* Formats process information */
 static const char * format_proc(const unsigned char *packed,
-		const apr_uint32_t *pid, apr_pool_t *pool)
+		apr_uint32_t pid, apr_uint32_t failures, apr_uint32_t delay,
+		apr_pool_t *pool)
 {
 	char *msg;
 
 	die_assert(packed);
-	die_assert(pid);
 	die_assert(pool);
 
-	if (*pid) {
+	if (pid) {
 		apr_uint64_t days, uptime = 0;
 		apr_uint32_t hours, minutes, seconds;
 		ngim_tain_t now;
@@ -797,24 +874,28 @@ static const char * format_proc(const unsigned char *packed,
 		if (days > 0) {
 			if (ALLOC_FAIL(msg,
 					apr_psprintf(pool, STATUS_MESSAGE_RUNNING_FORMAT_D,
-						*pid, days, hours, minutes, seconds))) {
+						pid, days, hours, minutes, seconds))) {
 				die_allocerror0();
 			}
 		} else if (hours > 0) {
 			if (ALLOC_FAIL(msg,
 					apr_psprintf(pool, STATUS_MESSAGE_RUNNING_FORMAT_H,
-						*pid, hours, minutes, seconds))) {
+						pid, hours, minutes, seconds))) {
 				die_allocerror0();
 			}
 		} else {
 			if (ALLOC_FAIL(msg,
 					apr_psprintf(pool, STATUS_MESSAGE_RUNNING_FORMAT_M,
-						*pid, minutes, seconds))) {
+						pid, minutes, seconds))) {
 				die_allocerror0();
 			}
 		}
-	} else {
+	} else if (!failures) {
 		msg = STATUS_MESSAGE_NOTRUNNING;
+	} else if (ALLOC_FAIL(msg,
+			apr_psprintf(pool, STATUS_MESSAGE_BACKOFF_FORMAT,
+				failures, delay / 1000, delay % 1000))) {
+		die_allocerror0();
 	}
 
 	return msg;
@@ -824,9 +905,254 @@ static const char * format_proc(const unsigned char *packed,
  * Service status
  */
 
+/* Reads a consistent copy of the monitor status record from a file.
+ * Returns non-zero if successful. */
+static int read_status(const char *path, monitor_status *rec,
+		apr_pool_t *pool)
+{
+	apr_status_t status;
+	apr_file_t *file;
+	apr_finfo_t info;
+	apr_mmap_t *mm;
+	const monitor_status *shared;
+	apr_size_t size;
+	apr_uint32_t start;
+	int i;
+
+	die_assert(path);
+	die_assert(rec);
+	die_assert(pool);
+
+	if (APR_FAIL(status, apr_file_open(&file, path, APR_FOPEN_READ |
+			APR_FOPEN_BINARY, FPROT_FILE_STATUS, pool))) {
+		warn_aprerror2(status, "failed to open ", path);
+		return 0;
+	}
+
+	if (APR_FAIL(status, apr_file_info_get(&info, APR_FINFO_SIZE, file))) {
+		warn_aprerror2(status, "failed to stat ", path);
+		apr_file_close(file);
+		return 0;
+	}
+
+	/* Files from older monitors are too short, newer ones may have more
+	 * than we know about */
+	if (info.size < (apr_off_t)MONITOR_STATUS_BASESIZE) {
+		warn_error3("status file ", path, " not in a known format");
+		apr_file_close(file);
+		return 0;
+	}
+
+	size = sizeof(monitor_status);
+
+	if (info.size < (apr_off_t)size) {
+		size = (apr_size_t)info.size;
+	}
+
+	memset(rec, 0, sizeof(monitor_status));
+
+	if (APR_FAIL(status,
+			apr_mmap_create(&mm, file, 0, size, APR_MMAP_READ, pool))) {
+		warn_aprerror2(status, "failed to map ", path);
+		apr_file_close(file);
+		return 0;
+	}
+
+	apr_file_close(file);
+	shared = mm->mm;
+
+	/* The monitor doesn't wait for readers, try again if it was busy */
+	for (i = 0; i < STATUS_READ_TRIES; ++i) {
+		start = ngim_seqlock_read_begin(&shared->sequence);
+		memcpy(rec, shared, size);
+
+		if (!ngim_seqlock_read_retry(&shared->sequence, start)) {
+			break;
+		}
+	}
+
+	apr_mmap_delete(mm);
+
+	if (i == STATUS_READ_TRIES) {
+		warn_error3("status file ", path, " kept changing while read");
+		return 0;
+	}
+
+	if (rec->magic != MONITOR_STATUS_MAGIC ||
+		rec->version != MONITOR_STATUS_VERSION ||
+		rec->size < MONITOR_STATUS_BASESIZE) {
+		warn_error3("status file ", path, " not in a known format");
+		return 0;
+	}
+
+	/* Fields the monitor doesn't know about are zero */
+	if (rec->size < size) {
+		memset((char *)rec + rec->size, 0, size - rec->size);
+	}
+
+	return 1;
+}
+
+/* Formats an exit according to STATUS_MESSAGE_EXIT_FORMAT. */
+static const char * format_exit(const monitor_exit *entry, apr_pool_t *pool)
+{
+	char *msg, *how;
+	ngim_tain_t stamp;
+	char formatted[NGIM_ISO8601_FORMAT];
+
+	die_assert(entry);
+	die_assert(pool);
+	die_assert(arg_func_format);
+
+	if (ngim_tain_unpack(entry->time, &stamp)) {
+		arg_func_format(formatted, ngim_tain_to_apr(&stamp));
+	} else {
+		formatted[0] = '?';
+		formatted[1] = '\0';
+	}
+
+	if (entry->flags & MONITOR_EXIT_CORE) {
+		how = apr_psprintf(pool, STATUS_MESSAGE_EXIT_CORE, entry->signal);
+	} else if (entry->signal) {
+		how = apr_psprintf(pool, STATUS_MESSAGE_EXIT_SIGNAL, entry->signal);
+	} else {
+		how = apr_psprintf(pool, STATUS_MESSAGE_EXIT_CODE, entry->code);
+	}
+
+	if (unlikely(!how) ||
+		ALLOC_FAIL(msg,
+			apr_psprintf(pool, STATUS_MESSAGE_EXIT_FORMAT,
+				formatted,
+				(entry->flags & MONITOR_EXIT_LOG) ? FILE_LOG : FILE_RUN,
+				entry->pid, how,
+				entry->uptime / 1000, entry->uptime % 1000))) {
+		die_allocerror0();
+	}
+
+	return msg;
+}
+
+/* Formats the latest exits of a service, newest first. */
+static const char * format_exits(const monitor_status *rec, apr_pool_t *pool)
+{
+	char *msg = "";
+	apr_uint32_t i, count;
+
+	die_assert(rec);
+	die_assert(pool);
+
+	count = (rec->exits < MONITOR_EXITS) ? rec->exits : MONITOR_EXITS;
+
+	for (i = 1; i <= count; ++i) {
+		if (ALLOC_FAIL(msg, apr_pstrcat(pool, msg,
+				format_exit(&rec->exit[(rec->exits - i) % MONITOR_EXITS],
+					pool), NULL))) {
+			die_allocerror0();
+		}
+	}
+
+	return msg;
+}
+
+/* Formats readiness of run according to STATUS_MESSAGE_READY_FORMAT. */
+static const char * format_ready(const monitor_status *rec, apr_pool_t *pool)
+{
+	char *msg;
+	ngim_tain_t stamp;
+	char formatted[NGIM_ISO8601_FORMAT];
+
+	die_assert(rec);
+	die_assert(pool);
+	die_assert(arg_func_format);
+
+	if (!rec->pid_run || !(rec->flags & MONITOR_STATUS_READY)) {
+		strcpy(formatted, STATUS_MESSAGE_NOTREADY);
+	} else if (ngim_tain_unpack(rec->ready_run, &stamp)) {
+		arg_func_format(formatted, ngim_tain_to_apr(&stamp));
+	} else {
+		formatted[0] = '?';
+		formatted[1] = '\0';
+	}
+
+	if (ALLOC_FAIL(msg,
+			apr_psprintf(pool, STATUS_MESSAGE_READY_FORMAT, formatted))) {
+		die_allocerror0();
+	}
+
+	return msg;
+}
+
+/* Formats the last health check according to STATUS_MESSAGE_CHECK_FORMAT. */
+static const char * format_check(const monitor_status *rec, apr_pool_t *pool)
+{
+	char *msg;
+	const char *result;
+	ngim_tain_t stamp;
+	char formatted[NGIM_ISO8601_FORMAT];
+
+	die_assert(rec);
+	die_assert(pool);
+	die_assert(arg_func_format);
+
+	switch (rec->check_result) {
+	case MONITOR_CHECK_PASSED:
+		result = "passed";
+		break;
+	case MONITOR_CHECK_FAILED:
+		result = "failed";
+		break;
+	case MONITOR_CHECK_TIMEOUT:
+		result = "timed out";
+		break;
+	default:
+		return STATUS_MESSAGE_NOTCHECKED;
+	}
+
+	if (ngim_tain_unpack(rec->checked, &stamp)) {
+		arg_func_format(formatted, ngim_tain_to_apr(&stamp));
+	} else {
+		formatted[0] = '?';
+		formatted[1] = '\0';
+	}
+
+	if (ALLOC_FAIL(msg,
+			apr_psprintf(pool, STATUS_MESSAGE_CHECK_FORMAT, formatted, result,
+				rec->check_latency / 1000, rec->check_latency % 1000,
+				rec->check_failures, rec->checks))) {
+		die_allocerror0();
+	}
+
+	return msg;
+}
+
+/* Formats resource usage according to STATUS_MESSAGE_USAGE_FORMAT. */
+static const char * format_usage(const char *name, const char *which,
+		const monitor_usage *usage, apr_pool_t *pool)
+{
+	char *msg;
+
+	die_assert(name);
+	die_assert(which);
+	die_assert(usage);
+	die_assert(pool);
+
+	if (ALLOC_FAIL(msg,
+			apr_psprintf(pool, STATUS_MESSAGE_USAGE_FORMAT, name, which,
+				usage->utime / APR_USEC_PER_SEC,
+				(unsigned int)((usage->utime / 1000) % 1000),
+				usage->stime / APR_USEC_PER_SEC,
+				(unsigned int)((usage->stime / 1000) % 1000),
+				usage->maxrss, usage->minflt, usage->majflt,
+				usage->nvcsw, usage->nivcsw))) {
+		die_allocerror0();
+	}
+
+	return msg;
+}
+
 /* Formats service status according to STATUS_MESSAGE_FORMAT. */
 static const char * format_status(int *counter, const char *name,
-		const unsigned char *filebuf, apr_pool_t *pool)
+		const monitor_status *rec, apr_pool_t *pool)
 {
 	char *msg, *realname;
 	ngim_tain_t stamp;
@@ -834,12 +1160,12 @@ static const char * format_status(int *counter, const char *name,
 
 	die_assert(counter);
 	die_assert(name);
-	die_assert(filebuf);
+	die_assert(rec);
 	die_assert(pool);
 	die_assert(arg_func_format);
 
 	/* Unpack and format to ISO8601 */
-	if (ngim_tain_unpack(&filebuf[MONITOR_STATUS_UPDATED], &stamp)) {
+	if (ngim_tain_unpack(rec->updated, &stamp)) {
 		arg_func_format(formatted, ngim_tain_to_apr(&stamp));
 	} else {
 		formatted[0] = '?';
@@ -855,12 +1181,60 @@ static const char * format_status(int *counter, const char *name,
 				++(*counter),
 				realname,
 				formatted,
-				format_proc(&filebuf[MONITOR_STATUS_CHG_RUN],
-					(apr_uint32_t*)&filebuf[MONITOR_STATUS_PID_RUN], pool),
-				format_proc(&filebuf[MONITOR_STATUS_CHG_LOG],
-					(apr_uint32_t*)&filebuf[MONITOR_STATUS_PID_LOG], pool),
-				format_flag(filebuf[MONITOR_STATUS_FORWARD]),
-				format_wantup(realname)))) {
+				format_proc(rec->changed_run, rec->pid_run,
+					rec->failures_run, rec->delay_run, pool),
+				format_proc(rec->changed_log, rec->pid_log,
+					rec->failures_log, rec->delay_log, pool),
+				format_flag(rec->flags & MONITOR_STATUS_FORWARD),
+				format_wantup(realname),
+				rec->starts_run,
+				rec->starts_log))) {
+		die_allocerror0();
+	}
+
+	if ((rec->flags & MONITOR_STATUS_NOTIFY) && ALLOC_FAIL(msg,
+			apr_pstrcat(pool, msg, format_ready(rec, pool), NULL))) {
+		die_allocerror0();
+	}
+
+	if ((rec->flags & MONITOR_STATUS_CHECK) && ALLOC_FAIL(msg,
+			apr_pstrcat(pool, msg, format_check(rec, pool), NULL))) {
+		die_allocerror0();
+	}
+
+	if (rec->sockets && ALLOC_FAIL(msg,
+			apr_psprintf(pool, "%s" STATUS_MESSAGE_SOCKETS_FORMAT, msg,
+				rec->sockets))) {
+		die_allocerror0();
+	}
+
+	if (rec->pid_replaced && ALLOC_FAIL(msg,
+			apr_psprintf(pool, "%s" STATUS_MESSAGE_REPLACING_FORMAT, msg,
+				rec->pid_replaced))) {
+		die_allocerror0();
+	}
+
+	if ((rec->spooled || rec->dropped) && ALLOC_FAIL(msg,
+			apr_psprintf(pool, "%s" STATUS_MESSAGE_SPOOL_FORMAT, msg,
+				rec->spooled, rec->dropped, rec->pipe_size))) {
+		die_allocerror0();
+	}
+
+	if (arg_usage && ALLOC_FAIL(msg,
+			apr_pstrcat(pool, msg,
+				format_usage(FILE_RUN, STATUS_MESSAGE_USAGE_LAST,
+					&rec->usage_run, pool),
+				format_usage(FILE_RUN, STATUS_MESSAGE_USAGE_TOTAL,
+					&rec->total_run, pool),
+				format_usage(FILE_LOG, STATUS_MESSAGE_USAGE_LAST,
+					&rec->usage_log, pool),
+				format_usage(FILE_LOG, STATUS_MESSAGE_USAGE_TOTAL,
+					&rec->total_log, pool), NULL))) {
+		die_allocerror0();
+	}
+
+	if (arg_exits && ALLOC_FAIL(msg,
+			apr_pstrcat(pool, msg, format_exits(rec, pool), NULL))) {
 		die_allocerror0();
 	}
 
@@ -876,10 +1250,9 @@ static void command_status()
 	apr_pool_t *pool;
 	apr_dir_t *dir;
 	apr_finfo_t info;
-	apr_file_t *file;
+	monitor_status rec;
 	int counter = 0;
 	char *path;
-	unsigned char filebuf[MONITOR_STATUS_SIZE];
 
 	die_assert(arg_base);
 
@@ -916,24 +1289,11 @@ static void command_status()
 			die_allocerror0();
 		}
 
-		if (APR_FAIL(status, apr_file_open(&file, path, APR_FOPEN_READ |
-				APR_FOPEN_BINARY, FPROT_FILE_STATUS, pool))) {
-			warn_aprerror2(status, "failed to open ", path);
+		if (!read_status(path, &rec, pool)) {
 			continue;
 		}
 
-		die_assert(file);
-
-		if (APR_FAIL(status, apr_file_read_full(file, filebuf,
-				MONITOR_STATUS_SIZE, NULL))) {
-			warn_aprerror2(status, "failed to read status file ", path);
-			apr_file_close(file);
-			continue;
-		}
-
-		apr_file_close(file);
-
-		apr_file_puts(format_status(&counter, info.name, filebuf, pool),
+		apr_file_puts(format_status(&counter, info.name, &rec, pool),
 				g_apr_stdout);
 	}
 
@@ -1040,11 +1400,72 @@ static void command_killall()
 	apr_dir_close(active);
 }
 
+/* Waits until run has been started after since, unless it's NULL, and
+ * has notified it's ready if it does that. Dies if it takes longer than
+ * arg_waittime. */
+static void service_wait(const ngim_tain_t *since)
+{
+	apr_status_t status;
+	apr_pool_t *pool;
+	apr_finfo_t info;
+	apr_time_t deadline;
+	monitor_status rec;
+	ngim_tain_t changed;
+	char *path;
+
+	die_assert(arg_base);
+	die_assert(arg_name);
+
+	if (APR_FAIL(status, apr_pool_create(&pool, g_pool))) {
+		die_aprerror1(status, "failed to create a memory pool");
+	}
+
+	/* Path to the monitor status file for the service */
+	if (ALLOC_FAIL(path,
+			apr_psprintf(g_pool, "%s/" DIR_ALL "/%s/" FILE_STATUS,
+				arg_base, arg_name))) {
+		die_allocerror0();
+	}
+
+	error2(INFO, "waiting for ", arg_name);
+	deadline = ngim_clock_monotonic() + arg_waittime;
+
+	for (;;) {
+		apr_pool_clear(pool);
+
+		/* The monitor may not have been started yet */
+		if (apr_stat(&info, path, APR_FINFO_SIZE, pool) == APR_SUCCESS &&
+			info.size >= (apr_off_t)MONITOR_STATUS_BASESIZE &&
+			read_status(path, &rec, pool) &&
+			rec.pid_run &&
+			(!(rec.flags & MONITOR_STATUS_NOTIFY) ||
+				(rec.flags & MONITOR_STATUS_READY)) &&
+			(!since || (ngim_tain_unpack(rec.changed_run, &changed) &&
+				!ngim_tain_less(&changed, since)))) {
+			break;
+		}
+
+		if (ngim_clock_monotonic() >= deadline) {
+			die_error2(arg_name, " is not ready");
+		}
+
+		apr_sleep(apr_time_from_msec(WAIT_INTERVAL));
+	}
+
+	apr_pool_destroy(pool);
+	error2(INFO, arg_name, " is ready");
+}
+
 /* Performs an action to a service */
 static void command_action(const apr_uint32_t selected)
 {
+	ngim_tain_t since;
+
 	die_assert(arg_name);
 
+	/* A restarted service must be started after this */
+	ngim_tain_now(&since);
+
 	if (service_exists()) {
 		if (selected & cmd_priority) {
 			service_priority();
@@ -1057,11 +1478,20 @@ static void command_action(const apr_uint32_t selected)
 				service_add();
 				/* Should be unnecessary */
 				monitor_command(MONITOR_CMD_WAKEUP, 0);
+
+				if (selected & cmd_wait) {
+					service_wait(&since);
+				}
 			}
 		} else if (service_active()) {
 			if (selected & cmd_up) {
 				error2(INFO, "setting up ", arg_name);
 				service_create_up();
+
+				if (selected & cmd_wait) {
+					/* Already running is fine */
+					service_wait(NULL);
+				}
 			} else if (selected & cmd_down) {
 				error2(INFO, "setting down ", arg_name);
 				service_remove_up();
@@ -1069,6 +1499,10 @@ static void command_action(const apr_uint32_t selected)
 				error2(INFO, "restarting ", arg_name);
 				service_create_up();
 				monitor_command(MONITOR_CMD_KILL, 0);
+
+				if (selected & cmd_wait) {
+					service_wait(&since);
+				}
 			} else if (selected & cmd_stop) {
 				error2(INFO, "stopping ", arg_name);
 				service_remove_up();
@@ -9,6 +9,7 @@
 
 #include <common.h>
 #include <apr_file_info.h>
+#include <apr_general.h>
 #include <ngim/base.h>
 
 /* Program names for error reporting */
@@ -37,6 +38,14 @@
  *               FILE_RUN			<-- started by monitor
  *               FILE_LOG			<-- started by monitor
  *               FILE_PRIORITY		<-- read by srvctl
+ *               FILE_STOPSIGNALS	<-- read by monitor, optional
+ *               FILE_STOPTIMEOUTS	<-- read by monitor, optional
+ *               FILE_RESTART		<-- read by monitor, optional
+ *               FILE_NOTIFY		<-- read by monitor, optional
+ *               FILE_CHECK			<-- started by monitor, optional
+ *               FILE_CHECKPOLICY	<-- read by monitor, optional
+ *               FILE_SOCKETS		<-- read by monitor, optional
+ *               FILE_LOGPOLICY		<-- read by monitor, optional
  */
 
 /* File and directory names */
@@ -54,6 +63,14 @@
 #define FILE_LOG				"log"
 #define FILE_RUN				"run"
 #define FILE_PRIORITY			"priority"
+#define FILE_STOPSIGNALS		"stopsignals"
+#define FILE_STOPTIMEOUTS		"stoptimeouts"
+#define FILE_RESTART			"restart"
+#define FILE_NOTIFY				"notify"
+#define FILE_CHECK				"check"
+#define FILE_CHECKPOLICY		"checkpolicy"
+#define FILE_SOCKETS			"sockets"
+#define FILE_LOGPOLICY			"logpolicy"
 
 /* Default file and directory permissions */
 /* drwxr-xr-x */
@@ -101,21 +118,98 @@
 
 /* Environment variables */
 #define ENV_SRVCTL_BASE			"SRVCTL_BASE"
+#define ENV_SRVCTL_NOTIFY		"SRVCTL_NOTIFY_FD"	/* Readiness channel */
+#define ENV_SRVCTL_LISTEN		"SRVCTL_LISTEN_FDS"	/* Listening sockets */
 
-/* Monitor status file
- *   status updated		NGIM_TAIN_PACK bytes
- *   run changed		NGIM_TAIN_PACK bytes
- *   log changed		NGIM_TAIN_PACK bytes
- *   run pid			4 bytes
- *   log pid			4 bytes
- *   flag_forward		1 byte
- */
-#define MONITOR_STATUS_SIZE		(3 * NGIM_TAIN_PACK + 2 * 4 + 1)
-#define MONITOR_STATUS_UPDATED	(0)
-#define MONITOR_STATUS_CHG_RUN	(NGIM_TAIN_PACK)
-#define MONITOR_STATUS_CHG_LOG	(MONITOR_STATUS_CHG_RUN + NGIM_TAIN_PACK)
-#define MONITOR_STATUS_PID_RUN	(MONITOR_STATUS_CHG_LOG + NGIM_TAIN_PACK)
-#define MONITOR_STATUS_PID_LOG	(MONITOR_STATUS_PID_RUN + 4)
-#define MONITOR_STATUS_FORWARD	(MONITOR_STATUS_SIZE - 1)
+/* Written to the readiness channel by run when it's ready to serve */
+#define MONITOR_NOTIFY_READY	"READY"
+
+/* Number of exits kept in the monitor status record */
+#define MONITOR_EXITS			16
+
+/* An exit of a child, kept in the monitor status record */
+typedef struct {
+	unsigned char time[NGIM_TAIN_PACK];
+	apr_uint32_t pid;
+	apr_uint32_t code;			/* Exit code, zero if killed by a signal */
+	apr_uint32_t signal;		/* Signal that killed the process, or zero */
+	apr_uint32_t uptime;		/* Milliseconds */
+	apr_uint32_t flags;			/* MONITOR_EXIT_* */
+} monitor_exit;
+
+#define MONITOR_EXIT_LOG		0x01	/* log exited, otherwise run */
+#define MONITOR_EXIT_CORE		0x02	/* Dumped core */
+
+/* Resources used by a child, kept in the monitor status record. In totals,
+ * maxrss is the largest of all runs. */
+typedef struct {
+	apr_uint64_t utime;			/* Microseconds of user CPU time */
+	apr_uint64_t stime;			/* Microseconds of system CPU time */
+	apr_uint64_t maxrss;		/* Largest resident set, as the system
+								 * reports it, in kilobytes on most */
+	apr_uint64_t minflt;		/* Page faults without I/O */
+	apr_uint64_t majflt;		/* Page faults with I/O */
+	apr_uint64_t nvcsw;			/* Voluntary context switches */
+	apr_uint64_t nivcsw;		/* Involuntary context switches */
+} monitor_usage;
+
+/* Monitor status record. FILE_STATUS is MONITOR_STATUS_SIZE bytes, mapped
+ * to memory and updated in place by the monitor under the sequence lock.
+ * New fields are added to the end and counted in size, so readers should
+ * only look at the fields they know that fit in it. Integers are in host
+ * byte order, and all fields are naturally aligned. */
+typedef struct {
+	apr_uint32_t magic;			/* MONITOR_STATUS_MAGIC */
+	apr_uint32_t version;		/* MONITOR_STATUS_VERSION */
+	apr_uint32_t size;			/* Bytes of the record in use */
+	apr_uint32_t sequence;		/* Odd while being updated */
+	apr_uint32_t pid_run;
+	apr_uint32_t pid_log;
+	apr_uint32_t failures_run;	/* Exits in a row before a stable uptime */
+	apr_uint32_t failures_log;
+	apr_uint32_t delay_run;		/* Milliseconds before a restart */
+	apr_uint32_t delay_log;
+	apr_uint32_t flags;			/* MONITOR_STATUS_* */
+	unsigned char updated[NGIM_TAIN_PACK];
+	unsigned char changed_run[NGIM_TAIN_PACK];
+	unsigned char changed_log[NGIM_TAIN_PACK];
+	/* Missing from records of MONITOR_STATUS_BASESIZE bytes */
+	apr_uint32_t starts_run;	/* Since the monitor started */
+	apr_uint32_t starts_log;
+	apr_uint32_t exits;			/* Total, the latest is at exits - 1 */
+	monitor_exit exit[MONITOR_EXITS];	/* Ring of the latest exits */
+	apr_uint32_t reserved;		/* Aligns the following */
+	monitor_usage usage_run;	/* Of the last exited run */
+	monitor_usage usage_log;
+	monitor_usage total_run;	/* Of all exited runs */
+	monitor_usage total_log;
+	unsigned char ready_run[NGIM_TAIN_PACK];	/* Notified ready */
+	unsigned char checked[NGIM_TAIN_PACK];	/* Last health check */
+	apr_uint32_t checks;		/* Health checks done */
+	apr_uint32_t check_failures;	/* Failed in a row */
+	apr_uint32_t check_latency;	/* Milliseconds the last one took */
+	apr_uint32_t check_result;	/* MONITOR_CHECK_* */
+	apr_uint32_t sockets;		/* Listening sockets passed to run */
+	apr_uint32_t pid_replaced;	/* Old run in an overlapping restart */
+	/* Output of run while log is down */
+	apr_uint32_t pipe_size;		/* Of the pipe to log, zero if unknown */
+	apr_uint32_t spooled;		/* Bytes waiting for log */
+	apr_uint64_t dropped;		/* Bytes that didn't fit in the spool */
+} monitor_status;
+
+#define MONITOR_STATUS_SIZE		1024	/* Room for new fields */
+#define MONITOR_STATUS_BASESIZE	APR_OFFSETOF(monitor_status, starts_run)
+#define MONITOR_STATUS_MAGIC	0x6e67696d	/* "ngim" */
+#define MONITOR_STATUS_VERSION	1
+#define MONITOR_STATUS_FORWARD	0x01	/* Output of run goes to log */
+#define MONITOR_STATUS_NOTIFY	0x02	/* run notifies when it's ready */
+#define MONITOR_STATUS_READY	0x04	/* run has notified */
+#define MONITOR_STATUS_CHECK	0x08	/* run is checked with FILE_CHECK */
+
+/* Results of health checks */
+#define MONITOR_CHECK_NONE		0
+#define MONITOR_CHECK_PASSED	1
+#define MONITOR_CHECK_FAILED	2
+#define MONITOR_CHECK_TIMEOUT	3
 
 #endif /* SRVCTL_H */
@@ -12,21 +12,60 @@
 #include <apr_time.h>
 #include <ngim/base.h>
 
-/* Function pointer type for the ISO 8601 conversion */
-typedef void (*iso8601_format)(char *s, apr_time_t t);
-
 /* Bitmasks for command line parameters */
 enum {
 	cmd_help	= 1 << 0,
 	cmd_local	= 1 << 1,
 	cmd_utc		= 1 << 2,
-	cmd_all		= 1 << 3
+	cmd_all		= 1 << 3,
+	cmd_since	= 1 << 4,
+	cmd_until	= 1 << 5,
+	cmd_merge	= 1 << 6,
+	cmd_follow	= 1 << 7,
+	cmd_cursor	= 1 << 8,
+	cmd_match	= 1 << 9,
+	cmd_regex	= 1 << 10,
+	cmd_histogram = 1 << 11,
+	cmd_reverse	= 1 << 12,
+	cmd_format	= 1 << 13
 };
 
 /* Variables for command line parameters */
 static const char *arg_file = NULL;
+static const char *arg_since = NULL;
+static const char *arg_until = NULL;
+static const char *arg_cursor = NULL;
+static const char *arg_match = NULL;
+static const char *arg_regex = NULL;
+static const char *arg_histogram = NULL;
+static const char *arg_format = NULL;
 static int arg_all = 0;
-static iso8601_format arg_func_format = NULL;
+static int arg_utc = 0;
+static int arg_merge = 0;
+static int arg_follow = 0;
+static int arg_reverse = 0;
+static int arg_json = 0;
+static ngim_convert_format_t arg_func_format = NULL;
+
+/* Time range, converted from arg_since and arg_until */
+static int range_since = 0;
+static int range_until = 0;
+static ngim_tain_t range_since_tain;
+static ngim_tain_t range_until_tain;
+
+/* Line filter, set up from arg_match and arg_regex */
+static int filter = 0;
+static apr_size_t filter_len = 0;
+#if HAVE_REGEX_H && HAVE_REGCOMP
+static regex_t filter_regex;
+#endif
+
+/* Histogram bucket width in seconds, from arg_histogram, and the bucket
+ * being counted */
+static apr_int64_t histogram = 0;
+static int histogram_started = 0;
+static apr_int64_t histogram_bucket;
+static apr_uint64_t histogram_count;
 
 /* Command line parameters and arguments */
 static ngim_cmdline_params_t taiconv_params[] = {
@@ -38,6 +77,19 @@ static ngim_cmdline_params_t taiconv_params[] = {
 	{ "-u",				cmd_utc,	NULL },
 	{ "--all",			cmd_all,	NULL },
 	{ "-a",				cmd_all, 	NULL },
+	{ "--since",		cmd_since,	&arg_since },
+	{ "--until",		cmd_until,	&arg_until },
+	{ "--merge",		cmd_merge,	NULL },
+	{ "-m",				cmd_merge,	NULL },
+	{ "--follow",		cmd_follow,	NULL },
+	{ "-f",				cmd_follow,	NULL },
+	{ "--cursor",		cmd_cursor,	&arg_cursor },
+	{ "--match",		cmd_match,	&arg_match },
+	{ "--regex",		cmd_regex,	&arg_regex },
+	{ "--histogram",	cmd_histogram, &arg_histogram },
+	{ "--format",		cmd_format,	&arg_format },
+	{ "--reverse",		cmd_reverse, NULL },
+	{ "-r",				cmd_reverse, NULL },
 	{ NULL,				0,			NULL }
 };
 static ngim_cmdline_args_t taiconv_args[] = {
@@ -46,8 +98,205 @@ static ngim_cmdline_args_t taiconv_args[] = {
 };
 
 #define CMDLINE_USAGE \
-	"--help | [--local-time (default) | --utc] [--all] [file]"
+	"--help | [--local-time (default) | --utc] " \
+	"[--format iso (default) | epoch | delta | json] [--all] [--since time] " \
+	"[--until time] [--match text] [--regex expression] " \
+	"[--histogram bucket] [file | --merge directory ... | --follow directory | " \
+	"--cursor file directory] | [--local-time (default) | --utc] " \
+	"--reverse [file]"
+
+
+/* Tests if a character is a valid ASCII hex nibble */
+#define is_hex_nibble(c) \
+	(!(ngim_tai_hex_value[(unsigned char)(c)] & NGIM_TAI_HEX_BAD))
+
+/* Parses a time given on the command line, either as an external textual
+ * TAI64 or TAI64N label, or as an ISO 8601 date and time. Returns non-zero
+ * if successful. */
+static int parse_time(const char *s, ngim_tain_t *t)
+{
+	apr_time_t a;
+	apr_size_t len, i;
+
+	die_assert(s);
+	die_assert(t);
+
+	len = strlen(s);
+
+	if (s[0] == '@') {
+		for (i = 1; i < len; ++i) {
+			if (!is_hex_nibble(s[i])) {
+				return 0;
+			}
+		}
+
+		if (len == NGIM_TAIN_FORMAT) {
+			return ngim_tain_decode(s, t);
+		} else if (len == NGIM_TAI_FORMAT) {
+			t->nano = 0;
+			return ngim_tai_decode(s, &t->sec);
+		}
+		return 0;
+	} else if (len > 0 && ngim_iso8601_parse(s, len, &a, arg_utc) == len) {
+		/* Exact conversion, ngim_tain_from_apr would round to the middle
+		 * of the microsecond */
+		ngim_tai_from_apr(&t->sec, a);
+		t->nano = 1000 * apr_time_usec(a);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Parses a histogram bucket width of the form N[s|m|h|d] in seconds.
+ * Returns zero if invalid. */
+static int parse_bucket(const char *s, apr_int64_t *width)
+{
+	char *end;
+
+	die_assert(s);
+	die_assert(width);
+
+	*width = apr_strtoi64(s, &end, 10);
+
+	if (end == s || *width <= 0) {
+		return 0;
+	}
+
+	switch (*end) {
+	case '\0':
+	case 's':
+		break;
+	case 'm':
+		*width *= 60;
+		break;
+	case 'h':
+		*width *= 3600;
+		break;
+	case 'd':
+		*width *= 86400;
+		break;
+	default:
+		return 0;
+	}
+
+	return (*end == '\0' || end[1] == '\0');
+}
+
+/*
+ * Output formats
+ */
+
+/* Writes x in decimal to s, returns a pointer past the last digit */
+static inline char * format_decimal(char *s, apr_uint64_t x)
+{
+	char digits[20];
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + x % 10;
+		x /= 10;
+	} while (x > 0);
+
+	while (n > 0) {
+		*s++ = digits[--n];
+	}
+
+	return s;
+}
+
+/* Writes nano as exactly nine digits to s, returns a pointer past them */
+static inline char * format_nano(char *s, apr_uint32_t nano)
+{
+	int i;
+
+	for (i = 8; i >= 0; --i) {
+		s[i] = '0' + nano % 10;
+		nano /= 10;
+	}
+
+	return s + 9;
+}
+
+/* Contexts for formatting and parsing ISO 8601, set up in main */
+static ngim_iso8601_context_t format_context;
+static ngim_iso8601_context_t parse_context;
+
+/* ISO 8601 in the local time zone or UTC, as format_context was set up */
+static void format_iso(char *s, const ngim_tain_t *t)
+{
+	ngim_iso8601_context_format(&format_context, s, ngim_tain_to_apr(t));
+}
+
+/* Nanoseconds since the epoch */
+static void format_epoch(char *s, const ngim_tain_t *t)
+{
+	apr_uint64_t sec;
+	apr_uint32_t nano = t->nano;
+
+	if (t->sec.x >= (apr_uint64_t)NGIM_TAI_APR_EPOCH) {
+		sec = t->sec.x - NGIM_TAI_APR_EPOCH;
+	} else {
+		*s++ = '-';
+		sec = NGIM_TAI_APR_EPOCH - t->sec.x;
+		if (nano > 0) {
+			--sec;
+			nano = 1000000000 - nano;
+		}
+	}
+
+	if (sec > 0) {
+		s = format_decimal(s, sec);
+		s = format_nano(s, nano);
+	} else {
+		s = format_decimal(s, nano);
+	}
 
+	*s = '\0';
+}
+
+/* The previous stamp for format_delta */
+static ngim_tain_t delta_previous;
+static int delta_started = 0;
+
+/* Seconds since the previous stamp, with nanosecond precision */
+static void format_delta(char *s, const ngim_tain_t *t)
+{
+	const ngim_tain_t *from = &delta_previous;
+	const ngim_tain_t *to = t;
+	apr_uint64_t sec;
+	apr_uint32_t nano;
+
+	if (!delta_started) {
+		delta_previous = *t;
+		delta_started = 1;
+	}
+
+	/* Lines may be out of order */
+	if (ngim_tain_less(t, &delta_previous)) {
+		*s++ = '-';
+		from = t;
+		to = &delta_previous;
+	} else {
+		*s++ = '+';
+	}
+
+	sec = to->sec.x - from->sec.x;
+
+	if (to->nano >= from->nano) {
+		nano = to->nano - from->nano;
+	} else {
+		--sec;
+		nano = 1000000000 + to->nano - from->nano;
+	}
+
+	s = format_decimal(s, sec);
+	*s++ = '.';
+	s = format_nano(s, nano);
+	*s = '\0';
+
+	delta_previous = *t;
+}
 
 /* Validates command line. Present parameters are specified in selected.
  * Prints an error message and returns <0 if command line is invalid. */
@@ -62,11 +311,31 @@ static int validate_cmdline(const apr_uint32_t selected)
 		return -1;
 	}
 
-	/* Choose an ISO 8601 convertion function */
+	/* ISO 8601 in the local time zone unless UTC is asked for */
+	arg_func_format = format_iso;
 	if (selected & cmd_utc) {
-		arg_func_format = ngim_iso8601_utc_format;
-	} else {
-		arg_func_format = ngim_iso8601_local_format;
+		arg_utc = 1;
+	}
+
+	/* Or another format. JSON wraps whole lines, which rules out options
+	 * that don't output lines as they are. */
+	if (selected & cmd_format) {
+		die_assert(arg_format);
+		if (!strcmp(arg_format, "epoch")) {
+			arg_func_format = format_epoch;
+		} else if (!strcmp(arg_format, "delta")) {
+			arg_func_format = format_delta;
+		} else if (!strcmp(arg_format, "json")) {
+			if (selected & (cmd_all | cmd_merge | cmd_histogram |
+					cmd_reverse)) {
+				warn_error1("invalid parameters");
+				return -1;
+			}
+			arg_json = 1;
+		} else if (strcmp(arg_format, "iso")) {
+			warn_error2("invalid format: ", arg_format);
+			return -1;
+		}
 	}
 
 	/* Should we convert all time stamps or just the ones at the
@@ -75,54 +344,210 @@ static int validate_cmdline(const apr_uint32_t selected)
 		arg_all = 1;
 	}
 
+	/* Time range */
+	if (selected & cmd_since) {
+		die_assert(arg_since);
+		if (!parse_time(arg_since, &range_since_tain)) {
+			warn_error2("invalid time for --since: ", arg_since);
+			return -1;
+		}
+		range_since = 1;
+	}
+	if (selected & cmd_until) {
+		die_assert(arg_until);
+		if (!parse_time(arg_until, &range_until_tain)) {
+			warn_error2("invalid time for --until: ", arg_until);
+			return -1;
+		}
+		range_until = 1;
+	}
+
+	/* Merge needs at least one directory */
+	if (selected & cmd_merge) {
+		if (!arg_file) {
+			warn_error1("missing directory for --merge");
+			return -1;
+		}
+		arg_merge = 1;
+	}
+
+	/* Follow needs exactly one directory and no time range */
+	if (selected & cmd_follow) {
+		if (!arg_file) {
+			warn_error1("missing directory for --follow");
+			return -1;
+		}
+		if (selected & (cmd_merge | cmd_since | cmd_until)) {
+			warn_error1("invalid parameters");
+			return -1;
+		}
+		arg_follow = 1;
+	}
+
+	/* Only lines with matching text are converted */
+	if (selected & cmd_match) {
+		die_assert(arg_match);
+		if (!*arg_match) {
+			warn_error1("empty text for --match");
+			return -1;
+		}
+		filter_len = strlen(arg_match);
+		filter = 1;
+	}
+	if (selected & cmd_regex) {
+		die_assert(arg_regex);
+#if HAVE_REGEX_H && HAVE_REGCOMP
+		if (regcomp(&filter_regex, arg_regex, REG_EXTENDED | REG_NOSUB)) {
+			warn_error2("invalid expression for --regex: ", arg_regex);
+			return -1;
+		}
+		filter = 1;
+#else
+		warn_error1("--regex is not supported on this system");
+		return -1;
+#endif
+	}
+
+	/* Counting lines instead of converting them */
+	if (selected & cmd_histogram) {
+		die_assert(arg_histogram);
+		if (!parse_bucket(arg_histogram, &histogram)) {
+			warn_error2("invalid bucket for --histogram: ", arg_histogram);
+			return -1;
+		}
+		if (selected & (cmd_merge | cmd_follow)) {
+			warn_error1("invalid parameters");
+			return -1;
+		}
+	}
+
+	/* Reverse conversion only cares about the time zone */
+	if (selected & cmd_reverse) {
+		if (selected & ~(cmd_reverse | cmd_local | cmd_utc | cmd_format) ||
+				arg_func_format == format_epoch ||
+				arg_func_format == format_delta) {
+			warn_error1("invalid parameters");
+			return -1;
+		}
+		arg_reverse = 1;
+	}
+
+	/* The cursor is kept for exactly one directory */
+	if (selected & cmd_cursor) {
+		die_assert(arg_cursor);
+		if (!arg_file) {
+			warn_error1("missing directory for --cursor");
+			return -1;
+		}
+		if (selected & (cmd_merge | cmd_follow | cmd_since | cmd_until)) {
+			warn_error1("invalid parameters");
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
-/* Tests if a character is a valid ASCII hex nibble */
-#define is_hex_nibble(c) \
-	(((c) >= '0' && (c) <= '9') || ((c) >= 'a' && (c) <= 'f'))
+/*
+ * Output
+ */
 
-/* Outputs a character to stdout, dies in case of a failure */
-static inline void flush_char(const char ch)
+#define OUTPUT_BUFSIZE		65536	/* Output buffer size */
+
+/* Output waiting to be written to stdout */
+static char output_buffer[OUTPUT_BUFSIZE];
+static apr_size_t output_len = 0;
+
+/* Writes the buffered output to stdout, dies in case of a failure */
+static void flush_output(void)
 {
-	if (APR_FAIL_N(apr_file_putc(ch, g_apr_stdout))) {
-		die_error1("failed to write to stdout");
+	if (output_len > 0) {
+		if (APR_FAIL_N(apr_file_write_full(g_apr_stdout, output_buffer,
+				output_len, NULL))) {
+			die_error1("failed to write to stdout");
+		}
+		output_len = 0;
 	}
 }
 
-/* Outputs a string to stdout, dies in case of a failure */
-static inline void flush_string(const char *str)
+/* Writes the buffered output to stdout before exiting */
+static void flush_output_at_exit(void)
 {
-	die_assert(str);
-
-	if (APR_FAIL_N(apr_file_puts(str, g_apr_stdout))) {
-		die_error1("failed to write to stdout");
+	if (output_len > 0 && g_apr_stdout) {
+		if (APR_FAIL_N(apr_file_write_full(g_apr_stdout, output_buffer,
+				output_len, NULL))) {
+			warn_error1("failed to write to stdout");
+		}
+		output_len = 0;
 	}
 }
 
 /* Outputs i bytes from buffer to stdout, dies in case of a failure */
-static inline void flush_buffer(const char *buf, int i)
+static inline void flush_buffer(const char *buf, apr_size_t i)
 {
 	die_assert(buf);
 	die_assert(i > 0);
 
-	if (APR_FAIL_N(apr_file_write_full(g_apr_stdout, buf, i, NULL))) {
-		die_error1("failed to write to stdout");
+	if (i > OUTPUT_BUFSIZE - output_len) {
+		flush_output();
+
+		if (i >= OUTPUT_BUFSIZE) {
+			/* Nothing to gain from copying */
+			if (APR_FAIL_N(apr_file_write_full(g_apr_stdout, buf, i, NULL))) {
+				die_error1("failed to write to stdout");
+			}
+			return;
+		}
+	}
+
+	memcpy(&output_buffer[output_len], buf, i);
+	output_len += i;
+}
+
+/* Outputs a character to stdout, dies in case of a failure */
+static inline void flush_char(const char ch)
+{
+	if (output_len == OUTPUT_BUFSIZE) {
+		flush_output();
 	}
+	output_buffer[output_len++] = ch;
+}
+
+/* Outputs a string to stdout, dies in case of a failure */
+static inline void flush_string(const char *str)
+{
+	die_assert(str);
+
+	flush_buffer(str, strlen(str));
+}
+
+/* Receives output from the converter */
+static void flush_converted(void *data, const char *s, apr_size_t len)
+{
+	flush_buffer(s, len);
 }
 
+/*
+ * Conversion
+ */
+
+/* The converter, set up in main */
+static ngim_convert_t converter;
+
 /* The result from convert_buffer */
 static char result[NGIM_ISO8601_FORMAT]; /* NUL-terminated */
 
-/* Converts an external textual TAI64 or TAI64N label of length len to an
- * ISO 8601 date and time string returned in result. Returns non-zero if
- * a textual label converted. Assumes that any buffer of valid length is
- * a valid textual label. If there are unused bytes in textual, returns
+/* Converts an external textual TAI64 or TAI64N label of length len to a
+ * string in the selected format returned in result. Returns non-zero if
+ * a textual label converted. If there are unused bytes in textual, returns
  * the number of unused bytes in unused, and a pointer to the start of the
  * unused part in textual in remain. */
 static inline int convert_buffer(const char *textual, apr_off_t len,
 		const char **remain, int *unused)
 {
+	ngim_tain_t t;
+	apr_size_t used;
+
 	die_assert(textual);
 	die_assert(remain);
 	die_assert(unused);
@@ -131,309 +556,530 @@ static inline int convert_buffer(const char *textual, apr_off_t len,
 	*remain = NULL;
 	*unused = 0;
 
-	/* If we have a sequence of valid length, convert it */
-	if (len >= NGIM_TAIN_FORMAT) {
-		ngim_tain_t t_tain;
-		if (ngim_tain_unformat(textual, &t_tain)) {
-			arg_func_format(result, ngim_tain_to_apr(&t_tain));
-			if (len > NGIM_TAIN_FORMAT) {
-				*remain = &textual[NGIM_TAIN_FORMAT];
-				*unused = len - NGIM_TAIN_FORMAT;
-			}
-			return 1;
-		}
-	} else if (len >= NGIM_TAI_FORMAT) {
-		ngim_tai_t t_tai;
-		if (ngim_tai_unformat(textual, &t_tai)) {
-			arg_func_format(result, ngim_tai_to_apr(&t_tai));
-			if (len > NGIM_TAI_FORMAT) {
-				*remain = &textual[NGIM_TAI_FORMAT];
-				*unused = len - NGIM_TAI_FORMAT;
-			}
-			return 1;
-		}
+	if (!(used = ngim_convert_label(textual, len, &t))) {
+		return 0;
 	}
 
-	return 0;
-}
-
-/* Converts all valid time stamps */
-static inline void convert_read_all(apr_file_t *in)
-{
-	apr_status_t status;
-	char textual[NGIM_TAIN_FORMAT + 1]; /* +1 for terminating character */
-	const char *remain;
-	int index = 0;
-	int unused;
-
-	die_assert(in);
-
-	for (;;) {
-		die_assert(index >= 0 && index <= NGIM_TAIN_FORMAT);
-
-		if (APR_FAIL(status, apr_file_getc(&textual[index], in))) {
-			/* If there was anything in the buffer, flush it */
-			if (index > 0) {
-				if (convert_buffer(textual, index, &remain, &unused)) {
-					flush_string(result);
-					if (unused > 0) {
-						flush_buffer(remain, unused);
-					}
-				} else {
-					flush_buffer(textual, index);
-				}
-			}
-			if (APR_STATUS_IS_EOF(status)) {
-				/* Done */
-				break;
-			} else {
-				die_aprerror1(status, "failed to read from input");
-			}
-		}
+	arg_func_format(result, &t);
 
-		if (index > 0) {
-			/* In the middle of a sequence */
-			if (is_hex_nibble(textual[index])) {
-				/* And there's more */
-				if (index == NGIM_TAIN_FORMAT) {
-					/* The sequence is too long, convert what we have */
-					if (convert_buffer(textual, index, &remain, &unused)) {
-						die_assert(!unused);
-						flush_string(result);
-						flush_char(textual[index]);
-					} else {
-						flush_buffer(textual, index + 1);
-					}
-					index = 0;
-				} else {
-					++index;
-				}
-			} else {
-				/* Flush the sequence */
-				if (convert_buffer(textual, index, &remain, &unused)) {
-					flush_string(result);
-					if (unused > 0) {
-						flush_buffer(remain, unused);
-					}
-					/* See if another sequence follows immediately */
-					if (textual[index] == '@') {
-						index = 1;
-						continue;
-					} else {
-						flush_char(textual[index]);
-					}
-				} else {
-					/* See if another sequence follows immediately */
-					if (textual[index] == '@') {
-						flush_buffer(textual, index);
-						index = 1;
-						continue;
-					} else {
-						flush_buffer(textual, index + 1);
-					}
-				}
-				/* Back to square zero */
-				index = 0;
-			}
-		} else {
-			if (textual[index] == '@') {
-				/* Sequence starts */
-				++index;
-			} else {
-				flush_char(textual[index]);
-			}
-		}
+	if (len > used) {
+		*remain = &textual[used];
+		*unused = len - used;
 	}
-}
-
-/* Converts time stamps at the beginning of each line */
-static inline void convert_read_nrm(apr_file_t *in)
-{
-	apr_status_t status;
-	char textual[NGIM_TAIN_FORMAT + 1]; /* +1 for terminating character */
-	const char *remain;
-	int index = 0;
-	int start = 1;
-	int unused;
-
-	die_assert(in);
-
-	for (;;) {
-		die_assert(index >= 0 && index <= NGIM_TAIN_FORMAT);
-
-		if (APR_FAIL(status, apr_file_getc(&textual[index], in))) {
-			/* If there was anything in the buffer, flush it */
-			if (index > 0) {
-				if (convert_buffer(textual, index, &remain, &unused)) {
-					flush_string(result);
-					if (unused > 0) {
-						flush_buffer(remain, unused);
-					}
-				} else {
-					flush_buffer(textual, index);
-				}
-			}
-			if (APR_STATUS_IS_EOF(status)) {
-				/* Done */
-				break;
-			} else {
-				die_aprerror1(status, "failed to read from input");
-			}
-		}
 
-		if (start && textual[index] == '@') {
-			start = 0;
-			++index;
-		} else if (index > 0) {
-			if (!is_hex_nibble(textual[index]) ||
-					index == NGIM_TAIN_FORMAT) {
-				/* End of stamp or sequence too long */
-				if (convert_buffer(textual, index, &remain, &unused)) {
-					flush_string(result);
-					if (unused > 0) {
-						flush_buffer(remain, unused);
-					}
-					flush_char(textual[index]);
-				} else {
-					flush_buffer(textual, index + 1);
-				}
-				start = (textual[index] == '\n');
-				index = 0;
-			} else {
-				++index;
-			}
-		} else {
-			start = (textual[index] == '\n');
-			flush_char(textual[index]);
-		}
-	}
+	return 1;
 }
 
-/* Tries to convert a file using buffered I/O where available. */
+/* Converts input read in blocks. */
 static int convert_read(const char *file)
 {
 	apr_status_t status;
 	apr_file_t *in;
+	apr_size_t len;
+	char *buffer;
 
 	/* File pointer for incoming data */
 	if (file) {
-		/* Use APR's internal buffering so we won't have to */
 		if (APR_FAIL(status, apr_file_open(&in, file, APR_FOPEN_READ |
-				APR_FOPEN_BINARY | APR_FOPEN_BUFFERED, 0, g_pool))) {
+				APR_FOPEN_BINARY, 0, g_pool))) {
 			die_aprerror2(status, "failed to open file ", file);
 		}
 	} else {
-		/* TODO: APR currently doesn't allow buffering with stdin */
 		in = g_apr_stdin;
 	}
 
 	die_assert(in);
 
+	if (ALLOC_FAIL(buffer, apr_palloc(g_pool, OUTPUT_BUFSIZE))) {
+		die_allocerror0();
+	}
+
 	/* Drop unneeded privileges */
 	if (ngim_priv_drop(NGIM_PRIV_NONE, NULL, NULL) < 0) {
 		warn_error1("failed to drop privileges");
 	}
 
 	/* Start converting */
-	if (arg_all) {
-		convert_read_all(in);
-	} else {
-		convert_read_nrm(in);
+	for (;;) {
+		len = OUTPUT_BUFSIZE;
+
+		if (APR_FAIL(status, apr_file_read(in, buffer, &len))) {
+			if (APR_STATUS_IS_EOF(status)) {
+				/* Done */
+				break;
+			}
+			die_aprerror1(status, "failed to read from input");
+		}
+
+		ngim_convert_feed(&converter, buffer, len);
 	}
 
+	ngim_convert_finish(&converter);
 	return 1;
 }
 
-/* Converts all valid timestamps */
-static inline void convert_mmap_all(const char *textual, apr_off_t size)
-{
-	apr_off_t index = 0;
-	apr_off_t start = 0;
-	const char *remain;
-	int inside = 0;
-	int unused;
+/*
+ * Histograms
+ */
 
-	die_assert(textual);
-	die_assert(size > 0); /* Zero-sized mmap? */
+/* Outputs the bucket being counted, if there is one */
+static void histogram_flush(void)
+{
+	ngim_tain_t start;
+	char count[32];
 
-	while (index < size) {
-		if (inside) {
-			if (!is_hex_nibble(textual[index]) ||
-						index - start == NGIM_TAIN_FORMAT) {
-				/* End of stamp or sequence too long */
-				if (convert_buffer(&textual[start], index - start, &remain,
-							&unused)) {
-					/* Flush the stamp */
-					flush_string(result);
-					start = index - unused;
-				}
-				inside = 0;
-				continue; /* Continue by rechecking textual[index] */
-			}
-		} else if (textual[index] == '@') {
-			if (start < index) {
-				/* Flush what we have processed so far */
-				flush_buffer(&textual[start], index - start);
-			}
-			start = index;
-			inside = 1;
-		}
-		++index;
+	if (!histogram_started) {
+		return;
 	}
 
-	/* Flush the remains */
-	if (inside &&
-		convert_buffer(&textual[start], index - start, &remain, &unused)) {
-		flush_string(result);
-		if (unused > 0) {
-			flush_buffer(remain, unused);
-		}
-	} else {
-		die_assert(start < index);
-		flush_buffer(&textual[start], index - start);
-	}
+	start.sec.x = NGIM_TAI_APR_EPOCH + histogram_bucket * histogram;
+	start.nano = 0;
+	arg_func_format(result, &start);
+	apr_snprintf(count, sizeof(count), " %" APR_UINT64_T_FMT "\n",
+		histogram_count);
+
+	flush_string(result);
+	flush_string(count);
+
+	histogram_started = 0;
 }
 
-/* Converts time stamps at the beginning of each line */
-static inline void convert_mmap_nrm(const char *textual, apr_off_t size)
+/* Counts the lines in each bucket, using only the seconds from the stamp
+ * at the beginning of each line. Lines are expected in order, a new row is
+ * output each time the bucket changes. Lines without a stamp and empty
+ * buckets are skipped. */
+static void histogram_lines(const char *textual, apr_off_t size)
 {
-	apr_off_t index = 0;
-	apr_off_t start = 0;
-	const char *remain;
-	int unused;
+	apr_off_t offset = 0;
+	apr_int64_t seconds, bucket;
+	const char *line, *found;
+	ngim_tai_t sec;
 
 	die_assert(textual);
-	die_assert(size > 0); /* Zero-sized mmap? */
 
-	while (index < size) {
-		if (textual[index] == '@') {
-			/* Flush what we have processed so far */
-			if (start < index) {
-				flush_buffer(&textual[start], index - start);
-				start = index;
+	while (offset < size) {
+		line = &textual[offset];
+		found = memchr(line, '\n', size - offset);
+
+		if (size - offset >= NGIM_TAI_FORMAT && ngim_tai_decode(line, &sec)) {
+			/* Buckets start at multiples of the width from the epoch */
+			seconds = (apr_int64_t)(sec.x - NGIM_TAI_APR_EPOCH);
+			bucket = seconds / histogram;
+			if (seconds < 0 && seconds % histogram) {
+				--bucket;
 			}
-			
-			/* Calculate stamp length */
-			while (++index < size && is_hex_nibble(textual[index]) &&
-					index - start <= NGIM_TAIN_FORMAT)
-				/* Do nothing */ ;
 
-			if (convert_buffer(&textual[start], index - start, &remain,
-						&unused)) {
-				/* Flush the stamp */
-				flush_string(result);
-				start = index - unused;
+			if (!histogram_started || bucket != histogram_bucket) {
+				histogram_flush();
+				histogram_bucket = bucket;
+				histogram_count = 0;
+				histogram_started = 1;
 			}
+			++histogram_count;
 		}
 
-		/* Move to the beginning of the next line */
-		while (index < size && textual[index++] != '\n')
-			/* Do nothing */ ;
+		offset = found ? (found - textual) + 1 : size;
 	}
+}
 
-	/* Flush the remains */
-	if (start < index) {
-		flush_buffer(&textual[start], index - start);
+/*
+ * JSON lines
+ */
+
+/* Returns the length of a valid multibyte UTF-8 sequence at s, or zero */
+static inline int utf8_length(const char *s, apr_off_t len)
+{
+	const unsigned char *u = (const unsigned char*)s;
+	int n, i;
+
+	if (u[0] >= 0xC2 && u[0] <= 0xDF) {
+		n = 2;
+	} else if (u[0] >= 0xE0 && u[0] <= 0xEF) {
+		n = 3;
+	} else if (u[0] >= 0xF0 && u[0] <= 0xF4) {
+		n = 4;
+	} else {
+		return 0;
+	}
+
+	if (len < n) {
+		return 0;
+	}
+	for (i = 1; i < n; ++i) {
+		if ((u[i] & 0xC0) != 0x80) {
+			return 0;
+		}
+	}
+
+	/* Overlong forms, surrogates and values above U+10FFFF */
+	if ((u[0] == 0xE0 && u[1] < 0xA0) || (u[0] == 0xED && u[1] > 0x9F) ||
+		(u[0] == 0xF0 && u[1] < 0x90) || (u[0] == 0xF4 && u[1] > 0x8F)) {
+		return 0;
+	}
+
+	return n;
+}
+
+/* Outputs text as the contents of a JSON string. Bytes that are not valid
+ * UTF-8 are escaped as the Latin-1 characters with the same values. */
+static void flush_json(const char *text, apr_off_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char escape[6] = { '\\', 'u', '0', '0', '0', '0' };
+	apr_off_t start = 0, i = 0;
+	unsigned char c;
+	int n;
+
+	while (i < len) {
+		c = (unsigned char)text[i];
+
+		if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\') {
+			++i;
+			continue;
+		} else if (c >= 0x80 && (n = utf8_length(&text[i], len - i))) {
+			i += n;
+			continue;
+		}
+
+		if (start < i) {
+			flush_buffer(&text[start], i - start);
+		}
+
+		switch (c) {
+		case '"':
+			flush_buffer("\\\"", 2);
+			break;
+		case '\\':
+			flush_buffer("\\\\", 2);
+			break;
+		case '\t':
+			flush_buffer("\\t", 2);
+			break;
+		case '\r':
+			flush_buffer("\\r", 2);
+			break;
+		default:
+			escape[4] = hex[c >> 4];
+			escape[5] = hex[c & 0x0F];
+			flush_buffer(escape, sizeof(escape));
+			break;
+		}
+
+		start = ++i;
+	}
+
+	if (start < i) {
+		flush_buffer(&text[start], i - start);
+	}
+}
+
+/* Outputs each line as a JSON object with the converted stamp at its
+ * beginning in "ts", if it has one, and the rest of the line in "msg" */
+static void json_lines(const char *textual, apr_off_t size)
+{
+	apr_off_t index = 0;
+	apr_off_t end, len, stamp;
+	const char *found;
+	const char *remain;
+	int unused;
+
+	die_assert(textual);
+
+	while (index < size) {
+		found = memchr(&textual[index], '\n', size - index);
+		end = found ? (found - textual) + 1 : size;
+		len = (found ? end - 1 : end) - index;
+
+		flush_char('{');
+
+		if (textual[index] == '@') {
+			/* Calculate stamp length */
+			for (stamp = 1; stamp < len && stamp <= NGIM_TAIN_FORMAT &&
+					is_hex_nibble(textual[index + stamp]); ++stamp)
+				/* Do nothing */ ;
+
+			if (convert_buffer(&textual[index], stamp, &remain, &unused)) {
+				flush_buffer("\"ts\":\"", 6);
+				flush_string(result);
+				flush_buffer("\",", 2);
+
+				/* The separator is not part of the message */
+				stamp -= unused;
+				if (stamp < len && textual[index + stamp] == ' ') {
+					++stamp;
+				}
+				index += stamp;
+				len -= stamp;
+			}
+		}
+
+		flush_buffer("\"msg\":\"", 7);
+		if (len > 0) {
+			flush_json(&textual[index], len);
+		}
+		flush_buffer("\"}\n", 3);
+
+		index = end;
+	}
+}
+
+/* Converts lines in memory */
+static inline void convert_lines(const char *textual, apr_off_t size)
+{
+	if (histogram) {
+		histogram_lines(textual, size);
+	} else if (arg_json) {
+		json_lines(textual, size);
+	} else {
+		ngim_convert_feed(&converter, textual, size);
+		ngim_convert_finish(&converter);
+	}
+}
+
+/* Returns the offset of the first line starting at or after offset. */
+static inline apr_off_t line_start(const char *textual, apr_off_t size,
+		apr_off_t offset)
+{
+	const char *newline;
+
+	if (offset <= 0) {
+		return 0;
+	} else if (offset >= size) {
+		return size;
+	}
+
+	/* A line starts at offset if the previous character is a newline */
+	newline = memchr(&textual[offset - 1], '\n', size - offset + 1);
+
+	if (newline) {
+		return (newline - textual) + 1;
+	}
+	return size;
+}
+
+/* Reads the time stamp at the beginning of the line starting at offset to
+ * stamp. TAI64 labels are treated as TAI64N labels with zero nanoseconds.
+ * Returns non-zero if the line starts with a valid label. */
+static inline int line_stamp(const char *textual, apr_off_t size,
+		apr_off_t offset, ngim_tain_t *stamp)
+{
+	apr_off_t len = 1;
+
+	die_assert(offset < size);
+
+	if (textual[offset] != '@') {
+		return 0;
+	}
+
+	/* Calculate stamp length */
+	while (offset + len < size && len < NGIM_TAIN_FORMAT &&
+			is_hex_nibble(textual[offset + len])) {
+		++len;
+	}
+
+	if (len == NGIM_TAIN_FORMAT) {
+		return ngim_tain_decode(&textual[offset], stamp);
+	} else if (len >= NGIM_TAI_FORMAT) {
+		stamp->nano = 0;
+		return ngim_tai_decode(&textual[offset], &stamp->sec);
+	}
+
+	return 0;
+}
+
+/* Finds the first line whose time stamp is not less than bound, or if after
+ * is non-zero, the first line whose time stamp is larger than bound. Assumes
+ * the stamps are in ascending order, as they are in files written by tainlog,
+ * and uses binary search on line starts. Lines without a valid stamp belong
+ * to the stamped line before them, as they do when merging, so they are
+ * never returned. Returns size if there is no such line. */
+static apr_off_t search_mmap(const char *textual, apr_off_t size,
+		const ngim_tain_t *bound, int after)
+{
+	apr_off_t low = 0, high = size, middle, probe;
+	ngim_tain_t stamp;
+
+	die_assert(textual);
+	die_assert(bound);
+
+	/* Lines starting before low are before the bound, lines starting at or
+	 * after high are not */
+	while (low < high) {
+		middle = low + (high - low) / 2;
+
+		/* Find the first stamped line starting at or after middle */
+		for (probe = line_start(textual, size, middle); probe < high;
+				probe = line_start(textual, size, probe + 1)) {
+			if (line_stamp(textual, size, probe, &stamp)) {
+				break;
+			}
+		}
+
+		if (probe >= high) {
+			/* No stamped lines in [middle, high) */
+			high = middle;
+		} else if (after ? !ngim_tain_less(bound, &stamp) :
+						   ngim_tain_less(&stamp, bound)) {
+			low = probe + 1;
+		} else {
+			high = probe;
+		}
+	}
+
+	/* Skip lines that belong to the one before low */
+	for (probe = line_start(textual, size, low); probe < size;
+			probe = line_start(textual, size, probe + 1)) {
+		if (line_stamp(textual, size, probe, &stamp)) {
+			break;
+		}
+	}
+
+	return probe;
+}
+
+/*
+ * Filtering
+ */
+
+#if HAVE_MEMMEM
+	#define find_text(textual, size, text, len) \
+		((const char*)memmem(textual, size, text, len))
+#else
+/* Returns the first occurrence of text of length len in textual, or NULL */
+static const char * find_text(const char *textual, apr_size_t size,
+		const char *text, apr_size_t len)
+{
+	const char *end = textual + size;
+
+	die_assert(len > 0);
+
+	while (size >= len &&
+			(textual = memchr(textual, text[0], size - len + 1))) {
+		if (!memcmp(textual, text, len)) {
+			return textual;
+		}
+		size = end - ++textual;
+	}
+
+	return NULL;
+}
+#endif
+
+/* Returns non-zero if the text following the stamp on a line of length len
+ * matches the filter. */
+static int filter_line(const char *line, apr_off_t len)
+{
+	apr_off_t i = 0;
+#if HAVE_REGEX_H && HAVE_REGCOMP && !defined(REG_STARTEND)
+	static char *buffer = NULL;
+	static apr_off_t buffer_len = 0;
+#endif
+
+	die_assert(line);
+
+	/* Skip the stamp */
+	if (len > 0 && line[0] == '@') {
+		while (++i < len && is_hex_nibble(line[i]) && i < NGIM_TAIN_FORMAT)
+			/* Do nothing */ ;
+	}
+
+	line += i;
+	len -= i;
+
+	if (len > 0 && line[len - 1] == '\n') {
+		--len;
+	}
+
+	if (arg_match && !find_text(line, len, arg_match, filter_len)) {
+		return 0;
+	}
+
+#if HAVE_REGEX_H && HAVE_REGCOMP
+	if (arg_regex) {
+	#if defined(REG_STARTEND)
+		regmatch_t match;
+
+		match.rm_so = 0;
+		match.rm_eo = len;
+
+		return !regexec(&filter_regex, line, 1, &match, REG_STARTEND);
+	#else
+		/* The line must be NUL-terminated */
+		if (len >= buffer_len) {
+			buffer_len = (len < 128) ? 256 : 2 * len;
+			if (ALLOC_FAIL(buffer, apr_palloc(g_pool, buffer_len))) {
+				die_allocerror0();
+			}
+		}
+
+		memcpy(buffer, line, len);
+		buffer[len] = '\0';
+
+		return !regexec(&filter_regex, buffer, 0, NULL, 0);
+	#endif
+	}
+#endif
+
+	return 1;
+}
+
+/* Converts the lines that match the filter. With --match, the text is
+ * first searched for in the whole buffer, so lines without it are skipped
+ * without looking at them one by one. */
+static void convert_filtered(const char *textual, apr_off_t size)
+{
+	apr_off_t offset = 0;
+	apr_off_t start, end;
+	apr_off_t run_start = 0, run_end = 0;
+	const char *found;
+
+	die_assert(textual);
+
+	while (offset < size) {
+		if (arg_match) {
+			if (!(found = find_text(&textual[offset], size - offset,
+					arg_match, filter_len))) {
+				break;
+			}
+			start = found - textual;
+		} else {
+			start = offset;
+		}
+
+		/* Widen to the whole line */
+		while (start > offset && textual[start - 1] != '\n') {
+			--start;
+		}
+
+		found = memchr(&textual[start], '\n', size - start);
+		end = found ? (found - textual) + 1 : size;
+
+		if (filter_line(&textual[start], end - start)) {
+			/* Collect adjacent lines to convert them in one go */
+			if (start != run_end) {
+				if (run_start < run_end) {
+					convert_lines(&textual[run_start], run_end - run_start);
+				}
+				run_start = start;
+			}
+			run_end = end;
+		}
+
+		offset = end;
+	}
+
+	if (run_start < run_end) {
+		convert_lines(&textual[run_start], run_end - run_start);
+	}
+}
+
+/* Converts lines in mapped memory, or just the ones that match the filter */
+static void convert_mapped(const char *textual, apr_off_t size)
+{
+	if (filter) {
+		convert_filtered(textual, size);
+	} else {
+		convert_lines(textual, size);
 	}
 }
 
@@ -446,6 +1092,8 @@ static int convert_mmap(const char *file)
 	apr_file_t *in;
 	apr_finfo_t finfo;
 	apr_mmap_t *map;
+	apr_off_t start, end;
+	const char *textual;
 
 	/* File pointer for incoming data */
 	if (file) {
@@ -459,12 +1107,27 @@ static int convert_mmap(const char *file)
 
 	die_assert(in);
 
-	/* Read file size, and map to memory */
+	/* Read file size and type */
 	if (APR_FAIL(status, apr_file_info_get(&finfo,
-					APR_FINFO_SIZE, in)) ||
-		APR_FAIL(status, apr_mmap_create(&map, in, 0, finfo.size,
+					APR_FINFO_SIZE | APR_FINFO_TYPE, in))) {
+		if (file) {
+			apr_file_close(in);
+		}
+		return 0;
+	}
+
+	/* There is nothing to convert in an empty file */
+	if (finfo.filetype == APR_REG && finfo.size == 0) {
+		if (file) {
+			apr_file_close(in);
+		}
+		return 1;
+	}
+
+	/* Map to memory */
+	if (APR_FAIL(status, apr_mmap_create(&map, in, 0, finfo.size,
 				APR_MMAP_READ, g_pool))) {
-		/* An empty file, a pipe, or another failure */
+		/* A pipe, or another failure */
 		if (file) {
 			apr_file_close(in);
 		}
@@ -478,13 +1141,25 @@ static int convert_mmap(const char *file)
 		warn_error1("failed to drop privileges");
 	}
 
+	textual = (const char*)map->mm;
+	start = 0;
+	end = finfo.size;
+
+	/* Limit to the requested time range */
+	if (range_since) {
+		start = search_mmap(textual, finfo.size, &range_since_tain, 0);
+	}
+	if (range_until) {
+		end = search_mmap(textual, finfo.size, &range_until_tain, 1);
+	}
+
 	/* Start converting */
-	if (arg_all) {
-		convert_mmap_all((const char*)map->mm, finfo.size);
-	} else {
-		convert_mmap_nrm((const char*)map->mm, finfo.size);
+	if (start < end) {
+		convert_mapped(&textual[start], end - start);
 	}
 
+	histogram_flush();
+
 	apr_mmap_delete(map);
 	
 	return 1;
@@ -493,21 +1168,1212 @@ static int convert_mmap(const char *file)
 #endif
 }
 
-int main(int argc, const char * const *argv, const char * const *env)
+/*
+ * Line by line conversion
+ */
+
+#define LINES_BUFSIZE		65536	/* Initial read buffer size */
+
+/* Function pointer type for converting complete lines */
+typedef void (*lines_func)(const char *textual, apr_off_t size);
+
+/* Passes the file, or stdin, to func. Maps the input if possible, and
+ * otherwise reads it in blocks of complete lines. Returns non-zero if
+ * successful. */
+static int convert_blocks(const char *file, lines_func func)
 {
-	apr_uint32_t selected;
+	apr_status_t status;
+	apr_file_t *in;
+	apr_finfo_t finfo;
+#if APR_HAS_MMAP
+	apr_mmap_t *map;
+#endif
+	apr_size_t bufsize = LINES_BUFSIZE;
+	apr_size_t len, pending = 0;
+	char *buffer, *grown;
 
-	ngim_base_app_init(PROGRAM_TAICONV, &argc, &argv, &env);
+	die_assert(func);
 
-	if (ngim_cmdline_parse(argc, argv, 1, taiconv_params, taiconv_args,
-			&selected) < 0 ||
-		validate_cmdline(selected) < 0) {
-		die_error4("usage: ", argv[0], " ", CMDLINE_USAGE);
+	/* File pointer for incoming data */
+	if (file) {
+		if (APR_FAIL(status, apr_file_open(&in, file, APR_FOPEN_READ |
+				APR_FOPEN_BINARY, 0, g_pool))) {
+			die_aprerror2(status, "failed to open file ", file);
+		}
+	} else {
+		in = g_apr_stdin;
 	}
 
-	die_assert(arg_func_format);
+	die_assert(in);
+
+	if (APR_FAIL(status, apr_file_info_get(&finfo,
+					APR_FINFO_SIZE | APR_FINFO_TYPE, in))) {
+		finfo.filetype = APR_NOFILE;
+	}
+
+	/* There is nothing to convert in an empty file */
+	if (finfo.filetype == APR_REG && finfo.size == 0) {
+		return 1;
+	}
+
+#if APR_HAS_MMAP
+	if (finfo.filetype == APR_REG &&
+		APR_SUCCESS == apr_mmap_create(&map, in, 0, finfo.size,
+				APR_MMAP_READ, g_pool)) {
+		/* Drop unneeded privileges */
+		if (ngim_priv_drop(NGIM_PRIV_NONE, NULL, NULL) < 0) {
+			warn_error1("failed to drop privileges");
+		}
+
+		func((const char*)map->mm, finfo.size);
+		apr_mmap_delete(map);
+		return 1;
+	}
+#endif
+
+	/* Drop unneeded privileges */
+	if (ngim_priv_drop(NGIM_PRIV_NONE, NULL, NULL) < 0) {
+		warn_error1("failed to drop privileges");
+	}
+
+	if (ALLOC_FAIL(buffer, apr_palloc(g_pool, bufsize))) {
+		die_allocerror0();
+	}
+
+	for (;;) {
+		if (pending == bufsize) {
+			/* A line longer than the buffer */
+			if (ALLOC_FAIL(grown, apr_palloc(g_pool, 2 * bufsize))) {
+				die_allocerror0();
+			}
+			memcpy(grown, buffer, pending);
+			buffer = grown;
+			bufsize *= 2;
+		}
+
+		len = bufsize - pending;
+
+		if (APR_FAIL(status, apr_file_read(in, &buffer[pending], &len))) {
+			if (!APR_STATUS_IS_EOF(status)) {
+				die_aprerror1(status, "failed to read input");
+			}
+			break;
+		}
+
+		pending += len;
+
+		/* Convert complete lines */
+		len = pending;
+		while (len > 0 && buffer[len - 1] != '\n') {
+			--len;
+		}
+
+		if (len > 0) {
+			func(buffer, len);
+			pending -= len;
+			memmove(buffer, &buffer[len], pending);
+		}
+	}
+
+	if (pending > 0) {
+		func(buffer, pending);
+	}
+
+	return 1;
+}
+
+/*
+ * Reverse conversion
+ */
+
+/* Converts ISO 8601 dates and times at the beginning of each line to
+ * external textual TAI64N labels. Lines without one are left alone. */
+static void reverse_lines(const char *textual, apr_off_t size)
+{
+	apr_off_t index = 0;
+	apr_off_t start = 0;
+	apr_off_t end;
+	apr_size_t used;
+	apr_time_t t;
+	ngim_tain_t tain;
+	char label[NGIM_TAIN_FORMAT];
+	const char *found;
+
+	die_assert(textual);
 
-	if (convert_mmap(arg_file) || convert_read(arg_file)) {
+	while (index < size) {
+		found = memchr(&textual[index], '\n', size - index);
+		end = found ? (found - textual) + 1 : size;
+
+		if (textual[index] >= '0' && textual[index] <= '9' &&
+			(used = ngim_iso8601_context_parse(&parse_context,
+				&textual[index], end - index, &t)) > 0) {
+			if (start < index) {
+				flush_buffer(&textual[start], index - start);
+			}
+
+			/* Exact conversion, as in parse_time */
+			ngim_tai_from_apr(&tain.sec, t);
+			tain.nano = 1000 * apr_time_usec(t);
+			ngim_tain_encode(label, &tain);
+
+			flush_buffer(label, NGIM_TAIN_FORMAT);
+			start = index + used;
+		}
+
+		index = end;
+	}
+
+	if (start < index) {
+		flush_buffer(&textual[start], index - start);
+	}
+}
+
+/*
+ * Following
+ */
+
+#define FOLLOW_BUFSIZE		65536	/* Read buffer size */
+#define FOLLOW_EVENTSIZE	4096	/* Buffer size for inotify events */
+#define TIMEOUT_FOLLOW		60		/* Maximum time between checks, seconds */
+#define PAUSE_FOLLOW		1		/* Time between checks without inotify */
+
+/* A log directory being followed */
+typedef struct {
+	const char *dir;		/* The directory */
+	const char *current;	/* Path to FILE_CURRENT in it */
+	apr_file_t *file;		/* The log file being read, or NULL */
+	apr_ino_t inode;		/* Inode and device of file */
+	apr_dev_t device;
+	char *buffer;			/* Read buffer */
+	apr_size_t pending;		/* Bytes of an incomplete line in buffer */
+} follow_state;
+
+/* Converts the complete lines in the buffer and keeps the rest pending. If
+ * all is non-zero or the buffer is full, converts everything. */
+static void follow_convert(follow_state *state, int all)
+{
+	apr_size_t len = state->pending;
+
+	die_assert(state);
+
+	if (!all && len < FOLLOW_BUFSIZE) {
+		/* Up to the last newline */
+		while (len > 0 && state->buffer[len - 1] != '\n') {
+			--len;
+		}
+	}
+
+	if (len > 0) {
+		convert_mapped(state->buffer, len);
+
+		state->pending -= len;
+		memmove(state->buffer, &state->buffer[len], state->pending);
+	}
+}
+
+/* Reads and converts everything currently available in the log file. */
+static void follow_read(follow_state *state)
+{
+	apr_status_t status;
+	apr_size_t len;
+
+	die_assert(state);
+
+	if (!state->file) {
+		return;
+	}
+
+	for (;;) {
+		len = FOLLOW_BUFSIZE - state->pending;
+
+		if (APR_FAIL(status, apr_file_read(state->file,
+				&state->buffer[state->pending], &len))) {
+			if (!APR_STATUS_IS_EOF(status)) {
+				warn_aprerror2(status, "failed to read from ", state->dir);
+			}
+			break;
+		}
+
+		state->pending += len;
+		follow_convert(state, 0);
+	}
+}
+
+/* Closes the log file being read, converting any incomplete line left. */
+static void follow_close(follow_state *state)
+{
+	die_assert(state);
+
+	if (state->file) {
+		follow_convert(state, 1);
+		apr_file_close(state->file);
+		state->file = NULL;
+	}
+}
+
+/* Opens a log file for reading, optionally from its end. Returns non-zero
+ * if successful. */
+static int follow_open(follow_state *state, const char *path, int end)
+{
+	apr_status_t status;
+	apr_finfo_t info;
+	apr_off_t offset = 0;
+
+	die_assert(state);
+	die_assert(path);
+	die_assert(!state->file);
+
+	if (APR_FAIL(status, apr_file_open(&state->file, path, APR_FOPEN_READ |
+			APR_FOPEN_BINARY, 0, g_pool))) {
+		if (!APR_STATUS_IS_ENOENT(status)) {
+			warn_aprerror2(status, "failed to open file ", path);
+		}
+		state->file = NULL;
+		return 0;
+	}
+
+	if (APR_FAIL(status, apr_file_info_get(&info, APR_FINFO_IDENT,
+			state->file)) ||
+		(end && APR_FAIL(status, apr_file_seek(state->file, APR_END,
+			&offset)))) {
+		warn_aprerror2(status, "failed to open file ", path);
+		apr_file_close(state->file);
+		state->file = NULL;
+		return 0;
+	}
+
+	state->inode = info.inode;
+	state->device = info.device;
+	return 1;
+}
+
+/* Converts an entire archived log file. */
+static void follow_archived(follow_state *state, const char *name,
+		apr_pool_t *pool)
+{
+	char *path;
+
+	die_assert(state);
+	die_assert(name);
+	die_assert(pool);
+
+	if (ALLOC_FAIL(path, apr_psprintf(pool, "%s/%s", state->dir, name))) {
+		die_allocerror0();
+	}
+
+	if (follow_open(state, path, 0)) {
+		follow_read(state);
+		follow_close(state);
+	}
+}
+
+/* Returns non-zero if FILE_CURRENT is not the file being read, which means
+ * tainlog has archived it, or it has appeared after we started. */
+static int follow_rotated(follow_state *state, apr_pool_t *pool)
+{
+	apr_status_t status;
+	apr_finfo_t info;
+
+	die_assert(state);
+	die_assert(pool);
+
+	if (APR_FAIL(status, apr_stat(&info, state->current, APR_FINFO_IDENT,
+			pool))) {
+		if (!APR_STATUS_IS_ENOENT(status)) {
+			warn_aprerror2(status, "stat failed for ", state->current);
+		}
+		/* Not created yet, keep reading the old file */
+		return 0;
+	}
+
+	return (!state->file || info.inode != state->inode ||
+			info.device != state->device);
+}
+
+/* Moves from the archived log file being read to the new FILE_CURRENT. If
+ * tainlog has archived more than one file in the meantime, converts the
+ * files archived after the one being read first, so nothing is missed. */
+static void follow_rotate(follow_state *state, apr_pool_t *pool)
+{
+	apr_status_t status;
+	apr_dir_t *directory;
+	apr_finfo_t info;
+	char archived[NGIM_TAIN_FORMAT + 1];
+	char next[NGIM_TAIN_FORMAT + 1];
+	int found = 0, more;
+
+	die_assert(state);
+	die_assert(pool);
+
+	if (state->file) {
+		/* tainlog closes the file before archiving it, so whatever we read
+		 * now is all there is */
+		follow_read(state);
+
+		/* Find the name the file was archived to */
+		if (APR_FAIL(status, apr_dir_open(&directory, state->dir, pool))) {
+			warn_aprerror2(status, "failed to open directory ", state->dir);
+		} else {
+			while (apr_dir_read(&info, APR_FINFO_NAME | APR_FINFO_IDENT,
+						directory) == APR_SUCCESS) {
+				if (info.name[0] == '@' &&
+					strlen(info.name) == NGIM_TAIN_FORMAT &&
+					info.inode == state->inode &&
+					info.device == state->device) {
+					apr_cpystrn(archived, info.name, sizeof(archived));
+					found = 1;
+					break;
+				}
+			}
+			apr_dir_close(directory);
+		}
+
+		follow_close(state);
+	}
+
+	/* Convert files archived after it, oldest first */
+	while (found) {
+		more = 0;
+
+		if (APR_FAIL(status, apr_dir_open(&directory, state->dir, pool))) {
+			warn_aprerror2(status, "failed to open directory ", state->dir);
+			break;
+		}
+		while (apr_dir_read(&info, APR_FINFO_NAME, directory) ==
+				APR_SUCCESS) {
+			if (info.name[0] == '@' &&
+				strlen(info.name) == NGIM_TAIN_FORMAT &&
+				strcmp(info.name, archived) > 0 &&
+				(!more || strcmp(info.name, next) < 0)) {
+				apr_cpystrn(next, info.name, sizeof(next));
+				more = 1;
+			}
+		}
+		apr_dir_close(directory);
+
+		if (!more) {
+			break;
+		}
+
+		follow_archived(state, next, pool);
+		memcpy(archived, next, sizeof(archived));
+	}
+
+	/* Then the new current from the start */
+	follow_open(state, state->current, 0);
+}
+
+/* Creates a pollset that becomes readable when something changes in the
+ * directory. Returns NULL if this is not supported, in which case the
+ * directory is checked periodically. */
+static apr_pollset_t * follow_watch(follow_state *state, apr_file_t **events)
+{
+#if HAVE_SYS_INOTIFY_H && HAVE_INOTIFY_INIT
+	apr_status_t status;
+	apr_pollset_t *pset;
+	int fd;
+
+	die_assert(state);
+	die_assert(events);
+
+	if ((fd = inotify_init()) == -1) {
+		warn_syserror1("inotify_init failed");
+		return NULL;
+	}
+
+	if (inotify_add_watch(fd, state->dir, IN_MODIFY | IN_CREATE |
+			IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE) == -1) {
+		warn_syserror2("failed to watch ", state->dir);
+		close(fd);
+		return NULL;
+	}
+
+	if (APR_FAIL(status, apr_os_file_put(events, &fd, APR_FOPEN_READ,
+			g_pool))) {
+		warn_aprerror1(status, "failed to watch for changes");
+		close(fd);
+		return NULL;
+	}
+
+	if (ngim_create_pollset_file_in(&pset, *events, g_pool) < 0) {
+		apr_file_close(*events);
+		return NULL;
+	}
+
+	return pset;
+#else
+	return NULL;
+#endif
+}
+
+/* Waits until something changes in the directory, or for a while. */
+static void follow_wait(apr_pollset_t *pset, apr_file_t *events)
+{
+	apr_status_t status;
+	apr_int32_t signaled;
+	apr_size_t len;
+	char buffer[FOLLOW_EVENTSIZE];
+
+	if (!pset) {
+		apr_sleep(apr_time_from_sec(PAUSE_FOLLOW));
+		return;
+	}
+
+	die_assert(events);
+
+	if (APR_FAIL(status, apr_pollset_poll(pset,
+			apr_time_from_sec(TIMEOUT_FOLLOW), &signaled, NULL))) {
+		if (!APR_STATUS_IS_EINTR(status) && !APR_STATUS_IS_TIMEUP(status)) {
+			warn_aprerror1(status, "failed to wait for changes");
+			apr_sleep(apr_time_from_sec(PAUSE_FOLLOW));
+		}
+		return;
+	}
+
+	/* The events themselves don't matter, the directory is checked after
+	 * each wakeup */
+	len = sizeof(buffer);
+	apr_file_read(events, buffer, &len);
+}
+
+/* Converts lines as they are written to FILE_CURRENT in directory dir,
+ * starting from its current end, and continues across rotations. Never
+ * returns. */
+static int convert_follow(const char *dir)
+{
+	apr_pool_t *pool;
+	apr_status_t status;
+	apr_pollset_t *pset;
+	apr_file_t *events = NULL;
+	follow_state state;
+
+	die_assert(dir);
+
+	memset(&state, 0, sizeof(state));
+	state.dir = dir;
+
+	if (ALLOC_FAIL(state.current,
+			apr_psprintf(g_pool, "%s/" FILE_CURRENT, dir)) ||
+		ALLOC_FAIL(state.buffer, apr_palloc(g_pool, FOLLOW_BUFSIZE))) {
+		die_allocerror0();
+	}
+
+	if (APR_FAIL(status, apr_pool_create(&pool, g_pool))) {
+		die_aprerror1(status, "failed to create a memory pool");
+	}
+
+	/* Privileges are not dropped, as new log files are opened for as long
+	 * as we run */
+	pset = follow_watch(&state, &events);
+	follow_open(&state, state.current, 1);
+
+	for (;;) {
+		follow_read(&state);
+
+		if (follow_rotated(&state, pool)) {
+			follow_rotate(&state, pool);
+			apr_pool_clear(pool);
+			/* Read the new file before waiting */
+			continue;
+		}
+
+		apr_pool_clear(pool);
+		flush_output();
+		follow_wait(pset, events);
+	}
+
+	return 1;
+}
+
+/*
+ * Log directories
+ */
+
+static int compare_archived_name(const void *a, const void *b)
+{
+	die_assert(a);
+	die_assert(b);
+
+	return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/* Lists the archived log files in dir in stamp order. Returns the number of
+ * files in names, which has room for one more name at the end. */
+static int list_archived(const char *dir, const char ***names,
+		apr_pool_t *pool)
+{
+	apr_status_t status;
+	apr_dir_t *directory;
+	apr_finfo_t info;
+	int count = 0, i;
+
+	die_assert(dir);
+	die_assert(names);
+	die_assert(pool);
+
+	/* Count the archived files first */
+	if (APR_FAIL(status, apr_dir_open(&directory, dir, pool))) {
+		die_aprerror2(status, "failed to open directory ", dir);
+	}
+	while (apr_dir_read(&info, APR_FINFO_NAME, directory) == APR_SUCCESS) {
+		if (info.name[0] == '@' && strlen(info.name) == NGIM_TAIN_FORMAT) {
+			++count;
+		}
+	}
+	apr_dir_close(directory);
+
+	if (ALLOC_FAIL(*names, apr_pcalloc(pool, (count + 1) * sizeof(**names)))) {
+		die_allocerror0();
+	}
+
+	/* Then collect their names, tainlog may have archived more since */
+	if (APR_FAIL(status, apr_dir_open(&directory, dir, pool))) {
+		die_aprerror2(status, "failed to open directory ", dir);
+	}
+	i = 0;
+	while (i < count &&
+			apr_dir_read(&info, APR_FINFO_NAME, directory) == APR_SUCCESS) {
+		if (info.name[0] == '@' && strlen(info.name) == NGIM_TAIN_FORMAT) {
+			if (ALLOC_FAIL((*names)[i++], apr_pstrdup(pool, info.name))) {
+				die_allocerror0();
+			}
+		}
+	}
+	apr_dir_close(directory);
+
+	/* Names of archived files are stamps, which sort as strings */
+	qsort(*names, i, sizeof(**names), compare_archived_name);
+	return i;
+}
+
+#if APR_HAS_MMAP
+/* Maps file name in directory dir to memory. Returns zero if the file is
+ * empty or does not exist. */
+static int map_archived(const char *dir, const char *name,
+		const char **textual, apr_off_t *size, apr_pool_t *pool)
+{
+	apr_status_t status;
+	apr_file_t *in;
+	apr_finfo_t finfo;
+	apr_mmap_t *map;
+	char *path;
+
+	die_assert(dir);
+	die_assert(name);
+	die_assert(textual);
+	die_assert(size);
+	die_assert(pool);
+
+	if (ALLOC_FAIL(path, apr_psprintf(pool, "%s/%s", dir, name))) {
+		die_allocerror0();
+	}
+
+	if (APR_FAIL(status, apr_file_open(&in, path, APR_FOPEN_READ |
+			APR_FOPEN_BINARY, 0, pool))) {
+		if (!APR_STATUS_IS_ENOENT(status)) {
+			/* Removed by tainlog while listing is fine, anything else
+			 * is worth mentioning */
+			warn_aprerror2(status, "failed to open file ", path);
+		}
+		return 0;
+	}
+
+	if (APR_FAIL(status, apr_file_info_get(&finfo,
+					APR_FINFO_SIZE | APR_FINFO_TYPE, in))) {
+		die_aprerror2(status, "failed to read file information for ", path);
+	}
+
+	if (finfo.filetype != APR_REG || finfo.size == 0) {
+		apr_file_close(in);
+		return 0;
+	}
+
+	if (APR_FAIL(status, apr_mmap_create(&map, in, 0, finfo.size,
+			APR_MMAP_READ, pool))) {
+		die_aprerror2(status, "failed to map file ", path);
+	}
+
+	/* The mapping stays valid after the file is closed, which keeps the
+	 * number of open descriptors low */
+	apr_file_close(in);
+
+	*textual = (const char*)map->mm;
+	*size = finfo.size;
+	return 1;
+}
+#endif
+
+/*
+ * Merging
+ */
+
+#if APR_HAS_MMAP
+/* A mapped log file, or the part of it within the time range */
+typedef struct {
+	const char *textual;
+	apr_off_t size;
+} merge_file;
+
+/* A log directory being merged */
+typedef struct {
+	const char *name;		/* Directory name, prefixed to each line */
+	int index;				/* Order on the command line, breaks ties */
+	merge_file *files;		/* Archived log files in order, then current */
+	int nfiles;
+	int file;				/* Index of the file being read */
+	apr_off_t offset;		/* Start of the next line in the file */
+	const char *line;		/* Current line */
+	apr_off_t len;			/* Length of the current line */
+	ngim_tain_t stamp;		/* Stamp of the current line, or of the closest
+							 * preceding stamped line if it has none */
+} merge_source;
+
+/* Maps file name in directory dir to memory and adds it to source, limited
+ * to the time range if one is given. Empty files are skipped. */
+static void merge_map(merge_source *source, const char *dir,
+		const char *name, apr_pool_t *pool)
+{
+	apr_off_t size, start, end;
+	const char *textual;
+
+	die_assert(source);
+
+	if (!map_archived(dir, name, &textual, &size, pool)) {
+		return;
+	}
+
+	start = 0;
+	end = size;
+
+	if (range_since) {
+		start = search_mmap(textual, size, &range_since_tain, 0);
+	}
+	if (range_until) {
+		end = search_mmap(textual, size, &range_until_tain, 1);
+	}
+
+	if (start < end) {
+		source->files[source->nfiles].textual = &textual[start];
+		source->files[source->nfiles].size = end - start;
+		++source->nfiles;
+	}
+}
+
+/* Lists the archived log files in dir in stamp order, followed by
+ * FILE_CURRENT, and maps them all to memory. */
+static void merge_open(merge_source *source, const char *dir,
+		apr_pool_t *pool)
+{
+	const char **names;
+	int count, i;
+
+	die_assert(source);
+	die_assert(dir);
+	die_assert(pool);
+
+	count = list_archived(dir, &names, pool);
+	names[count++] = FILE_CURRENT;
+
+	if (ALLOC_FAIL(source->files,
+			apr_pcalloc(pool, count * sizeof(*source->files)))) {
+		die_allocerror0();
+	}
+
+	source->name = dir;
+	source->nfiles = 0;
+
+	for (i = 0; i < count; ++i) {
+		merge_map(source, dir, names[i], pool);
+	}
+}
+
+/* Moves source to its next line. Returns zero if there are no more lines. */
+static int merge_next(merge_source *source)
+{
+	const merge_file *file;
+	const char *newline;
+	ngim_tain_t stamp;
+
+	die_assert(source);
+
+	/* Skip to the next file with data left */
+	while (source->file < source->nfiles &&
+			source->offset >= source->files[source->file].size) {
+		++source->file;
+		source->offset = 0;
+	}
+
+	if (source->file >= source->nfiles) {
+		return 0;
+	}
+
+	file = &source->files[source->file];
+
+	source->line = &file->textual[source->offset];
+	newline = memchr(source->line, '\n', file->size - source->offset);
+
+	if (newline) {
+		source->len = newline - source->line + 1;
+	} else {
+		source->len = file->size - source->offset;
+	}
+
+	source->offset += source->len;
+
+	/* Lines without a stamp keep the stamp of the previous line */
+	if (line_stamp(source->line, source->len, 0, &stamp)) {
+		source->stamp = stamp;
+	}
+
+	return 1;
+}
+
+/* Compares the current lines of two sources, returns non-zero if a comes
+ * before b. */
+static inline int merge_less(const merge_source *a, const merge_source *b)
+{
+	if (ngim_tain_less(&a->stamp, &b->stamp)) {
+		return 1;
+	} else if (ngim_tain_less(&b->stamp, &a->stamp)) {
+		return 0;
+	}
+	return (a->index < b->index);
+}
+
+/* Restores the heap property for a binary min-heap of n sources after the
+ * source at position i has changed. */
+static void merge_heapify(merge_source **heap, int n, int i)
+{
+	merge_source *tmp;
+	int smallest, child;
+
+	for (;;) {
+		smallest = i;
+		child = 2 * i + 1;
+
+		if (child < n && merge_less(heap[child], heap[smallest])) {
+			smallest = child;
+		}
+		if (child + 1 < n && merge_less(heap[child + 1], heap[smallest])) {
+			smallest = child + 1;
+		}
+		if (smallest == i) {
+			break;
+		}
+
+		tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+/* Merges the log files in directories dirs line by line in the order of
+ * their time stamps, prefixing each line with the name of its directory.
+ * Each directory is assumed to be in stamp order already, so only the
+ * current line of each directory is kept in a heap. */
+static int convert_merge(const char * const *dirs, int count)
+{
+	merge_source *sources;
+	merge_source **heap;
+	merge_source *top;
+	int i, n = 0;
+
+	die_assert(dirs);
+	die_assert(count > 0);
+
+	if (ALLOC_FAIL(sources, apr_pcalloc(g_pool, count * sizeof(*sources))) ||
+		ALLOC_FAIL(heap, apr_pcalloc(g_pool, count * sizeof(*heap)))) {
+		die_allocerror0();
+	}
+
+	/* Map everything before dropping privileges */
+	for (i = 0; i < count; ++i) {
+		merge_open(&sources[i], dirs[i], g_pool);
+		sources[i].index = i;
+	}
+
+	/* Drop unneeded privileges */
+	if (ngim_priv_drop(NGIM_PRIV_NONE, NULL, NULL) < 0) {
+		warn_error1("failed to drop privileges");
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (merge_next(&sources[i])) {
+			heap[n++] = &sources[i];
+		}
+	}
+	for (i = n / 2 - 1; i >= 0; --i) {
+		merge_heapify(heap, n, i);
+	}
+
+	while (n > 0) {
+		top = heap[0];
+
+		if (!filter || filter_line(top->line, top->len)) {
+			flush_string(top->name);
+			flush_buffer(": ", 2);
+
+			convert_lines(top->line, top->len);
+
+			/* Keep lines from different sources apart */
+			if (top->line[top->len - 1] != '\n') {
+				flush_char('\n');
+			}
+		}
+
+		if (!merge_next(top)) {
+			heap[0] = heap[--n];
+		}
+		merge_heapify(heap, n, 0);
+	}
+
+	return 1;
+}
+#else
+static int convert_merge(const char * const *dirs, int count)
+{
+	die_error1("--merge is not supported without mmap");
+}
+#endif
+
+/*
+ * Cursors
+ */
+
+#if APR_HAS_MMAP
+#define CURSOR_BUFSIZE	64	/* Enough for a label and an offset */
+#define CURSOR_RETRIES	3	/* Times to map again if archived meanwhile */
+
+/* Position in a log directory. The file is identified by the stamp on its
+ * first line, which is also the name tainlog archived the file before it
+ * to. This keeps it recognizable after it too has been archived. */
+typedef struct {
+	int stamped;						/* Non-zero if label is set */
+	char label[NGIM_TAIN_FORMAT + 1];	/* NUL-terminated */
+	apr_off_t offset;					/* Bytes already converted */
+} cursor_state;
+
+/* Copies the stamp on the first line of a mapped file to label. Returns
+ * zero if the line has none. */
+static int cursor_label(const char *textual, apr_off_t size, char *label)
+{
+	int i;
+
+	die_assert(label);
+
+	if (!textual || size < NGIM_TAIN_FORMAT || textual[0] != '@') {
+		return 0;
+	}
+	for (i = 1; i < NGIM_TAIN_FORMAT; ++i) {
+		if (!is_hex_nibble(textual[i])) {
+			return 0;
+		}
+	}
+
+	memcpy(label, textual, NGIM_TAIN_FORMAT);
+	label[NGIM_TAIN_FORMAT] = '\0';
+	return 1;
+}
+
+/* Reads the cursor from file path. A missing file means starting from the
+ * oldest archived log file. */
+static void cursor_load(const char *path, cursor_state *cursor,
+		apr_pool_t *pool)
+{
+	apr_status_t status;
+	apr_file_t *file;
+	apr_size_t len;
+	char buffer[CURSOR_BUFSIZE];
+	char *pos, *end;
+
+	die_assert(path);
+	die_assert(cursor);
+	die_assert(pool);
+
+	memset(cursor, 0, sizeof(*cursor));
+
+	if (APR_FAIL(status, apr_file_open(&file, path, APR_FOPEN_READ,
+			0, pool))) {
+		if (APR_STATUS_IS_ENOENT(status)) {
+			return;
+		}
+		die_aprerror2(status, "failed to open file ", path);
+	}
+
+	len = sizeof(buffer) - 1;
+	status = apr_file_read_full(file, buffer, len, &len);
+	apr_file_close(file);
+
+	if (status != APR_SUCCESS && !APR_STATUS_IS_EOF(status)) {
+		die_aprerror2(status, "failed to read from ", path);
+	}
+	buffer[len] = '\0';
+
+	/* The format is "[label ]offset\n" */
+	pos = buffer;
+	if (*pos == '@') {
+		if (!cursor_label(pos, len, cursor->label) ||
+				pos[NGIM_TAIN_FORMAT] != ' ') {
+			die_error2("invalid cursor in ", path);
+		}
+		cursor->stamped = 1;
+		pos += NGIM_TAIN_FORMAT + 1;
+	}
+
+	cursor->offset = (apr_off_t)apr_strtoi64(pos, &end, 10);
+
+	if (end == pos || *end != '\n' || cursor->offset < 0) {
+		die_error2("invalid cursor in ", path);
+	}
+}
+
+/* Returns non-zero if tainlog has archived a file in dir that is newer than
+ * the newest of the count names listed earlier. */
+static int cursor_rotated(const char *dir, const char * const *names,
+		int count)
+{
+	const char **listed;
+	int n;
+
+	die_assert(dir);
+	die_assert(names);
+
+	n = list_archived(dir, &listed, g_pool);
+
+	return (n > 0 && (count == 0 || strcmp(listed[n - 1],
+				names[count - 1]) > 0));
+}
+
+/* Converts the lines written to directory dir since the position in the
+ * cursor file, and updates the cursor. Only complete lines in FILE_CURRENT
+ * are converted, the rest is left for the next time. */
+static int convert_cursor(const char *dir, const char *path)
+{
+	apr_status_t status;
+	apr_file_t *file;
+	cursor_state cursor;
+	const char **names;
+	const char **textual;
+	apr_off_t *size;
+	apr_off_t offset, end = 0;
+	char label[NGIM_TAIN_FORMAT + 1];
+	char *tmpname, *output;
+	int count, first, i, tries;
+
+	die_assert(dir);
+	die_assert(path);
+
+	cursor_load(path, &cursor, g_pool);
+	offset = cursor.offset;
+
+	/* Archives are listed before current is mapped. If tainlog archives
+	 * current in between, the file mapped as current is a newer one and
+	 * the archived file would be skipped, so the files are listed again
+	 * afterwards and mapped again if something was archived. */
+	for (tries = 0; ; ++tries) {
+		count = list_archived(dir, &names, g_pool);
+		names[count] = FILE_CURRENT;
+
+		/* The file being read when the cursor was saved is the first one
+		 * archived after its label, or current if there are none. Without
+		 * a label, it is the oldest file. */
+		first = 0;
+
+		if (cursor.stamped) {
+			while (first < count &&
+					strcmp(names[first], cursor.label) <= 0) {
+				++first;
+			}
+		}
+
+		if (ALLOC_FAIL(textual, apr_pcalloc(g_pool,
+				(count + 1) * sizeof(*textual))) ||
+			ALLOC_FAIL(size, apr_pcalloc(g_pool,
+				(count + 1) * sizeof(*size)))) {
+			die_allocerror0();
+		}
+
+		/* Map only the files with something new in them */
+		for (i = first; i <= count; ++i) {
+			if (!map_archived(dir, names[i], &textual[i], &size[i],
+					g_pool)) {
+				textual[i] = NULL;
+				size[i] = 0;
+			}
+		}
+
+		if (tries == CURSOR_RETRIES || !cursor_rotated(dir, names, count)) {
+			break;
+		}
+	}
+
+	/* Make sure the file still is the one the cursor was saved in. If
+	 * the old files have already been removed, start from the oldest one
+	 * left. */
+	if (offset > 0 &&
+			(size[first] < offset ||
+			(cursor_label(textual[first], size[first], label) &&
+			 (!cursor.stamped || strcmp(label, cursor.label))))) {
+		warn_error3("lost track of ", dir, ", some lines may be missing");
+		offset = 0;
+	}
+
+	/* Create the new cursor before dropping privileges */
+	if (ALLOC_FAIL(tmpname, apr_psprintf(g_pool, "%s.XXXXXX", path))) {
+		die_allocerror0();
+	}
+
+	if (APR_FAIL(status, apr_file_mktemp(&file, tmpname, APR_FOPEN_CREATE |
+			APR_EXCL | APR_FOPEN_WRITE | APR_FOPEN_BINARY, g_pool))) {
+		die_aprerror2(status, "failed to update ", path);
+	}
+
+	/* Drop unneeded privileges */
+	if (ngim_priv_drop(NGIM_PRIV_NONE, NULL, NULL) < 0) {
+		warn_error1("failed to drop privileges");
+	}
+
+	for (i = first; i <= count; ++i, offset = 0) {
+		end = size[i];
+
+		if (i == count) {
+			/* Leave an incomplete line in current for later */
+			while (end > offset && textual[i][end - 1] != '\n') {
+				--end;
+			}
+		}
+
+		if (end <= offset) {
+			continue;
+		}
+
+		convert_mapped(&textual[i][offset], end - offset);
+	}
+
+	histogram_flush();
+
+	/* The new position is in current. If it has no lines yet, its first
+	 * line will have the label of the newest archived file. */
+	if (cursor_label(textual[count], size[count], label)) {
+		output = apr_psprintf(g_pool, "%s %" APR_OFF_T_FMT "\n", label, end);
+	} else if (count > 0) {
+		output = apr_psprintf(g_pool, "%s %" APR_OFF_T_FMT "\n",
+					names[count - 1], end);
+	} else {
+		output = apr_psprintf(g_pool, "%" APR_OFF_T_FMT "\n", end);
+	}
+
+	if (!output) {
+		die_allocerror0();
+	}
+
+	/* Lines are written out before the cursor moves past them */
+	flush_output();
+
+	if (APR_FAIL(status, apr_file_write_full(file, output, strlen(output),
+			NULL))) {
+		apr_file_close(file);
+		apr_file_remove(tmpname, g_pool);
+		die_aprerror2(status, "failed to write to ", tmpname);
+	}
+
+	apr_file_close(file);
+
+	if (APR_FAIL(status, apr_file_rename(tmpname, path, g_pool))) {
+		apr_file_remove(tmpname, g_pool);
+		die_aprerror4(status, "failed to rename ", tmpname, " -> ", path);
+	}
+
+	return 1;
+}
+#else
+static int convert_cursor(const char *dir, const char *path)
+{
+	die_error1("--cursor is not supported without mmap");
+}
+#endif
+
+int main(int argc, const char * const *argv, const char * const *env)
+{
+	apr_uint32_t selected;
+	const char * const *merge_dirs;
+	int index, merge_count;
+
+	ngim_base_app_init(PROGRAM_TAICONV, &argc, &argv, &env);
+
+	if ((index = ngim_cmdline_parse(argc, argv, 0, taiconv_params,
+			taiconv_args, &selected)) < 0 ||
+		validate_cmdline(selected) < 0) {
+		die_error4("usage: ", argv[0], " ", CMDLINE_USAGE);
+	}
+
+	/* Only --merge takes more than one argument */
+	if (index > 0 && !arg_merge) {
+		warn_error1("too many arguments");
+		die_error4("usage: ", argv[0], " ", CMDLINE_USAGE);
+	}
+
+	die_assert(arg_func_format);
+
+	ngim_iso8601_context_init(&format_context, arg_utc);
+	ngim_iso8601_context_init(&parse_context, arg_utc);
+	ngim_convert_init(&converter, arg_all ? NGIM_CONVERT_ALL : 0,
+		arg_func_format, flush_converted, NULL);
+
+	/* Output is buffered */
+	if (atexit(flush_output_at_exit)) {
+		die_syserror1("atexit failed");
+	}
+
+	if (arg_reverse) {
+		if (convert_blocks(arg_file, reverse_lines)) {
+			return EXIT_SUCCESS;
+		}
+		return EXIT_FAILURE;
+	}
+
+	if (arg_follow) {
+		return convert_follow(arg_file) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (arg_cursor) {
+		if (convert_cursor(arg_file, arg_cursor)) {
+			return EXIT_SUCCESS;
+		}
+		return EXIT_FAILURE;
+	}
+
+	if (arg_merge) {
+		/* The first directory is in arg_file, the rest follow it */
+		merge_dirs = &argv[(index > 0) ? index - 1 : argc - 1];
+		merge_count = (index > 0) ? argc - index + 1 : 1;
+
+		die_assert(merge_dirs[0] == arg_file);
+
+		if (convert_merge(merge_dirs, merge_count)) {
+			return EXIT_SUCCESS;
+		}
+		return EXIT_FAILURE;
+	}
+
+	if (convert_mmap(arg_file)) {
+		return EXIT_SUCCESS;
+	} else if (range_since || range_until) {
+		/* Searching for the time range requires a mapped file */
+		die_error1("--since and --until require a regular file as input");
+	} else if (filter) {
+		die_error1("--match and --regex require a regular file as input");
+	} else if (histogram) {
+		die_error1("--histogram requires a regular file as input");
+	} else if (arg_json) {
+		/* JSON needs whole lines */
+		if (convert_blocks(arg_file, convert_lines)) {
+			return EXIT_SUCCESS;
+		}
+		return EXIT_FAILURE;
+	} else if (convert_read(arg_file)) {
 		return EXIT_SUCCESS;
 	} else {
 		return EXIT_FAILURE;
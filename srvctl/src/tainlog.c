@@ -49,6 +49,7 @@ static int arg_bufsize = DEFAULT_BUFSIZE;
 static const char *arg_buffer = NULL;
 static int arg_filesize = DEFAULT_FILESIZE;
 static const char *arg_file = NULL;
+static const char *arg_clock = NULL;
 
 /* Bitmasks for command line parameters */
 enum {
@@ -59,7 +60,8 @@ enum {
 	cmd_user	= 1 << 4,
 	cmd_group	= 1 << 5,
 	cmd_buffer	= 1 << 6,
-	cmd_file	= 1 << 7
+	cmd_file	= 1 << 7,
+	cmd_clock	= 1 << 8
 };
 
 /* Command line parameters and arguments */
@@ -80,6 +82,8 @@ static ngim_cmdline_params_t logger_params[] = {
 	{ "-s",				cmd_file,		&arg_file },
 	{ "--line-buffer",	cmd_buffer,		&arg_buffer },
 	{ "-b",				cmd_buffer,		&arg_buffer },
+	{ "--clock",		cmd_clock,		&arg_clock },
+	{ "-c",				cmd_clock,		&arg_clock },
 	{ NULL,				0,				NULL }
 };
 static ngim_cmdline_args_t logger_args[] = {
@@ -89,7 +93,8 @@ static ngim_cmdline_args_t logger_args[] = {
 
 #define CMDLINE_USAGE \
 	"--help | [--user name] [--group name] [--keep num_files | --keep-all] " \
-	"[--logdir subdir] [--logsize file_bytes ] [--line-buffer size] directory"
+	"[--logdir subdir] [--logsize file_bytes ] [--line-buffer size] " \
+	"[--clock realtime | tai | coarse] directory"
 
 
 /* Validates command line. Present parameters are specified in selected.
@@ -180,6 +185,29 @@ static int validate_cmdline(const apr_uint32_t selected)
 		}
 	}
 
+	/* Clock for time stamps */
+	if (selected & cmd_clock) {
+		int source;
+
+		die_assert(arg_clock);
+
+		if (!strcmp(arg_clock, "realtime")) {
+			source = NGIM_CLOCK_REALTIME;
+		} else if (!strcmp(arg_clock, "tai")) {
+			source = NGIM_CLOCK_TAI;
+		} else if (!strcmp(arg_clock, "coarse")) {
+			source = NGIM_CLOCK_COARSE;
+		} else {
+			warn_error2("invalid clock: ", arg_clock);
+			return -1;
+		}
+
+		if (ngim_clock_select(source) != source) {
+			warn_error3("clock ", arg_clock,
+				" not available, using realtime");
+		}
+	}
+
 	return 0;
 }
 
@@ -346,7 +374,7 @@ static void close_tainlog(ngim_tain_t *stamp, apr_pool_t *pool)
 	 * written to the next log file. It is very unlikely that another file has
 	 * the same name, but if one does, we simply (try to) overwrite it */
 	
-	ngim_tain_format(name, stamp);
+	ngim_tain_encode(name, stamp);
 	name[NGIM_TAIN_FORMAT] = '\0';
 	
 	if (APR_FAIL(status, apr_file_rename(FILE_CURRENT, name, pool))) {
@@ -427,7 +455,7 @@ static inline void format_tainlog(char *buffer, apr_size_t *len,
 	die_assert(*len < arg_bufsize);
 	
 	/* Prepend the line with a timestamp */
-	ngim_tain_format(buffer, stamp);
+	ngim_tain_encode(buffer, stamp);
 
 	/* If the previous line was wrapped, indicate it with a tab as the
 	 * separator, otherwise use a space */
@@ -19,16 +19,26 @@
 PROG_MONITOR=monitor
 PROG_RUN=run
 PROG_LOG=log
+PROG_FAIL=fail
+PROG_CHECK=check
 
 DIR_ACTIVE=active
 DIR_ALL=all
 DIR_MONITOR=monitor
 FILE_UP=up
+FILE_RESTART=restart
+FILE_STOPSIGNALS=stopsignals
+FILE_STOPTIMEOUTS=stoptimeouts
+FILE_LOGPOLICY=logpolicy
+FILE_NOTIFY=notify
+FILE_CHECKPOLICY=checkpolicy
+FILE_SOCKETS=sockets
 PIPE_CONTROL=control
 PIPE_STDIN=stdin
 
-SLEEP_FOR_MONITOR=6		# Decreasing this may trigger the suspension timer
+SLEEP_FOR_MONITOR=6		# Must exceed the restart delay and stable time below
 SLEEP_FOR_SCANNER=10
+SLEEP_FOR_RESTART=0.5	# Less than the pause the monitor used to take
 KILL_TESTS=5
 
 
@@ -57,7 +67,8 @@ fi
 
 ## Test for required programs
 
-REQUIRED="which mktemp chmod touch cat sleep mkdir tail cmp cp rm grep ln"
+REQUIRED="which mktemp chmod touch cat sleep mkdir tail cmp cp rm grep ln \
+	bash kill wc"
 
 for p in `echo $REQUIRED`; do
 	which $p >/dev/null 2>&1
@@ -116,6 +127,9 @@ ln -s "$TEST_PROG_DIR/$PROG_RUN" "$TEST_DIR/$PROG_RUN"
 cat > "$TEST_DIR/$TEST_PROG_DIR/$PROG_LOG" <<-END
 	#!/bin/sh
 	echo \$\$ >> "$TEST_RSLT_DIR/$PROG_LOG.pids"
+	if [ -f "$TEST_RSLT_DIR/$PROG_LOG.hold" ]; then
+		exit 1
+	fi
 	exec cat >> "$TEST_RSLT_DIR/$PROG_LOG.stdout" 2>&1
 END
 
@@ -124,6 +138,22 @@ touch "$TEST_DIR/$TEST_RSLT_DIR/$PROG_LOG.pids"
 touch "$TEST_DIR/$TEST_RSLT_DIR/$PROG_LOG.stdout"
 ln -s "$TEST_PROG_DIR/$PROG_LOG" "$TEST_DIR/$PROG_LOG"
 
+# Replaces run when testing the restart delay
+cat > "$TEST_DIR/$TEST_PROG_DIR/$PROG_FAIL" <<-END
+	#!/bin/sh
+	echo \$\$ >> "$TEST_RSLT_DIR/$PROG_RUN.pids"
+	exit 1
+END
+
+chmod a+x "$TEST_DIR/$TEST_PROG_DIR/$PROG_FAIL"
+
+# Output of run is kept while log is down
+echo "spool 64" > "$TEST_DIR/$FILE_LOGPOLICY"
+
+# Children killed by the tests run long enough to count as a fresh start,
+# so that the restart delay doesn't grow
+echo "delay 1 stable 2" > "$TEST_DIR/$FILE_RESTART"
+
 
 ## Start the games
 
@@ -452,6 +482,307 @@ else
 fi
 
 
+## Make sure exits are noticed right away
+
+if [ $ERRORS -gt 0 ]; then
+	echo "$0: skipping reaping test due to detected problems"
+else
+	echo "$0: testing how soon $PROG_RUN is restarted"
+
+	PIDS_RUN[0]=`tail -n 1 "$TEST_DIR/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+
+	# It has run long enough to be started again without a delay
+	kill -KILL "${PIDS_RUN[0]}"
+	sleep $SLEEP_FOR_RESTART
+
+	PIDS_RUN[1]=`tail -n 1 "$TEST_DIR/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+
+	if [ "${PIDS_RUN[0]}" == "${PIDS_RUN[1]}" ]; then
+		echo "$0: problem: failed to restart $PROG_RUN in $SLEEP_FOR_RESTART seconds"
+		((ERRORS++));
+	fi
+
+	sleep $SLEEP_FOR_MONITOR
+fi
+
+
+## Test the stop sequence
+
+if [ $ERRORS -gt 0 ]; then
+	echo "$0: skipping stop sequence test due to detected problems"
+else
+	echo "$0: testing stop signals and timeouts"
+
+	# Both children ignore SIGCONT, and are killed a second later
+	echo "CONT KILL" > "$TEST_DIR/$FILE_STOPSIGNALS"
+	echo "1" > "$TEST_DIR/$FILE_STOPTIMEOUTS"
+
+	PIDS_RUN[0]=`tail -n 1 "$TEST_DIR/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+
+	echo -n 'k' > "$TEST_DIR/$DIR_MONITOR/$PIPE_CONTROL"
+	sleep $SLEEP_FOR_RESTART
+
+	if ! kill -0 "${PIDS_RUN[0]}" 2>/dev/null; then
+		echo "$0: problem: $PROG_RUN was stopped before the stop timeout"
+		((ERRORS++));
+	fi
+
+	sleep $SLEEP_FOR_MONITOR
+
+	PIDS_RUN[1]=`tail -n 1 "$TEST_DIR/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+
+	if kill -0 "${PIDS_RUN[0]}" 2>/dev/null ||
+		[ "${PIDS_RUN[0]}" == "${PIDS_RUN[1]}" ]; then
+		echo "$0: problem: failed to stop $PROG_RUN with the next signal"
+		((ERRORS++));
+	fi
+
+	rm -f "$TEST_DIR/$FILE_STOPSIGNALS" "$TEST_DIR/$FILE_STOPTIMEOUTS"
+fi
+
+
+## Test the restart delay
+
+if [ $ERRORS -gt 0 ]; then
+	echo "$0: skipping restart delay test due to detected problems"
+else
+	echo "$0: testing restart delays with $PROG_RUN failing"
+
+	STARTS[0]=`wc -l < "$TEST_DIR/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+
+	rm -f "$TEST_DIR/$PROG_RUN"
+	ln -s "$TEST_PROG_DIR/$PROG_FAIL" "$TEST_DIR/$PROG_RUN"
+	echo -n 'k' > "$TEST_DIR/$DIR_MONITOR/$PIPE_CONTROL"
+	sleep $SLEEP_FOR_MONITOR
+
+	STARTS[1]=`wc -l < "$TEST_DIR/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+	STARTS[2]=$((${STARTS[1]} - ${STARTS[0]}))
+
+	# Started right away, and then after delays of 1, 2 and 4 seconds
+	if [ ${STARTS[2]} -lt 2 -o ${STARTS[2]} -gt 4 ]; then
+		echo "$0: problem: started failing $PROG_RUN ${STARTS[2]} times in $SLEEP_FOR_MONITOR seconds"
+		((ERRORS++));
+	fi
+
+	# A request starts it without a delay
+	rm -f "$TEST_DIR/$PROG_RUN"
+	ln -s "$TEST_PROG_DIR/$PROG_RUN" "$TEST_DIR/$PROG_RUN"
+	echo -n 'k' > "$TEST_DIR/$DIR_MONITOR/$PIPE_CONTROL"
+	sleep $SLEEP_FOR_RESTART
+
+	PIDS_RUN[0]=`tail -n 1 "$TEST_DIR/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+
+	if ! kill -0 "${PIDS_RUN[0]}" 2>/dev/null; then
+		echo "$0: problem: failed to restart $PROG_RUN after command k"
+		((ERRORS++));
+	fi
+
+	sleep $SLEEP_FOR_MONITOR
+fi
+
+
+## Test spooling while log is down
+
+if [ $ERRORS -gt 0 ]; then
+	echo "$0: skipping spooling test due to detected problems"
+else
+	echo "$0: testing spooling with $PROG_LOG down"
+
+	PIDS_RUN[0]=`tail -n 1 "$TEST_DIR/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+	PIDS_LOG[0]=`tail -n 1 "$TEST_DIR/$TEST_RSLT_DIR/$PROG_LOG.pids"`
+
+	# Log fails to start until the file is removed
+	touch "$TEST_DIR/$TEST_RSLT_DIR/$PROG_LOG.hold"
+	kill -KILL "${PIDS_LOG[0]}"
+	sleep $SLEEP_FOR_RESTART
+
+	STR_TEST="$0: this is spooled while $PROG_LOG is down"
+	echo "$STR_TEST" > "$TEST_DIR/$DIR_MONITOR/$PIPE_STDIN"
+	sleep $SLEEP_FOR_RESTART
+
+	if grep "$STR_TEST" "$TEST_DIR/$TEST_RSLT_DIR/$PROG_LOG.stdout" \
+			>/dev/null 2>&1; then
+		echo "$0: problem: $PROG_LOG was not down when testing spooling"
+		((ERRORS++));
+	fi
+
+	rm -f "$TEST_DIR/$TEST_RSLT_DIR/$PROG_LOG.hold"
+	sleep $SLEEP_FOR_MONITOR
+
+	if ! grep "$STR_TEST" "$TEST_DIR/$TEST_RSLT_DIR/$PROG_LOG.stdout" \
+			>/dev/null 2>&1; then
+		echo "$0: problem: spooled output did not reach $PROG_LOG"
+		((ERRORS++));
+	fi
+
+	PIDS_RUN[1]=`tail -n 1 "$TEST_DIR/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+
+	if [ "${PIDS_RUN[0]}" != "${PIDS_RUN[1]}" ]; then
+		echo "$0: problem: restarted $PROG_RUN while $PROG_LOG was down"
+		((ERRORS++));
+	fi
+fi
+
+
+## Test readiness notification, health checks and passed sockets with
+## another service, as these are set up when the monitor starts
+
+if [ $ERRORS -gt 0 ]; then
+	echo "$0: skipping notification tests due to detected problems"
+else
+	echo "$0: creating a service with notification, checks and sockets"
+
+	TEST_DIR2=`mktemp -q -d -p "$DIR_ALL" service.XXXXXX`
+	TEST_NAME2="${TEST_DIR2##*/}"
+	TEST_PORT=$((20000 + $RANDOM % 20000))
+
+	mkdir "$TEST_DIR2/$TEST_PROG_DIR" "$TEST_DIR2/$TEST_RSLT_DIR" || exit 1
+
+	# Bash for the descriptor number, which may have more than one digit
+	cat > "$TEST_DIR2/$TEST_PROG_DIR/$PROG_RUN" <<-END
+		#!/bin/bash
+		echo \$\$ >> "$TEST_RSLT_DIR/$PROG_RUN.pids"
+		echo "\$SRVCTL_LISTEN_FDS" > "$TEST_RSLT_DIR/$PROG_RUN.listen"
+		if [ -f "$TEST_RSLT_DIR/$PROG_RUN.ready" ]; then
+			sleep 1
+			echo -n READY >&\$SRVCTL_NOTIFY_FD
+		fi
+		exec cat
+	END
+
+	cat > "$TEST_DIR2/$TEST_PROG_DIR/$PROG_CHECK" <<-END
+		#!/bin/sh
+		[ ! -f "$TEST_RSLT_DIR/$PROG_CHECK.fail" ]
+	END
+
+	chmod a+x "$TEST_DIR2/$TEST_PROG_DIR/$PROG_RUN" \
+		"$TEST_DIR2/$TEST_PROG_DIR/$PROG_CHECK"
+	touch "$TEST_DIR2/$TEST_RSLT_DIR/$PROG_RUN.pids"
+	touch "$TEST_DIR2/$TEST_RSLT_DIR/$PROG_RUN.ready"
+	ln -s "$TEST_PROG_DIR/$PROG_RUN" "$TEST_DIR2/$PROG_RUN"
+	ln -s "$TEST_PROG_DIR/$PROG_CHECK" "$TEST_DIR2/$PROG_CHECK"
+
+	echo "delay 1 stable 2" > "$TEST_DIR2/$FILE_RESTART"
+	echo "3" > "$TEST_DIR2/$FILE_NOTIFY"
+	echo "interval 1 timeout 1 failures 2" > "$TEST_DIR2/$FILE_CHECKPOLICY"
+	echo "tcp 127.0.0.1:$TEST_PORT overlap" > "$TEST_DIR2/$FILE_SOCKETS"
+
+	ln -s "../$TEST_DIR2" "$DIR_ACTIVE"
+	sleep $SLEEP_FOR_SCANNER
+	touch "$TEST_DIR2/$DIR_MONITOR/$FILE_UP"
+	echo -n 'k' > "$TEST_DIR2/$DIR_MONITOR/$PIPE_CONTROL"
+	sleep $SLEEP_FOR_MONITOR
+
+	PIDS_RUN[0]=`tail -n 1 "$TEST_DIR2/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+
+	if [ -z "${PIDS_RUN[0]}" ]; then
+		echo "$0: problem: failed to start $PROG_RUN with notification"
+		((ERRORS++));
+	elif ! grep "$TEST_NAME2: $PROG_RUN \[pid ${PIDS_RUN[0]}\] is ready" \
+			"$3" >/dev/null 2>&1; then
+		echo "$0: problem: $PROG_RUN [pid ${PIDS_RUN[0]}] did not become ready"
+		((ERRORS++));
+	fi
+
+	if [ ! -s "$TEST_DIR2/$TEST_RSLT_DIR/$PROG_RUN.listen" ] ||
+		! (exec 3<>"/dev/tcp/127.0.0.1/$TEST_PORT") 2>/dev/null; then
+		echo "$0: problem: failed to listen on 127.0.0.1:$TEST_PORT"
+		((ERRORS++));
+	fi
+fi
+
+if [ $ERRORS -gt 0 ]; then
+	echo "$0: skipping overlapping restart test due to detected problems"
+else
+	echo "$0: testing overlapping restarts"
+
+	PIDS_RUN[0]=`tail -n 1 "$TEST_DIR2/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+
+	# The old run is stopped only after the new one is ready
+	echo -n 'k' > "$TEST_DIR2/$DIR_MONITOR/$PIPE_CONTROL"
+	sleep $SLEEP_FOR_RESTART
+
+	PIDS_RUN[1]=`tail -n 1 "$TEST_DIR2/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+
+	if [ "${PIDS_RUN[0]}" == "${PIDS_RUN[1]}" ] ||
+		! kill -0 "${PIDS_RUN[0]}" 2>/dev/null; then
+		echo "$0: problem: $PROG_RUN was not replaced with an overlap"
+		((ERRORS++));
+	fi
+
+	sleep $SLEEP_FOR_MONITOR
+
+	if kill -0 "${PIDS_RUN[0]}" 2>/dev/null; then
+		echo "$0: problem: failed to stop the replaced $PROG_RUN"
+		((ERRORS++));
+	fi
+
+	if ! (exec 3<>"/dev/tcp/127.0.0.1/$TEST_PORT") 2>/dev/null; then
+		echo "$0: problem: stopped listening on 127.0.0.1:$TEST_PORT"
+		((ERRORS++));
+	fi
+fi
+
+if [ $ERRORS -gt 0 ]; then
+	echo "$0: skipping notification timeout test due to detected problems"
+else
+	echo "$0: testing $PROG_RUN not notifying in time"
+
+	PIDS_RUN[0]=`tail -n 1 "$TEST_DIR2/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+
+	rm -f "$TEST_DIR2/$TEST_RSLT_DIR/$PROG_RUN.ready"
+	kill -KILL "${PIDS_RUN[0]}"
+	sleep $SLEEP_FOR_MONITOR
+
+	if ! grep "$TEST_NAME2: $PROG_RUN did not notify it was ready in time" \
+			"$3" >/dev/null 2>&1; then
+		echo "$0: problem: $PROG_RUN was not stopped for not notifying"
+		((ERRORS++));
+	fi
+
+	# Ready again after the next delayed restart
+	touch "$TEST_DIR2/$TEST_RSLT_DIR/$PROG_RUN.ready"
+	sleep $SLEEP_FOR_MONITOR
+
+	PIDS_RUN[1]=`tail -n 1 "$TEST_DIR2/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+
+	if ! grep "$TEST_NAME2: $PROG_RUN \[pid ${PIDS_RUN[1]}\] is ready" \
+			"$3" >/dev/null 2>&1; then
+		echo "$0: problem: $PROG_RUN [pid ${PIDS_RUN[1]}] did not become ready"
+		((ERRORS++));
+	fi
+fi
+
+if [ $ERRORS -gt 0 ]; then
+	echo "$0: skipping health check test due to detected problems"
+else
+	echo "$0: testing a failing health check"
+
+	PIDS_RUN[0]=`tail -n 1 "$TEST_DIR2/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+
+	touch "$TEST_DIR2/$TEST_RSLT_DIR/$PROG_CHECK.fail"
+	sleep $SLEEP_FOR_MONITOR
+	rm -f "$TEST_DIR2/$TEST_RSLT_DIR/$PROG_CHECK.fail"
+
+	PIDS_RUN[1]=`tail -n 1 "$TEST_DIR2/$TEST_RSLT_DIR/$PROG_RUN.pids"`
+
+	if [ "${PIDS_RUN[0]}" == "${PIDS_RUN[1]}" ] ||
+		! grep "$TEST_NAME2: $PROG_RUN failed its health checks" "$3" \
+			>/dev/null 2>&1; then
+		echo "$0: problem: failed to restart $PROG_RUN after failed checks"
+		((ERRORS++));
+	fi
+fi
+
+if [ -n "$TEST_DIR2" ]; then
+	echo "$0: shutting down the service with notification"
+	rm -f "$DIR_ACTIVE/$TEST_NAME2"
+	echo -n 'x' > "$TEST_DIR2/$DIR_MONITOR/$PIPE_CONTROL"
+	sleep $SLEEP_FOR_MONITOR
+	rm -rf "$TEST_DIR2"
+fi
+
+
 ## Clean up
 
 echo "$0: shutting down service and monitor"
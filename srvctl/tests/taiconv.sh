@@ -32,7 +32,7 @@ fi
 
 ## Test for required programs
 
-REQUIRED="cat cmp pwd rm"
+REQUIRED="cat cmp head kill mktemp mv pwd rm sleep tail"
 
 for p in `echo $REQUIRED`; do
 	which $p >/dev/null 2>&1
@@ -46,25 +46,183 @@ done
 
 ## Get full directory paths
 
+TEST_DIR="`pwd -P`"
 cd "$1"
 PROG_DIR="`pwd -P`"
 
 ## Create a temporary directory
 
+TEMP_DIR="`mktemp -d`"
+
+if [ $? -ne 0 ]; then
+	echo "$0: failed to create a temporary directory"
+	exit 1
+fi
 
 ## Start the games
 
 ERRORS=0
 
+# Compares the output of taiconv for a test file to known results. Runs in
+# the test directory, so that merged lines are prefixed with relative names.
+test_file()
+{
+	NAME="$1"
+	shift
+
+	(cd "$TEST_DIR" && "$PROG_DIR/$PROG_TAICONV" "$@" "$NAME") | \
+		cmp -s - "$TEST_DIR/$NAME.results"
+
+	if [ $? -ne 0 ]; then
+		echo "$0: conversion of $NAME failed with parameters $*"
+		ERRORS=$(($ERRORS + 1))
+	fi
+}
+
+test_pipe()
+{
+	NAME="$1"
+	shift
+
+	cat "$TEST_DIR/$NAME" | "$PROG_DIR/$PROG_TAICONV" "$@" | \
+		cmp -s - "$TEST_DIR/$NAME.results"
+
+	if [ $? -ne 0 ]; then
+		echo "$0: conversion of piped $NAME failed with parameters $*"
+		ERRORS=$(($ERRORS + 1))
+	fi
+}
+
 
 ## Run conversion tests for file input
 
+test_file taiconv.testall --utc --all
+test_file taiconv.testnrm --utc
+test_file taiconv.testrange --utc --since @4000000042ac1736 \
+	--until "2005-06-12 11:06:22Z"
+test_file taiconv.testrange --utc --since @4000000042ac1736 \
+	--until "2005-06-12 13:06:22+02:00"
+test_file taiconv.testrange --utc --since @4000000042ac1736 \
+	--until "2005-06-12T08:36:22-0230"
+
+# Offsets beyond any time zone are rejected
+if "$PROG_DIR/$PROG_TAICONV" --utc --until "2005-06-12 13:06:22+99:99" \
+		"$TEST_DIR/taiconv.testrange" >/dev/null 2>&1; then
+	echo "$0: an invalid offset from UTC was accepted"
+	ERRORS=$(($ERRORS + 1))
+fi
+
+test_file taiconv.testmatch --utc --match disk --regex "^ (warning|error):"
+test_file taiconv.testhist --utc --histogram 1m --match error:
+test_file taiconv.testreverse --utc --reverse
+test_file taiconv.testjson --utc --format json
+test_file taiconv.testepoch --format epoch
+test_file taiconv.testmerge --utc --until @4000000042ac1739 \
+	--merge taiconv.testmerge.other
+
 
 ## Run conversion tests for pipe input
 
+test_pipe taiconv.testall --utc --all
+test_pipe taiconv.testnrm --utc
+test_pipe taiconv.testreverse --utc --reverse
+test_pipe taiconv.testjson --utc --format json
+test_pipe taiconv.testepoch --format epoch
+
+
+## Run tests for reading with a cursor
+
+# The range test file split into an archived log file and current
+mkdir "$TEMP_DIR/log"
+head -n 3 "$TEST_DIR/taiconv.testrange" > \
+	"$TEMP_DIR/log/@4000000042ac17372a3248c4"
+tail -n +4 "$TEST_DIR/taiconv.testrange" > "$TEMP_DIR/log/current"
+
+test_cursor()
+{
+	DESC="$1"
+
+	"$PROG_DIR/$PROG_TAICONV" --utc --cursor "$TEMP_DIR/cursor" \
+		"$TEMP_DIR/log" | cmp -s - "$TEMP_DIR/expected"
+
+	if [ $? -ne 0 ]; then
+		echo "$0: reading with a cursor failed for $DESC"
+		ERRORS=$(($ERRORS + 1))
+	fi
+}
+
+"$PROG_DIR/$PROG_TAICONV" --utc "$TEST_DIR/taiconv.testrange" > \
+	"$TEMP_DIR/expected"
+test_cursor "the first run"
+
+: > "$TEMP_DIR/expected"
+test_cursor "a run without new lines"
+
+echo "@4000000042ac173a2a3248c4 sixth" >> "$TEMP_DIR/log/current"
+echo "2005-06-12 11:06:24.707939Z sixth" > "$TEMP_DIR/expected"
+test_cursor "a new line"
+
+# tainlog writes a line, archives current and starts a new one, whose
+# first line has the stamp it archived the old one with
+echo "@4000000042ac173b2a3248c4 seventh" >> "$TEMP_DIR/log/current"
+mv "$TEMP_DIR/log/current" "$TEMP_DIR/log/@4000000042ac173c2a3248c4"
+echo "@4000000042ac173c2a3248c4 eighth" > "$TEMP_DIR/log/current"
+cat > "$TEMP_DIR/expected" <<-END
+	2005-06-12 11:06:25.707939Z seventh
+	2005-06-12 11:06:26.707939Z eighth
+END
+test_cursor "a rotation"
+
+: > "$TEMP_DIR/expected"
+test_cursor "a run without new lines after a rotation"
+
+
+## Run tests for following a log directory
+
+mkdir "$TEMP_DIR/follow"
+echo "@4000000042ac17352a3248c4 before" > "$TEMP_DIR/follow/current"
+
+"$PROG_DIR/$PROG_TAICONV" --utc --follow "$TEMP_DIR/follow" > \
+	"$TEMP_DIR/followed" &
+FOLLOW_PID=$!
+sleep 1
+
+# Lines written before following are skipped, lines appended are not
+echo "@4000000042ac17362a3248c4 appended" >> "$TEMP_DIR/follow/current"
+sleep 1
+
+# Rotate as tainlog does, with a line written just before archiving
+echo "@4000000042ac17372a3248c4 archived" >> "$TEMP_DIR/follow/current"
+mv "$TEMP_DIR/follow/current" "$TEMP_DIR/follow/@4000000042ac17382a3248c4"
+echo "@4000000042ac17382a3248c4 rotated" > "$TEMP_DIR/follow/current"
+sleep 1
+
+echo "@4000000042ac17392a3248c4 appended after rotation" >> \
+	"$TEMP_DIR/follow/current"
+sleep 1
+
+kill $FOLLOW_PID
+wait $FOLLOW_PID 2>/dev/null
+
+cat > "$TEMP_DIR/expected" <<-END
+	2005-06-12 11:06:20.707939Z appended
+	2005-06-12 11:06:21.707939Z archived
+	2005-06-12 11:06:22.707939Z rotated
+	2005-06-12 11:06:23.707939Z appended after rotation
+END
+
+cmp -s "$TEMP_DIR/followed" "$TEMP_DIR/expected"
+
+if [ $? -ne 0 ]; then
+	echo "$0: following failed for appends and a rotation"
+	ERRORS=$(($ERRORS + 1))
+fi
+
 
 ## Clean up
 
+rm -rf "$TEMP_DIR"
+
 if [ $ERRORS -gt 0 ]; then
 	echo "$0: detected $ERRORS problems"
 else